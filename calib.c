@@ -0,0 +1,208 @@
+/*
+ *    Filename: calib.c
+ * Description: Charge time to lux calibration through a lookup table.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "utils.h"
+#include "calib.h"
+
+struct calib_point_t
+{
+    double log_ms;
+    double log_lux;
+};
+
+
+static int calib_point_cmp(const void *a, const void *b)
+{
+    double diff = ((const struct calib_point_t *)a)->log_ms - ((const struct calib_point_t *)b)->log_ms;
+    return (diff > 0) - (diff < 0);
+}
+
+
+static double calib_interpolate(const struct calib_point_t *points, int num_points, double log_ms)
+{
+    int i;
+
+    // the segment containing log_ms, or the end segment beyond the points
+    for (i = 1; i < num_points - 1; i++) {
+        if (log_ms < points[i].log_ms)
+            break;
+    }
+    return points[i - 1].log_lux + (log_ms - points[i - 1].log_ms) *
+           (points[i].log_lux - points[i - 1].log_lux) / (points[i].log_ms - points[i - 1].log_ms);
+}
+
+
+int calib_load(struct calib_t *calib, const char *path)
+{
+    struct calib_point_t points[CALIB_MAX_POINTS];
+    double model_k = 0;
+    double model_gamma = 0;
+    char line[256];
+    int line_no = 0;
+    FILE *fp;
+    int i;
+
+    memset(calib, 0, sizeof(struct calib_t));
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        LOG_ERROR("Error: failed to open calibration file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char *comment = strchr(line, '#');
+        double ms, lux;
+        char extra;
+
+        line_no++;
+        if (comment)
+            *comment = 0;
+        if (strspn(line, " \t\r\n") == strlen(line))
+            continue;
+        if (sscanf(line, " model %lf %lf %c", &model_k, &model_gamma, &extra) == 2) {
+            if ((model_k <= 0) || (model_gamma <= 0))
+                break;
+            calib->model = 1;
+        } else if ((sscanf(line, "%lf %lf %c", &ms, &lux, &extra) == 2) && (ms > 0) && (lux > 0)) {
+            if (calib->num_points == CALIB_MAX_POINTS) {
+                LOG_ERROR("Error: %s: more than %d points\n", path, CALIB_MAX_POINTS);
+                fclose(fp);
+                return -1;
+            }
+            points[calib->num_points].log_ms = log(ms);
+            points[calib->num_points].log_lux = log(lux);
+            calib->num_points++;
+        } else {
+            break;
+        }
+    }
+    if (!feof(fp)) {
+        LOG_ERROR("Error: %s:%d: expected '<ms> <lux>' or 'model <k> <gamma>'\n", path, line_no);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    if (calib->model && calib->num_points) {
+        LOG_ERROR("Error: %s: use either points or a model\n", path);
+        return -1;
+    }
+    if (!calib->model) {
+        if (calib->num_points < 2) {
+            LOG_ERROR("Error: %s: at least two points are needed\n", path);
+            return -1;
+        }
+        qsort(points, calib->num_points, sizeof(struct calib_point_t), calib_point_cmp);
+        // darker is always a longer charge time, the inverse depends on it
+        for (i = 1; i < calib->num_points; i++) {
+            if ((points[i].log_ms == points[i - 1].log_ms) ||
+                (points[i].log_lux >= points[i - 1].log_lux)) {
+                LOG_ERROR("Error: %s: lux must fall as the charge time grows\n", path);
+                return -1;
+            }
+        }
+    }
+
+    for (i = 0; i < CALIB_TABLE_SIZE; i++) {
+        // the middle of the bucket, in ms
+        double ms = (loglin_bucket_min(i, CALIB_SUB_BITS) +
+                     loglin_bucket_min(i + 1, CALIB_SUB_BITS)) / 2000.0;
+        if (ms <= 0)
+            ms = 0.0005;
+        if (calib->model)
+            calib->lux[i] = (float)pow(model_k / ms, 1.0 / model_gamma);
+        else
+            calib->lux[i] = (float)exp(calib_interpolate(points, calib->num_points, log(ms)));
+    }
+    return 0;
+}
+
+
+float calib_lux(const struct calib_t *calib, uint32_t duration_us)
+{
+    return calib->lux[loglin_bucket(duration_us, CALIB_SUB_BITS, CALIB_MAX_BITS)];
+}
+
+
+int calib_duration_us(const struct calib_t *calib, double lux, uint32_t *duration_us)
+{
+    int i;
+
+    for (i = 0; i < CALIB_TABLE_SIZE; i++) {
+        if (calib->lux[i] <= lux) {
+            *duration_us = (uint32_t)loglin_bucket_min(i, CALIB_SUB_BITS);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+void calib_capture_start(struct calib_capture_t *capture, double lux, int samples)
+{
+    if (samples > CALIB_MAX_CAPTURE)
+        samples = CALIB_MAX_CAPTURE;
+    capture->lux = lux;
+    capture->count = 0;
+    capture->wanted = samples;
+}
+
+
+static int calib_uint32_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+int calib_capture_add(struct calib_capture_t *capture, uint32_t duration_us,
+                      const char *path, int gpio)
+{
+    uint32_t median;
+    FILE *fp;
+
+    if (capture->count >= capture->wanted)
+        return 0;
+    capture->samples[capture->count++] = duration_us;
+    if (capture->count < capture->wanted)
+        return 0;
+
+    qsort(capture->samples, capture->count, sizeof(uint32_t), calib_uint32_cmp);
+    median = capture->samples[capture->count / 2];
+    fp = fopen(path, "a");
+    if (fp == NULL) {
+        LOG_ERROR("Error: failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // the line is a calibration point as it is
+    fprintf(fp, "%u.%03u %g # gpio %d, median of %d, range %u.%03u-%u.%03u ms\n",
+            median / 1000, median % 1000, capture->lux, gpio, capture->count,
+            capture->samples[0] / 1000, capture->samples[0] % 1000,
+            capture->samples[capture->count - 1] / 1000, capture->samples[capture->count - 1] % 1000);
+    if (fclose(fp)) {
+        LOG_ERROR("Error: failed to write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    LOG_INFO("LDR %d calibration point %u.%03u ms at %g lux\n", gpio,
+             median / 1000, median % 1000, capture->lux);
+    return 1;
+}
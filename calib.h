@@ -0,0 +1,67 @@
+/*
+ *    Filename: calib.h
+ * Description: Charge time to lux calibration through a lookup table.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _CALIB_H_
+#define _CALIB_H_
+
+#include <stdint.h>
+
+#include "utils.h"
+
+// The table has one entry per log-linear bucket of the charge time, see
+// loglin_bucket(), so a conversion is a bucket index and a load.
+#define CALIB_SUB_BITS          5
+#define CALIB_MAX_BITS          30      // charge times in us, clamped
+#define CALIB_TABLE_SIZE        LOGLIN_BUCKETS(CALIB_SUB_BITS, CALIB_MAX_BITS)
+#define CALIB_MAX_POINTS        64
+#define CALIB_MAX_CAPTURE       64
+#define CALIB_DEFAULT_CAPTURE   8
+
+// Calibration file, one entry per line, '#' starts a comment:
+//   <charge time ms> <lux>     measured point, at least two. Between
+//                              points lux is interpolated on a log-log
+//                              scale, beyond them the end segments are
+//                              extended.
+//   model <k> <gamma>          LDR resistance fit, lux = (k / ms)^(1 / gamma)
+struct calib_t
+{
+    float lux[CALIB_TABLE_SIZE];
+    int num_points;
+    unsigned char model;
+};
+
+// Pairs charge times with a reference reading, for the calibration file.
+struct calib_capture_t
+{
+    double lux;
+    uint32_t samples[CALIB_MAX_CAPTURE];
+    int count;
+    int wanted;
+};
+
+
+int calib_load(struct calib_t *calib, const char *path);
+float calib_lux(const struct calib_t *calib, uint32_t duration_us);
+// the shortest charge time that reads lux or darker
+int calib_duration_us(const struct calib_t *calib, double lux, uint32_t *duration_us);
+
+void calib_capture_start(struct calib_capture_t *capture, double lux, int samples);
+// returns 1 once the capture is complete and appended to path, -1 if error
+int calib_capture_add(struct calib_capture_t *capture, uint32_t duration_us,
+                      const char *path, int gpio);
+
+
+#endif // _CALIB_H_
@@ -0,0 +1,335 @@
+/*
+ *    Filename: coproc.c
+ * Description: Long-lived handler process fed line-delimited events.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+
+#include "utils.h"
+#include "coproc.h"
+
+extern char **environ;
+
+
+static void coproc_timer_cb(void *priv_data, uint32_t events);
+static void coproc_in_cb(void *priv_data, uint32_t events);
+static void coproc_out_cb(void *priv_data, uint32_t events);
+
+
+// close-on-exec pipe, the spawn file actions dup the child's ends over
+// stdin and stdout
+static int coproc_pipe(int fds[2])
+{
+    if (pipe(fds)) {
+        LOG_ERROR("Error: failed to create pipe: %s\n", strerror(errno));
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+
+static int coproc_start(struct coproc_t *coproc)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    sigset_t defaults;
+    int pipe_in[2];
+    int pipe_out[2];
+    int ret;
+
+    if (coproc_pipe(pipe_in))
+        return -1;
+    if (coproc_pipe(pipe_out)) {
+        close(pipe_in[0]);
+        close(pipe_in[1]);
+        return -1;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipe_in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, pipe_out[1], STDOUT_FILENO);
+    // same as the action commands: no blocked signals, SIGPIPE back to
+    // default, and its own process group
+    posix_spawnattr_init(&attr);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF |
+                             POSIX_SPAWN_SETPGROUP);
+
+    ret = posix_spawn(&(coproc->pid), coproc->argv[0], &actions, &attr, coproc->argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipe_in[0]);
+    close(pipe_out[1]);
+    if (ret) {
+        LOG_ERROR("Error: failed to start handler %s: %s\n", coproc->name, strerror(ret));
+        coproc->pid = 0;
+        close(pipe_in[1]);
+        close(pipe_out[0]);
+        return -1;
+    }
+
+    fcntl(pipe_in[1], F_SETFL, O_NONBLOCK);
+    fcntl(pipe_out[0], F_SETFL, O_NONBLOCK);
+    // stdin is only polled for EPOLLOUT while there is a backlog
+    if (loop_add(coproc->loop, &(coproc->src_in), pipe_in[1], 0, coproc_in_cb, coproc))
+        close(pipe_in[1]);
+    if (loop_add(coproc->loop, &(coproc->src_out), pipe_out[0], EPOLLIN, coproc_out_cb, coproc))
+        close(pipe_out[0]);
+    coproc->writing = 0;
+    coproc->reply_len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &(coproc->start_time));
+    LOG_INFO("Started handler %s, pid %d\n", coproc->name, (int)coproc->pid);
+    return 0;
+}
+
+
+// the handler is gone or unusable, close it down and schedule a restart
+static void coproc_stop(struct coproc_t *coproc)
+{
+    struct timespec now;
+    int64_t ran_ms;
+    unsigned int delay_ms;
+
+    if ((coproc->src_in.fd < 0) && (coproc->src_out.fd < 0))
+        return;
+    loop_source_close(coproc->loop, &(coproc->src_in));
+    loop_source_close(coproc->loop, &(coproc->src_out));
+    if (coproc->pid > 0)
+        kill(-coproc->pid, SIGTERM);
+    if (coproc->buf_len)
+        LOG_ERROR("Error: handler %s stopped with %zu bytes unsent\n", coproc->name, coproc->buf_len);
+    coproc->buf_len = 0;
+    coproc->writing = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ran_ms = timespec_diff_ms(&now, &(coproc->start_time));
+    if (ran_ms >= COPROC_STABLE_MS)
+        coproc->backoff_ms = COPROC_MIN_BACKOFF_MS;
+    delay_ms = coproc->backoff_ms;
+    coproc->backoff_ms *= 2;
+    if (coproc->backoff_ms > COPROC_MAX_BACKOFF_MS)
+        coproc->backoff_ms = COPROC_MAX_BACKOFF_MS;
+    LOG_INFO("Restarting handler %s in %u ms\n", coproc->name, delay_ms);
+    loop_timer_arm_us(&(coproc->timer), (uint64_t)delay_ms * 1000);
+}
+
+
+static void coproc_timer_cb(void *priv_data, uint32_t events)
+{
+    struct coproc_t *coproc = (struct coproc_t *)priv_data;
+    int status;
+
+    loop_timer_ack(&(coproc->timer));
+    // the old one closed its pipes but is still running
+    if (coproc->pid > 0) {
+        kill(-coproc->pid, SIGKILL);
+        if (waitpid(coproc->pid, &status, WNOHANG) != coproc->pid) {
+            loop_timer_arm_us(&(coproc->timer), COPROC_MIN_BACKOFF_MS * 1000);
+            return;
+        }
+        coproc->pid = 0;
+    }
+    coproc->restarts++;
+    if (coproc_start(coproc)) {
+        clock_gettime(CLOCK_MONOTONIC, &(coproc->start_time));
+        loop_timer_arm_us(&(coproc->timer), (uint64_t)coproc->backoff_ms * 1000);
+        coproc->backoff_ms *= 2;
+        if (coproc->backoff_ms > COPROC_MAX_BACKOFF_MS)
+            coproc->backoff_ms = COPROC_MAX_BACKOFF_MS;
+    }
+}
+
+
+// writes as much of the backlog as the pipe takes without blocking
+static int coproc_flush(struct coproc_t *coproc)
+{
+    ssize_t len;
+
+    while (coproc->buf_len > 0) {
+        len = write(coproc->src_in.fd, coproc->buf, coproc->buf_len);
+        if (len > 0) {
+            coproc->buf_len -= len;
+            memmove(coproc->buf, coproc->buf + len, coproc->buf_len);
+        } else if (errno == EAGAIN) {
+            if (!coproc->writing && (loop_modify(coproc->loop, &(coproc->src_in), EPOLLOUT) == 0))
+                coproc->writing = 1;
+            return 0;
+        } else if (errno != EINTR) {
+            LOG_ERROR("Error: failed to write to handler %s: %s\n", coproc->name, strerror(errno));
+            coproc_stop(coproc);
+            return -1;
+        }
+    }
+    if (coproc->writing && (loop_modify(coproc->loop, &(coproc->src_in), 0) == 0))
+        coproc->writing = 0;
+    return 0;
+}
+
+
+static void coproc_in_cb(void *priv_data, uint32_t events)
+{
+    struct coproc_t *coproc = (struct coproc_t *)priv_data;
+
+    if (coproc->src_in.fd < 0)
+        return;
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        coproc_stop(coproc);
+        return;
+    }
+    coproc_flush(coproc);
+}
+
+
+static void coproc_out_cb(void *priv_data, uint32_t events)
+{
+    struct coproc_t *coproc = (struct coproc_t *)priv_data;
+    ssize_t len;
+    size_t start, i;
+
+    if (coproc->src_out.fd < 0)
+        return;
+    for (;;) {
+        len = read(coproc->src_out.fd, coproc->reply + coproc->reply_len,
+                   sizeof(coproc->reply) - 1 - coproc->reply_len);
+        if (len == 0) {
+            coproc_stop(coproc);
+            return;
+        }
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                LOG_ERROR("Error: failed to read from handler %s: %s\n", coproc->name, strerror(errno));
+                coproc_stop(coproc);
+            }
+            return;
+        }
+        coproc->reply_len += len;
+
+        // log every complete line, an over-long line is logged in pieces
+        start = 0;
+        for (i = 0; i < coproc->reply_len; i++) {
+            if (coproc->reply[i] == '\n') {
+                coproc->reply[i] = 0;
+                LOG_INFO("%s: %s\n", coproc->name, coproc->reply + start);
+                coproc->replies++;
+                start = i + 1;
+            }
+        }
+        if ((start == 0) && (coproc->reply_len == sizeof(coproc->reply) - 1)) {
+            coproc->reply[coproc->reply_len] = 0;
+            LOG_INFO("%s: %s\n", coproc->name, coproc->reply);
+            start = coproc->reply_len;
+        }
+        coproc->reply_len -= start;
+        memmove(coproc->reply, coproc->reply + start, coproc->reply_len);
+    }
+}
+
+
+int coproc_init(struct coproc_t *coproc, struct loop_t *loop,
+                const char *name, char *const *argv)
+{
+    memset(coproc, 0, sizeof(struct coproc_t));
+    coproc->loop = loop;
+    coproc->name = name;
+    coproc->argv = argv;
+    coproc->src_in.fd = -1;
+    coproc->src_out.fd = -1;
+    coproc->backoff_ms = COPROC_MIN_BACKOFF_MS;
+    if (loop_timer_init(loop, &(coproc->timer), coproc_timer_cb, coproc))
+        return -1;
+    return coproc_start(coproc);
+}
+
+
+int coproc_send(struct coproc_t *coproc, const char *line, size_t len, int droppable)
+{
+    // samples only get half the buffer, so a stalled handler still
+    // receives the transitions
+    size_t limit = droppable ? sizeof(coproc->buf) / 2 : sizeof(coproc->buf);
+
+    if ((coproc->src_in.fd < 0) || (coproc->buf_len + len > limit)) {
+        if (droppable) {
+            coproc->dropped_samples++;
+        } else {
+            coproc->dropped_events++;
+            LOG_ERROR("Error: handler %s is not keeping up, event dropped\n", coproc->name);
+        }
+        return -1;
+    }
+    memcpy(coproc->buf + coproc->buf_len, line, len);
+    coproc->buf_len += len;
+    coproc->sent++;
+    if (!coproc->writing)
+        return coproc_flush(coproc);
+    return 0;
+}
+
+
+// called on SIGCHLD
+void coproc_reap(struct coproc_t *coproc)
+{
+    int status;
+
+    if ((coproc->pid <= 0) || (waitpid(coproc->pid, &status, WNOHANG) != coproc->pid))
+        return;
+    if (WIFEXITED(status))
+        LOG_INFO("Handler %s, pid %d, exited with status %d\n", coproc->name, (int)coproc->pid, WEXITSTATUS(status));
+    else if (WIFSIGNALED(status))
+        LOG_INFO("Handler %s, pid %d, killed by signal %d\n", coproc->name, (int)coproc->pid, WTERMSIG(status));
+    coproc->pid = 0;
+    coproc_stop(coproc);
+}
+
+
+void coproc_print_stats(const struct coproc_t *coproc, FILE *stream)
+{
+    fprintf(stream, "Handler %s: pid %d, sent %llu, replies %llu, buffered %zu bytes\n",
+            coproc->name, (int)coproc->pid, (unsigned long long)coproc->sent,
+            (unsigned long long)coproc->replies, coproc->buf_len);
+    fprintf(stream, "Handler %s: dropped samples %llu, dropped events %llu, restarts %llu\n",
+            coproc->name, (unsigned long long)coproc->dropped_samples,
+            (unsigned long long)coproc->dropped_events, (unsigned long long)coproc->restarts);
+}
+
+
+// closing stdin lets the handler finish on its own, SIGTERM makes sure
+void coproc_cleanup(struct coproc_t *coproc)
+{
+    if (coproc->loop == NULL)
+        return;
+    loop_source_close(coproc->loop, &(coproc->src_in));
+    loop_source_close(coproc->loop, &(coproc->src_out));
+    loop_source_close(coproc->loop, &(coproc->timer));
+    if (coproc->pid > 0)
+        kill(-coproc->pid, SIGTERM);
+}
@@ -0,0 +1,76 @@
+/*
+ *    Filename: coproc.h
+ * Description: Long-lived handler process fed line-delimited events.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _COPROC_H_
+#define _COPROC_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "loop.h"
+
+#define COPROC_BUFFER_SIZE          65536
+#define COPROC_LINE_MAX             1024
+#define COPROC_MIN_BACKOFF_MS       100
+#define COPROC_MAX_BACKOFF_MS       30000
+// a handler that ran this long gets restarted without delay
+#define COPROC_STABLE_MS            10000
+
+
+// One handler process, started at launch and kept running. Events are
+// written to its stdin as lines, and lines it prints on stdout are
+// logged. Writes never block: output is buffered, and while the
+// handler is not keeping up samples are dropped first, transitions
+// only once the buffer is full. The handler is restarted with
+// exponential backoff whenever it exits.
+struct coproc_t
+{
+    struct loop_t *loop;
+    struct loop_source_t src_in;        // handler stdin
+    struct loop_source_t src_out;       // handler stdout
+    struct loop_source_t timer;         // restart backoff
+    const char *name;
+    char *const *argv;
+    pid_t pid;
+    struct timespec start_time;
+    unsigned int backoff_ms;
+    unsigned char writing;
+
+    char buf[COPROC_BUFFER_SIZE];
+    size_t buf_len;
+    char reply[COPROC_LINE_MAX];
+    size_t reply_len;
+
+    uint64_t sent;
+    uint64_t replies;
+    uint64_t dropped_samples;
+    uint64_t dropped_events;
+    uint64_t restarts;
+};
+
+
+int coproc_init(struct coproc_t *coproc, struct loop_t *loop,
+                const char *name, char *const *argv);
+// droppable lines are the first to go when the handler falls behind.
+// returns -1 if the line was dropped.
+int coproc_send(struct coproc_t *coproc, const char *line, size_t len, int droppable);
+void coproc_reap(struct coproc_t *coproc);
+void coproc_print_stats(const struct coproc_t *coproc, FILE *stream);
+void coproc_cleanup(struct coproc_t *coproc);
+
+
+#endif // _COPROC_H_
@@ -0,0 +1,314 @@
+/*
+ *    Filename: ctl.c
+ * Description: Unix domain control and subscription socket.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "utils.h"
+#include "ctl.h"
+
+
+static void ctl_client_close(struct ctl_client_t *client)
+{
+    struct ctl_t *ctl = client->ctl;
+
+    if (client->subscribed & CTL_SUB_TRANSITIONS)
+        ctl->num_subscribers[CTL_SUB_TRANSITIONS]--;
+    if (client->subscribed & CTL_SUB_SAMPLES)
+        ctl->num_subscribers[CTL_SUB_SAMPLES]--;
+    client->subscribed = 0;
+    client->writing = 0;
+    client->in_len = 0;
+    client->out_len = 0;
+    loop_source_close(ctl->loop, &(client->src));
+}
+
+
+static int ctl_client_flush(struct ctl_client_t *client)
+{
+    ssize_t len;
+
+    while (client->out_len > 0) {
+        // a client that went away must not take us with it
+        len = send(client->src.fd, client->out, client->out_len, MSG_NOSIGNAL);
+        if (len > 0) {
+            client->out_len -= len;
+            memmove(client->out, client->out + len, client->out_len);
+        } else if (errno == EAGAIN) {
+            if (!client->writing &&
+                (loop_modify(client->ctl->loop, &(client->src), EPOLLIN | EPOLLOUT) == 0))
+                client->writing = 1;
+            return 0;
+        } else if (errno != EINTR) {
+            ctl_client_close(client);
+            return -1;
+        }
+    }
+    if (client->writing && (loop_modify(client->ctl->loop, &(client->src), EPOLLIN) == 0))
+        client->writing = 0;
+    return 0;
+}
+
+
+// queues data for the client, a client that can't take it is dropped
+static int ctl_client_write(struct ctl_client_t *client, const char *data, size_t len)
+{
+    if (client->src.fd < 0)
+        return -1;
+    if (client->out_len + len > sizeof(client->out)) {
+        LOG_VERBOSE("Control client %d is not reading, disconnecting\n", client->src.fd);
+        client->ctl->dropped_clients++;
+        ctl_client_close(client);
+        return -1;
+    }
+    memcpy(client->out + client->out_len, data, len);
+    client->out_len += len;
+    if (!client->writing)
+        return ctl_client_flush(client);
+    return 0;
+}
+
+
+int ctl_reply(struct ctl_client_t *client, const char *fmt, ...)
+{
+    char line[CTL_BUFFER_SIZE];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return -1;
+    if (len > (int)sizeof(line) - 2)
+        len = sizeof(line) - 2;
+    line[len++] = '\n';
+    return ctl_client_write(client, line, len);
+}
+
+
+static void ctl_subscribe(struct ctl_client_t *client, unsigned char subscribed)
+{
+    struct ctl_t *ctl = client->ctl;
+
+    if (client->subscribed & CTL_SUB_TRANSITIONS)
+        ctl->num_subscribers[CTL_SUB_TRANSITIONS]--;
+    if (client->subscribed & CTL_SUB_SAMPLES)
+        ctl->num_subscribers[CTL_SUB_SAMPLES]--;
+    client->subscribed = subscribed;
+    if (client->subscribed & CTL_SUB_TRANSITIONS)
+        ctl->num_subscribers[CTL_SUB_TRANSITIONS]++;
+    if (client->subscribed & CTL_SUB_SAMPLES)
+        ctl->num_subscribers[CTL_SUB_SAMPLES]++;
+    ctl_reply(client, "{\"ok\":true}");
+}
+
+
+static void ctl_handle_line(struct ctl_client_t *client, char *line)
+{
+    if (strcmp(line, "subscribe") == 0)
+        ctl_subscribe(client, CTL_SUB_TRANSITIONS);
+    else if (strcmp(line, "subscribe samples") == 0)
+        ctl_subscribe(client, CTL_SUB_TRANSITIONS | CTL_SUB_SAMPLES);
+    else if (strcmp(line, "unsubscribe") == 0)
+        ctl_subscribe(client, 0);
+    else if (line[0])
+        client->ctl->cb(client->ctl->priv_data, client, line);
+}
+
+
+static void ctl_client_cb(void *priv_data, uint32_t events)
+{
+    struct ctl_client_t *client = (struct ctl_client_t *)priv_data;
+    ssize_t len;
+    size_t start, i;
+
+    if (client->src.fd < 0)
+        return;
+    if (events & EPOLLOUT) {
+        if (ctl_client_flush(client))
+            return;
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        return;
+
+    len = read(client->src.fd, client->in + client->in_len, sizeof(client->in) - client->in_len);
+    if (len <= 0) {
+        if ((len < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+            return;
+        ctl_client_close(client);
+        return;
+    }
+    client->in_len += len;
+
+    start = 0;
+    for (i = 0; (i < client->in_len) && (client->src.fd >= 0); i++) {
+        if (client->in[i] == '\n') {
+            client->in[i] = 0;
+            if ((i > start) && (client->in[i - 1] == '\r'))
+                client->in[i - 1] = 0;
+            ctl_handle_line(client, client->in + start);
+            start = i + 1;
+        }
+    }
+    if (client->src.fd < 0)
+        return;
+    if ((start == 0) && (client->in_len == sizeof(client->in))) {
+        ctl_reply(client, "{\"error\":\"line too long\"}");
+        ctl_client_close(client);
+        return;
+    }
+    client->in_len -= start;
+    memmove(client->in, client->in + start, client->in_len);
+}
+
+
+static void ctl_accept_cb(void *priv_data, uint32_t events)
+{
+    struct ctl_t *ctl = (struct ctl_t *)priv_data;
+    struct ctl_client_t *client = NULL;
+    int fd;
+    int i;
+
+    while ((fd = accept(ctl->listen.fd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        client = NULL;
+        for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+            if (ctl->clients[i].src.fd < 0) {
+                client = &(ctl->clients[i]);
+                break;
+            }
+        }
+        if ((client == NULL) ||
+            loop_add(ctl->loop, &(client->src), fd, EPOLLIN, ctl_client_cb, client)) {
+            LOG_ERROR("Error: too many control clients\n");
+            close(fd);
+            continue;
+        }
+        client->in_len = 0;
+        client->out_len = 0;
+        client->subscribed = 0;
+        client->writing = 0;
+    }
+}
+
+
+int ctl_init(struct ctl_t *ctl, struct loop_t *loop, const char *path,
+             CtlCommandCallback cb, void *priv_data)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+    int i;
+
+    memset(ctl, 0, sizeof(struct ctl_t));
+    ctl->loop = loop;
+    ctl->listen.fd = -1;
+    ctl->cb = cb;
+    ctl->priv_data = priv_data;
+    for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+        ctl->clients[i].ctl = ctl;
+        ctl->clients[i].src.fd = -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LOG_ERROR("Error: control socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    // a stale socket from a previous run, anything else is left alone
+    if ((stat(path, &st) == 0) && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_ERROR("Error: failed to create control socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 8)) {
+        LOG_ERROR("Error: failed to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    ctl->path = path;
+    if (loop_add(loop, &(ctl->listen), fd, EPOLLIN, ctl_accept_cb, ctl)) {
+        close(fd);
+        return -1;
+    }
+    LOG_VERBOSE("Control socket %s\n", path);
+    return 0;
+}
+
+
+int ctl_subscribed(const struct ctl_t *ctl, int kind)
+{
+    return ctl->num_subscribers[kind] > 0;
+}
+
+
+void ctl_publish(struct ctl_t *ctl, int kind, const char *line, size_t len)
+{
+    int i;
+
+    if (!ctl_subscribed(ctl, kind))
+        return;
+    for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+        if ((ctl->clients[i].src.fd >= 0) && (ctl->clients[i].subscribed & kind))
+            ctl_client_write(&(ctl->clients[i]), line, len);
+    }
+}
+
+
+void ctl_print_stats(const struct ctl_t *ctl, FILE *stream)
+{
+    int clients = 0;
+    int i;
+
+    for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+        if (ctl->clients[i].src.fd >= 0)
+            clients++;
+    }
+    fprintf(stream, "Control %s: clients %d, subscribers %d, sample subscribers %d, dropped %llu\n",
+            ctl->path, clients, ctl->num_subscribers[CTL_SUB_TRANSITIONS],
+            ctl->num_subscribers[CTL_SUB_SAMPLES], (unsigned long long)ctl->dropped_clients);
+}
+
+
+void ctl_cleanup(struct ctl_t *ctl)
+{
+    int i;
+
+    if (ctl->loop == NULL)
+        return;
+    for (i = 0; i < CTL_MAX_CLIENTS; i++)
+        ctl_client_close(&(ctl->clients[i]));
+    loop_source_close(ctl->loop, &(ctl->listen));
+    if (ctl->path)
+        unlink(ctl->path);
+    ctl->path = NULL;
+}
@@ -0,0 +1,85 @@
+/*
+ *    Filename: ctl.h
+ * Description: Unix domain control and subscription socket.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _CTL_H_
+#define _CTL_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "loop.h"
+
+#define CTL_DEFAULT_PATH    "/run/ldr-reader.sock"
+#define CTL_MAX_CLIENTS     32
+#define CTL_LINE_MAX        256
+#define CTL_BUFFER_SIZE     16384
+
+#define CTL_SUB_TRANSITIONS 1
+#define CTL_SUB_SAMPLES     2
+
+// Line protocol, one request per line, every reply is one JSON line:
+//   status                         current state, thresholds and uptime
+//   set <gpio|all> key=value ...   change thresholds at runtime
+//   calibrate <lux> [samples]      pair the next charge times with a lux
+//                                  meter reading, needs ldr-reader -Y
+//   subscribe [samples]            stream transitions, and samples
+//   unsubscribe
+// Subscribers get events as they happen, in the same JSON as the -p
+// handler. Output to each client is buffered, a client that lets its
+// buffer fill up is disconnected rather than delaying a measurement.
+
+struct ctl_t;
+
+struct ctl_client_t
+{
+    struct ctl_t *ctl;
+    struct loop_source_t src;
+    unsigned char subscribed;
+    unsigned char writing;
+    char in[CTL_LINE_MAX];
+    size_t in_len;
+    char out[CTL_BUFFER_SIZE];
+    size_t out_len;
+};
+
+// called for each request line that isn't a subscription
+typedef void (*CtlCommandCallback)(void *priv_data, struct ctl_client_t *client, char *line);
+
+struct ctl_t
+{
+    struct loop_t *loop;
+    struct loop_source_t listen;
+    const char *path;
+    CtlCommandCallback cb;
+    void *priv_data;
+    struct ctl_client_t clients[CTL_MAX_CLIENTS];
+    int num_subscribers[CTL_SUB_SAMPLES + 1];
+    uint64_t dropped_clients;
+};
+
+
+int ctl_init(struct ctl_t *ctl, struct loop_t *loop, const char *path,
+             CtlCommandCallback cb, void *priv_data);
+// appends one reply line, the newline is added
+int ctl_reply(struct ctl_client_t *client, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+// true if anyone is subscribed to this kind of event
+int ctl_subscribed(const struct ctl_t *ctl, int kind);
+void ctl_publish(struct ctl_t *ctl, int kind, const char *line, size_t len);
+void ctl_print_stats(const struct ctl_t *ctl, FILE *stream);
+void ctl_cleanup(struct ctl_t *ctl);
+
+
+#endif // _CTL_H_
@@ -0,0 +1,350 @@
+/*
+ *    Filename: exec.c
+ * Description: Runs action commands without blocking the event loop.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "utils.h"
+#include "exec.h"
+
+extern char **environ;
+
+
+static void exec_timer_cb(void *priv_data, uint32_t events);
+
+
+int exec_parse_policy(const char *str, exec_policy_t *policy)
+{
+    if (strcmp(str, "queue") == 0)
+        *policy = EXEC_POLICY_QUEUE;
+    else if (strcmp(str, "skip") == 0)
+        *policy = EXEC_POLICY_SKIP;
+    else if (strcmp(str, "replace") == 0)
+        *policy = EXEC_POLICY_REPLACE;
+    else if (strcmp(str, "parallel") == 0)
+        *policy = EXEC_POLICY_PARALLEL;
+    else
+        return -1;
+    return 0;
+}
+
+
+int exec_init(struct exec_t *exec, struct loop_t *loop, int max_running,
+              unsigned int timeout_ms, exec_policy_t policy)
+{
+    memset(exec, 0, sizeof(struct exec_t));
+    exec->max_running = max_running;
+    if (exec->max_running > EXEC_MAX_CHILDREN)
+        exec->max_running = EXEC_MAX_CHILDREN;
+    exec->timeout_ms = timeout_ms;
+    exec->policy = policy;
+    return loop_timer_init(loop, &(exec->timer), exec_timer_cb, exec);
+}
+
+
+static void timespec_add_ms(struct timespec *ts, unsigned int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+
+// arms the timer for the earliest timeout or kill escalation
+static void exec_arm_timer(struct exec_t *exec)
+{
+    struct timespec now;
+    int64_t earliest_us = -1;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < EXEC_MAX_CHILDREN; i++) {
+        const struct exec_child_t *child = &(exec->children[i]);
+        int64_t delay_us;
+        if ((child->pid == 0) || (child->deadline.tv_sec == 0))
+            continue;
+        delay_us = timespec_diff_us(&(child->deadline), &now);
+        if (delay_us < 0)
+            delay_us = 0;
+        if ((earliest_us < 0) || (delay_us < earliest_us))
+            earliest_us = delay_us;
+    }
+    if (earliest_us < 0)
+        loop_timer_disarm(&(exec->timer));
+    else
+        loop_timer_arm_us(&(exec->timer), (uint64_t)earliest_us);
+}
+
+
+static struct exec_child_t *exec_find_key(struct exec_t *exec, int key)
+{
+    int i;
+    for (i = 0; i < EXEC_MAX_CHILDREN; i++) {
+        if ((exec->children[i].pid != 0) && (exec->children[i].key == key))
+            return &(exec->children[i]);
+    }
+    return NULL;
+}
+
+
+static int exec_spawn(struct exec_t *exec, const struct exec_pending_t *req)
+{
+    struct exec_child_t *child = NULL;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    sigset_t defaults;
+    char gpio_env[24];
+    char **envp;
+    struct timespec spawned;
+    size_t count = 0;
+    size_t i;
+    int ret;
+
+    for (i = 0; i < EXEC_MAX_CHILDREN; i++) {
+        if (exec->children[i].pid == 0) {
+            child = &(exec->children[i]);
+            break;
+        }
+    }
+    if (child == NULL)
+        return -1;
+
+    // the environment with LDR_GPIO set to the LDR GPIO pin
+    while (environ[count])
+        count++;
+    envp = malloc((count + 2) * sizeof(char *));
+    if (envp == NULL)
+        return -1;
+    snprintf(gpio_env, sizeof(gpio_env), "LDR_GPIO=%d", req->key);
+    count = 0;
+    for (i = 0; environ[i]; i++) {
+        if (strncmp(environ[i], "LDR_GPIO=", 9) != 0)
+            envp[count++] = environ[i];
+    }
+    envp[count++] = gpio_env;
+    envp[count] = NULL;
+
+    // signals handled through signalfd are blocked, don't pass that on.
+    // Own process group, so a timeout also stops whatever a script started.
+    posix_spawnattr_init(&attr);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF |
+                             POSIX_SPAWN_SETPGROUP);
+
+    clock_gettime(CLOCK_MONOTONIC, &(child->start_time));
+    ret = posix_spawn(&(child->pid), req->argv[0], NULL, &attr, req->argv, envp);
+    clock_gettime(CLOCK_MONOTONIC, &spawned);
+    posix_spawnattr_destroy(&attr);
+    free(envp);
+    if (ret) {
+        exec->spawn_failures++;
+        child->pid = 0;
+        LOG_ERROR("Error: failed to run %s: %s\n", req->name, strerror(ret));
+        return -1;
+    }
+
+    child->key = req->key;
+    child->name = req->name;
+    child->killed = 0;
+    child->deadline.tv_sec = 0;
+    child->deadline.tv_nsec = 0;
+    if (exec->timeout_ms) {
+        child->deadline = child->start_time;
+        timespec_add_ms(&(child->deadline), exec->timeout_ms);
+    }
+    exec->num_running++;
+    exec->spawned++;
+    exec->spawn_us_total += timespec_diff_us(&spawned, &(child->start_time));
+    LOG_VERBOSE("Started %s for LDR %d, pid %d, queued %lld ms, spawn took %lld us\n",
+                req->name, req->key, (int)child->pid,
+                (long long)timespec_diff_ms(&(child->start_time), &(req->queue_time)),
+                (long long)timespec_diff_us(&spawned, &(child->start_time)));
+    return 0;
+}
+
+
+// keeps only the latest command per key
+static void exec_queue(struct exec_t *exec, const struct exec_pending_t *req)
+{
+    int i;
+
+    for (i = 0; i < exec->num_pending; i++) {
+        if (exec->pending[i].key == req->key) {
+            exec->dropped++;
+            LOG_VERBOSE("Replaced pending %s for LDR %d with %s\n",
+                        exec->pending[i].name, req->key, req->name);
+            exec->pending[i] = *req;
+            return;
+        }
+    }
+    if (exec->num_pending == EXEC_MAX_PENDING) {
+        exec->dropped++;
+        LOG_ERROR("Error: too many pending commands, dropped %s for LDR %d\n", req->name, req->key);
+        return;
+    }
+    exec->pending[exec->num_pending++] = *req;
+}
+
+
+static void exec_start_pending(struct exec_t *exec)
+{
+    int i = 0;
+
+    while ((i < exec->num_pending) && (exec->num_running < exec->max_running)) {
+        struct exec_pending_t req = exec->pending[i];
+        if ((exec->policy != EXEC_POLICY_PARALLEL) && exec_find_key(exec, req.key)) {
+            i++;
+            continue;
+        }
+        exec->num_pending--;
+        memmove(&(exec->pending[i]), &(exec->pending[i + 1]),
+                (exec->num_pending - i) * sizeof(struct exec_pending_t));
+        exec_spawn(exec, &req);
+    }
+}
+
+
+void exec_run(struct exec_t *exec, int key, const char *name, char *const *argv)
+{
+    struct exec_child_t *running = exec_find_key(exec, key);
+    struct exec_pending_t req;
+
+    req.key = key;
+    req.name = name;
+    req.argv = argv;
+    clock_gettime(CLOCK_MONOTONIC, &(req.queue_time));
+
+    if (running) {
+        switch (exec->policy) {
+            case EXEC_POLICY_SKIP:
+                exec->dropped++;
+                LOG_VERBOSE("Skipped %s for LDR %d, %s is still running\n", name, key, running->name);
+                return;
+            case EXEC_POLICY_REPLACE:
+                if (running->killed == 0) {
+                    LOG_VERBOSE("Terminating %s for LDR %d, pid %d\n", running->name, key, (int)running->pid);
+                    kill(-running->pid, SIGTERM);
+                    running->killed = 1;
+                    running->deadline = req.queue_time;
+                    timespec_add_ms(&(running->deadline), EXEC_KILL_GRACE_MS);
+                    exec_arm_timer(exec);
+                }
+                exec_queue(exec, &req);
+                return;
+            case EXEC_POLICY_QUEUE:
+                exec_queue(exec, &req);
+                return;
+            case EXEC_POLICY_PARALLEL:
+                break;
+        }
+    }
+    if ((exec->num_running >= exec->max_running) || exec_spawn(exec, &req)) {
+        if (exec->num_running >= exec->max_running)
+            exec_queue(exec, &req);
+        return;
+    }
+    exec_arm_timer(exec);
+}
+
+
+// called on SIGCHLD, several exits may share one signal. Only our own
+// children are waited for, others may be reaped elsewhere.
+void exec_reap(struct exec_t *exec)
+{
+    struct timespec now;
+    int status;
+    int i;
+
+    for (i = 0; i < EXEC_MAX_CHILDREN; i++) {
+        struct exec_child_t *child = &(exec->children[i]);
+        long long runtime_ms;
+
+        if ((child->pid == 0) || (waitpid(child->pid, &status, WNOHANG) <= 0))
+            continue;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        runtime_ms = (long long)timespec_diff_ms(&now, &(child->start_time));
+        if (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) {
+            LOG_VERBOSE("%s for LDR %d, pid %d, finished after %lld ms\n",
+                        child->name, child->key, (int)child->pid, runtime_ms);
+        } else if (WIFEXITED(status)) {
+            exec->failed++;
+            LOG_INFO("%s for LDR %d, pid %d, exited with status %d after %lld ms\n",
+                     child->name, child->key, (int)child->pid, WEXITSTATUS(status), runtime_ms);
+        } else if (WIFSIGNALED(status)) {
+            exec->failed++;
+            LOG_INFO("%s for LDR %d, pid %d, killed by signal %d after %lld ms\n",
+                     child->name, child->key, (int)child->pid, WTERMSIG(status), runtime_ms);
+        }
+        child->pid = 0;
+        exec->num_running--;
+    }
+    exec_start_pending(exec);
+    exec_arm_timer(exec);
+}
+
+
+// timeouts get SIGTERM, and SIGKILL if they are still there after the grace time
+static void exec_timer_cb(void *priv_data, uint32_t events)
+{
+    struct exec_t *exec = (struct exec_t *)priv_data;
+    struct timespec now;
+    int i;
+
+    loop_timer_ack(&(exec->timer));
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < EXEC_MAX_CHILDREN; i++) {
+        struct exec_child_t *child = &(exec->children[i]);
+        if ((child->pid == 0) || (child->deadline.tv_sec == 0) ||
+            (timespec_diff_us(&(child->deadline), &now) > 0))
+            continue;
+        if (child->killed == 0) {
+            exec->timeouts++;
+            LOG_INFO("%s for LDR %d, pid %d, timed out, terminating\n", child->name, child->key, (int)child->pid);
+            kill(-child->pid, SIGTERM);
+            child->killed = 1;
+            child->deadline = now;
+            timespec_add_ms(&(child->deadline), EXEC_KILL_GRACE_MS);
+        } else {
+            LOG_INFO("%s for LDR %d, pid %d, ignored SIGTERM, killing\n", child->name, child->key, (int)child->pid);
+            kill(-child->pid, SIGKILL);
+            child->killed = 2;
+            child->deadline.tv_sec = 0;
+        }
+    }
+    exec_arm_timer(exec);
+}
+
+
+void exec_cleanup(struct exec_t *exec, struct loop_t *loop)
+{
+    if (exec->num_running)
+        LOG_VERBOSE("Leaving %d commands running\n", exec->num_running);
+    loop_source_close(loop, &(exec->timer));
+}
@@ -0,0 +1,91 @@
+/*
+ *    Filename: exec.h
+ * Description: Runs action commands without blocking the event loop.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _EXEC_H_
+#define _EXEC_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "loop.h"
+
+#define EXEC_MAX_CHILDREN           16
+#define EXEC_MAX_PENDING            16
+#define EXEC_DEFAULT_MAX_RUNNING    2
+#define EXEC_DEFAULT_TIMEOUT_MS     60000
+#define EXEC_KILL_GRACE_MS          2000
+
+// what to do with a command for a key that already has one running
+typedef enum
+{
+    EXEC_POLICY_QUEUE = 0,      // run it afterwards, only the latest waits
+    EXEC_POLICY_SKIP,           // drop it
+    EXEC_POLICY_REPLACE,        // terminate the running one first
+    EXEC_POLICY_PARALLEL,       // run it alongside, within the limit
+} exec_policy_t;
+
+
+struct exec_child_t
+{
+    pid_t pid;
+    int key;
+    const char *name;
+    struct timespec start_time;
+    struct timespec deadline;
+    unsigned char killed;       // 1 after SIGTERM, 2 after SIGKILL
+};
+
+struct exec_pending_t
+{
+    int key;
+    const char *name;
+    char *const *argv;
+    struct timespec queue_time;
+};
+
+// Children are started with posix_spawn() and reaped on SIGCHLD, which
+// the caller routes to exec_reap() through its signalfd. Commands are
+// keyed, by LDR GPIO pin here, for the coalescing policy.
+struct exec_t
+{
+    struct loop_source_t timer;
+    struct exec_child_t children[EXEC_MAX_CHILDREN];
+    struct exec_pending_t pending[EXEC_MAX_PENDING];
+    int num_running;
+    int num_pending;
+    int max_running;
+    unsigned int timeout_ms;
+    exec_policy_t policy;
+
+    uint64_t spawned;
+    uint64_t spawn_failures;
+    uint64_t spawn_us_total;
+    uint64_t failed;            // non-zero exit status or killed
+    uint64_t timeouts;
+    uint64_t dropped;           // skipped, replaced while pending, or no room
+};
+
+
+int exec_init(struct exec_t *exec, struct loop_t *loop, int max_running,
+              unsigned int timeout_ms, exec_policy_t policy);
+int exec_parse_policy(const char *str, exec_policy_t *policy);
+void exec_run(struct exec_t *exec, int key, const char *name, char *const *argv);
+void exec_reap(struct exec_t *exec);
+void exec_cleanup(struct exec_t *exec, struct loop_t *loop);
+
+
+#endif // _EXEC_H_
@@ -0,0 +1,258 @@
+/*
+ *    Filename: filter.c
+ * Description: Fixed point filters between the charge time and the state machine.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "filter.h"
+
+
+static const char *filter_names[] = { "median", "ema", "kalman", "outlier" };
+#define NUM_FILTER_TYPES    ((int)(sizeof(filter_names) / sizeof(filter_names[0])))
+
+
+// parses up to max numbers after the stage name, returns how many were
+// found or -1 if error
+static int filter_parse_args(const char *args, const char *end, double *values, int max)
+{
+    int count = 0;
+
+    while ((args < end) && (*args == ':')) {
+        char *next;
+        if (count == max)
+            return -1;
+        values[count++] = strtod(args + 1, &next);
+        if (next == args + 1)
+            return -1;
+        args = next;
+    }
+    return (args == end) ? count : -1;
+}
+
+
+static int filter_parse_stage(const char *spec, const char *end, struct filter_stage_t *stage)
+{
+    double args[2];
+    size_t name_len = strcspn(spec, ":,");
+    int num_args;
+    int type;
+
+    for (type = 0; type < NUM_FILTER_TYPES; type++) {
+        if ((strlen(filter_names[type]) == name_len) &&
+            (strncmp(spec, filter_names[type], name_len) == 0))
+            break;
+    }
+    if (type == NUM_FILTER_TYPES)
+        return -1;
+    num_args = filter_parse_args(spec + name_len, end, args, 2);
+    if (num_args < 0)
+        return -1;
+
+    memset(stage, 0, sizeof(struct filter_stage_t));
+    stage->type = (filter_type_t)type;
+    switch (stage->type)
+    {
+        case FILTER_MEDIAN:
+            if (num_args > 1)
+                return -1;
+            stage->u.median.size = (num_args > 0) ? (unsigned int)args[0] : FILTER_DEFAULT_MEDIAN;
+            if ((stage->u.median.size < 1) || (stage->u.median.size > FILTER_MAX_MEDIAN) ||
+                !(stage->u.median.size & 1))
+                return -1;
+            break;
+        case FILTER_EMA:
+            if (num_args > 1)
+                return -1;
+            if (num_args == 0)
+                args[0] = FILTER_DEFAULT_EMA_ALPHA;
+            if ((args[0] <= 0) || (args[0] > 1))
+                return -1;
+            stage->u.ema.alpha = (uint32_t)(args[0] * FILTER_ONE + 0.5);
+            if (stage->u.ema.alpha == 0)
+                stage->u.ema.alpha = 1;
+            break;
+        case FILTER_KALMAN:
+            if (num_args < 1)
+                args[0] = FILTER_DEFAULT_KALMAN_Q_US;
+            if (num_args < 2)
+                args[1] = FILTER_DEFAULT_KALMAN_R_US;
+            // variances above 1e12 us^2 would overflow the gain
+            if ((args[0] <= 0) || (args[1] <= 0) || (args[0] > 1e6) || (args[1] > 1e6))
+                return -1;
+            stage->u.kalman.q = (int64_t)(args[0] * args[0]);
+            stage->u.kalman.r = (int64_t)(args[1] * args[1]);
+            break;
+        case FILTER_OUTLIER:
+            if (((num_args > 0) && (args[0] <= 0)) || ((num_args > 1) && (args[1] < 0)))
+                return -1;
+            stage->u.outlier.pct = (num_args > 0) ? (unsigned int)args[0] : FILTER_DEFAULT_OUTLIER_PCT;
+            stage->u.outlier.max_rejects = (num_args > 1) ? (unsigned int)args[1] : FILTER_DEFAULT_OUTLIER_REJECTS;
+            break;
+    }
+    return 0;
+}
+
+
+int filter_parse(const char *spec, struct filter_chain_t *chain)
+{
+    memset(chain, 0, sizeof(struct filter_chain_t));
+    while (*spec) {
+        const char *end = spec + strcspn(spec, ",");
+        if (chain->count == FILTER_MAX_STAGES) {
+            LOG_ERROR("Error: too many filter stages, maximum is %d\n", FILTER_MAX_STAGES);
+            return -1;
+        }
+        if (filter_parse_stage(spec, end, &(chain->stages[chain->count]))) {
+            LOG_ERROR("Error: invalid filter stage: %.*s\n", (int)(end - spec), spec);
+            return -1;
+        }
+        chain->count++;
+        spec = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+
+void filter_reset(struct filter_chain_t *chain)
+{
+    int i;
+
+    for (i = 0; i < chain->count; i++) {
+        struct filter_stage_t *stage = &(chain->stages[i]);
+        stage->primed = 0;
+        switch (stage->type)
+        {
+            case FILTER_MEDIAN:
+                stage->u.median.count = 0;
+                stage->u.median.pos = 0;
+                break;
+            case FILTER_OUTLIER:
+                stage->u.outlier.rejects = 0;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+
+static uint32_t filter_median(struct filter_stage_t *stage, uint32_t value)
+{
+    uint32_t sorted[FILTER_MAX_MEDIAN];
+    unsigned int count;
+    unsigned int i, j;
+
+    stage->u.median.window[stage->u.median.pos] = value;
+    stage->u.median.pos = (stage->u.median.pos + 1) % stage->u.median.size;
+    if (stage->u.median.count < stage->u.median.size)
+        stage->u.median.count++;
+    count = stage->u.median.count;
+
+    // insertion sort, the window is tiny
+    for (i = 0; i < count; i++) {
+        uint32_t v = stage->u.median.window[i];
+        for (j = i; (j > 0) && (sorted[j - 1] > v); j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = v;
+    }
+    return sorted[count / 2];
+}
+
+
+static uint32_t filter_ema(struct filter_stage_t *stage, uint32_t value)
+{
+    int64_t x = (int64_t)value << FILTER_FRAC_BITS;
+
+    if (!stage->primed) {
+        stage->u.ema.value = x;
+        stage->primed = 1;
+    } else {
+        stage->u.ema.value += ((x - stage->u.ema.value) * stage->u.ema.alpha) >> FILTER_FRAC_BITS;
+    }
+    return (uint32_t)((stage->u.ema.value + FILTER_ONE / 2) >> FILTER_FRAC_BITS);
+}
+
+
+static uint32_t filter_kalman(struct filter_stage_t *stage, uint32_t value)
+{
+    int64_t z = (int64_t)value << FILTER_FRAC_BITS;
+    int64_t gain;
+
+    if (!stage->primed) {
+        stage->u.kalman.x = z;
+        stage->u.kalman.p = stage->u.kalman.r;
+        stage->primed = 1;
+        return value;
+    }
+    // the reading is modelled as constant plus process noise
+    stage->u.kalman.p += stage->u.kalman.q;
+    gain = (stage->u.kalman.p << FILTER_FRAC_BITS) / (stage->u.kalman.p + stage->u.kalman.r);
+    stage->u.kalman.x += ((z - stage->u.kalman.x) >> FILTER_FRAC_BITS) * gain;
+    stage->u.kalman.p = (stage->u.kalman.p * (FILTER_ONE - gain)) >> FILTER_FRAC_BITS;
+    return (uint32_t)((stage->u.kalman.x + FILTER_ONE / 2) >> FILTER_FRAC_BITS);
+}
+
+
+static uint32_t filter_outlier(struct filter_stage_t *stage, uint32_t value)
+{
+    uint64_t last = stage->u.outlier.last;
+    uint64_t diff = (value > last) ? value - last : last - value;
+
+    if (stage->primed && (diff * 100 > last * stage->u.outlier.pct) &&
+        (stage->u.outlier.rejects < stage->u.outlier.max_rejects)) {
+        stage->u.outlier.rejects++;
+        stage->u.outlier.rejected++;
+        return stage->u.outlier.last;
+    }
+    stage->u.outlier.rejects = 0;
+    stage->u.outlier.last = value;
+    stage->primed = 1;
+    return value;
+}
+
+
+uint32_t filter_apply(struct filter_chain_t *chain, uint32_t value)
+{
+    int i;
+
+    if (value > FILTER_MAX_VALUE)
+        value = FILTER_MAX_VALUE;
+    for (i = 0; i < chain->count; i++) {
+        struct filter_stage_t *stage = &(chain->stages[i]);
+        switch (stage->type)
+        {
+            case FILTER_MEDIAN:  value = filter_median(stage, value); break;
+            case FILTER_EMA:     value = filter_ema(stage, value); break;
+            case FILTER_KALMAN:  value = filter_kalman(stage, value); break;
+            case FILTER_OUTLIER: value = filter_outlier(stage, value); break;
+        }
+    }
+    return value;
+}
+
+
+uint64_t filter_rejected(const struct filter_chain_t *chain)
+{
+    uint64_t rejected = 0;
+    int i;
+
+    for (i = 0; i < chain->count; i++) {
+        if (chain->stages[i].type == FILTER_OUTLIER)
+            rejected += chain->stages[i].u.outlier.rejected;
+    }
+    return rejected;
+}
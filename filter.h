@@ -0,0 +1,106 @@
+/*
+ *    Filename: filter.h
+ * Description: Fixed point filters between the charge time and the state machine.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <stdint.h>
+
+#define FILTER_MAX_STAGES       8
+#define FILTER_MAX_MEDIAN       15
+#define FILTER_FRAC_BITS        16          // fixed point fraction bits
+#define FILTER_ONE              (1 << FILTER_FRAC_BITS)
+#define FILTER_MAX_VALUE        (1u << 30)  // us, inputs are clamped to it
+
+#define FILTER_DEFAULT_MEDIAN           5
+#define FILTER_DEFAULT_EMA_ALPHA        0.25
+#define FILTER_DEFAULT_KALMAN_Q_US      1000
+#define FILTER_DEFAULT_KALMAN_R_US      10000
+#define FILTER_DEFAULT_OUTLIER_PCT      100
+#define FILTER_DEFAULT_OUTLIER_REJECTS  3
+
+typedef enum
+{
+    FILTER_MEDIAN = 0,
+    FILTER_EMA,
+    FILTER_KALMAN,
+    FILTER_OUTLIER
+} filter_type_t;
+
+// Configuration and state of one stage. Everything is integer, the EMA
+// and the Kalman gain are fractions of FILTER_ONE.
+struct filter_stage_t
+{
+    filter_type_t type;
+    unsigned char primed;
+    union
+    {
+        struct
+        {
+            uint32_t window[FILTER_MAX_MEDIAN];
+            unsigned int size;
+            unsigned int count;
+            unsigned int pos;
+        } median;
+        struct
+        {
+            uint32_t alpha;
+            int64_t value;          // fixed point
+        } ema;
+        struct
+        {
+            int64_t q;              // process noise variance, us^2
+            int64_t r;              // measurement noise variance, us^2
+            int64_t p;              // estimate variance, us^2
+            int64_t x;              // estimate, fixed point
+        } kalman;
+        struct
+        {
+            unsigned int pct;       // allowed change from the last accepted value
+            unsigned int max_rejects;   // a longer run is a real change
+            unsigned int rejects;
+            uint32_t last;
+            uint64_t rejected;
+        } outlier;
+    } u;
+};
+
+struct filter_chain_t
+{
+    struct filter_stage_t stages[FILTER_MAX_STAGES];
+    int count;
+};
+
+
+// spec is a comma separated list of stages with colon separated
+// parameters, e.g. "outlier:100:3,median:5,ema:0.25"
+int filter_parse(const char *spec, struct filter_chain_t *chain);
+void filter_reset(struct filter_chain_t *chain);
+uint32_t filter_apply(struct filter_chain_t *chain, uint32_t value);
+uint64_t filter_rejected(const struct filter_chain_t *chain);
+
+#define FILTER_USAGE \
+    "                 Stages, applied in order, separated by commas:\n" \
+    "                   median[:n]          sliding median of n samples, odd, up to 15. Default 5\n" \
+    "                   ema[:alpha]         exponential moving average, 0 < alpha <= 1. Default 0.25\n" \
+    "                   kalman[:q[:r]]      scalar Kalman filter, process and measurement noise\n" \
+    "                                       standard deviations in us. Default 1000:10000\n" \
+    "                   outlier[:pct[:n]]   hold the last value when a sample moves more than pct\n" \
+    "                                       percent, unless n samples in a row do. Default 100:3\n" \
+    "                 Example: outlier,median:5,ema:0.5\n"
+
+
+#endif // _FILTER_H_
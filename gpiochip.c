@@ -0,0 +1,198 @@
+/*
+ *    Filename: gpiochip.c
+ * Description: GPIO character device (v2 uAPI).
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include "utils.h"
+#include "sysfsgpio.h"
+#include "gpiochip.h"
+
+
+static __u64 gpiochip_edge_flags(int edge)
+{
+    switch (edge)
+    {
+        case GPIO_EDGE_RISING:  return GPIO_V2_LINE_FLAG_EDGE_RISING;
+        case GPIO_EDGE_FALLING: return GPIO_V2_LINE_FLAG_EDGE_FALLING;
+        case GPIO_EDGE_BOTH:    return GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+        default:                return 0;
+    }
+}
+
+static void gpiochip_output_config(struct gpio_v2_line_config *config, int value)
+{
+    memset(config, 0, sizeof(struct gpio_v2_line_config));
+    config->flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    config->num_attrs = 1;
+    config->attrs[0].mask = 1;
+    config->attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+    config->attrs[0].attr.values = value ? 1 : 0;
+}
+
+int gpiochip_open(const char *path)
+{
+    int fd;
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (-1 == fd)
+        LOG_ERROR("Failed to open %s: %s\n", path, strerror(errno));
+    return fd;
+}
+
+// returns the line request fd, or -1 if error.
+// input lines are requested without edge detection.
+int gpiochip_request_line(int chip_fd, int offset, int dir, int value)
+{
+    struct gpio_v2_line_request req;
+
+    memset(&req, 0, sizeof(struct gpio_v2_line_request));
+    req.offsets[0] = offset;
+    req.num_lines = 1;
+    strncpy(req.consumer, GPIOCHIP_CONSUMER, sizeof(req.consumer) - 1);
+    if (GPIO_OUT == dir)
+        gpiochip_output_config(&req.config, value);
+    else
+        req.config.flags = GPIO_V2_LINE_FLAG_INPUT;
+
+    if (-1 == ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req)) {
+        LOG_ERROR("Failed to request gpio line %d: %s\n", offset, strerror(errno));
+        return(-1);
+    }
+    if (-1 == fcntl(req.fd, F_SETFL, O_NONBLOCK)) {
+        LOG_ERROR("Failed to set gpio line %d non-blocking\n", offset);
+        close(req.fd);
+        return(-1);
+    }
+    return req.fd;
+}
+
+// requests several output lines as one, so they can be set together.
+// lines in active_low_mask (bit n for offsets[n]) are inverted by the kernel.
+// all lines start inactive. returns the line request fd, or -1 if error.
+int gpiochip_request_outputs(int chip_fd, const int *offsets, int num_lines,
+                             uint64_t active_low_mask)
+{
+    struct gpio_v2_line_request req;
+    int i;
+
+    if ((num_lines <= 0) || (num_lines > GPIO_V2_LINES_MAX)) {
+        LOG_ERROR("Invalid number of gpio output lines %d\n", num_lines);
+        return(-1);
+    }
+    memset(&req, 0, sizeof(struct gpio_v2_line_request));
+    for (i = 0; i < num_lines; i++)
+        req.offsets[i] = offsets[i];
+    req.num_lines = num_lines;
+    strncpy(req.consumer, GPIOCHIP_CONSUMER, sizeof(req.consumer) - 1);
+    req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    if (active_low_mask) {
+        req.config.attrs[0].mask = active_low_mask;
+        req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+        req.config.attrs[0].attr.flags = GPIO_V2_LINE_FLAG_OUTPUT | GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+        req.config.num_attrs = 1;
+    }
+
+    if (-1 == ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req)) {
+        LOG_ERROR("Failed to request %d gpio output lines: %s\n", num_lines, strerror(errno));
+        return(-1);
+    }
+    return req.fd;
+}
+
+// switch the line to output and drive it, edge detection is disabled.
+int gpiochip_line_output(int line_fd, int value)
+{
+    struct gpio_v2_line_config config;
+
+    gpiochip_output_config(&config, value);
+    if (-1 == ioctl(line_fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &config)) {
+        LOG_ERROR("Failed to set gpio line output: %s\n", strerror(errno));
+        return(-1);
+    }
+    return(0);
+}
+
+// drives the lines in mask (bit n for the nth requested line) to bits,
+// all in a single ioctl.
+int gpiochip_set_values(int line_fd, uint64_t bits, uint64_t mask)
+{
+    struct gpio_v2_line_values values;
+
+    values.bits = bits;
+    values.mask = mask;
+    if (-1 == ioctl(line_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values)) {
+        LOG_ERROR("Failed to set gpio line values: %s\n", strerror(errno));
+        return(-1);
+    }
+    return(0);
+}
+
+// switch the line to input and enable edge detection in a single ioctl.
+int gpiochip_line_input(int line_fd, int edge)
+{
+    struct gpio_v2_line_config config;
+
+    memset(&config, 0, sizeof(struct gpio_v2_line_config));
+    config.flags = GPIO_V2_LINE_FLAG_INPUT | gpiochip_edge_flags(edge);
+    if (-1 == ioctl(line_fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &config)) {
+        LOG_ERROR("Failed to set gpio line input: %s\n", strerror(errno));
+        return(-1);
+    }
+    return(0);
+}
+
+// discard any queued edge events, e.g. bounces left over from the
+// previous cycle. returns number of events discarded.
+int gpiochip_line_flush_events(int line_fd)
+{
+    struct gpio_v2_line_event events[4];
+    int count = 0;
+    ssize_t len;
+
+    while ((len = read(line_fd, events, sizeof(events))) > 0)
+        count += len / sizeof(struct gpio_v2_line_event);
+    return count;
+}
+
+// reads one edge event without blocking.
+// returns 1 if successful, timestamp is set to the kernel CLOCK_MONOTONIC
+// timestamp of the edge.
+// returns zero if no event is pending, timestamp is set to now.
+// returns -1 if error.
+int gpiochip_read_edge(int line_fd, struct timespec *timestamp)
+{
+    struct gpio_v2_line_event event;
+    ssize_t len;
+
+    len = read(line_fd, &event, sizeof(event));
+    if (len != sizeof(event)) {
+        clock_gettime(CLOCK_MONOTONIC, timestamp);
+        if ((len < 0) && (errno == EAGAIN))
+            return 0;
+        LOG_ERROR("Error: failed to read gpio line event\n");
+        return(-1);
+    }
+    timestamp->tv_sec = event.timestamp_ns / 1000000000ULL;
+    timestamp->tv_nsec = event.timestamp_ns % 1000000000ULL;
+    return 1;
+}
@@ -0,0 +1,40 @@
+/*
+ *    Filename: gpiochip.h
+ * Description: GPIO character device (v2 uAPI).
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GPIOCHIP_H_
+#define _GPIOCHIP_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define GPIOCHIP_DEFAULT_PATH   "/dev/gpiochip0"
+#define GPIOCHIP_CONSUMER       "ldr-reader"
+#define GPIOCHIP_MAX_LINES      64
+
+
+int gpiochip_open(const char *path);
+int gpiochip_request_line(int chip_fd, int offset, int dir, int value);
+int gpiochip_request_outputs(int chip_fd, const int *offsets, int num_lines,
+                             uint64_t active_low_mask);
+int gpiochip_line_output(int line_fd, int value);
+int gpiochip_set_values(int line_fd, uint64_t bits, uint64_t mask);
+int gpiochip_line_input(int line_fd, int edge);
+int gpiochip_line_flush_events(int line_fd);
+int gpiochip_read_edge(int line_fd, struct timespec *timestamp);
+
+
+#endif // _GPIOCHIP_H_
@@ -0,0 +1,180 @@
+/*
+ *    Filename: gpiomem.c
+ * Description: Memory mapped BCM283x GPIO registers.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "gpiomem.h"
+#include "ldr.h"
+
+
+int gpiomem_open(struct gpiomem_t *mem, const char *path)
+{
+    struct stat st;
+    void *map;
+
+    mem->regs = NULL;
+    mem->fd = open(path, O_RDWR | O_SYNC | O_CLOEXEC);
+    if (mem->fd < 0) {
+        LOG_ERROR("Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // a fake register file gets sized to the register block
+    if ((fstat(mem->fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size < GPIOMEM_BLOCK_SIZE)) {
+        if (ftruncate(mem->fd, GPIOMEM_BLOCK_SIZE)) {
+            LOG_ERROR("Failed to size %s: %s\n", path, strerror(errno));
+            gpiomem_close(mem);
+            return -1;
+        }
+    }
+    map = mmap(NULL, GPIOMEM_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, mem->fd, 0);
+    if (map == MAP_FAILED) {
+        LOG_ERROR("Failed to map %s: %s\n", path, strerror(errno));
+        gpiomem_close(mem);
+        return -1;
+    }
+    mem->regs = (volatile uint32_t *)map;
+    return 0;
+}
+
+
+void gpiomem_close(struct gpiomem_t *mem)
+{
+    if (mem->regs) {
+        munmap((void *)mem->regs, GPIOMEM_BLOCK_SIZE);
+        mem->regs = NULL;
+    }
+    if (mem->fd >= 0) {
+        close(mem->fd);
+        mem->fd = -1;
+    }
+}
+
+
+int gpiomem_fsel_get(const struct gpiomem_t *mem, int pin)
+{
+    int shift = (pin % 10) * 3;
+    return (mem->regs[GPIOMEM_GPFSEL0 + pin / 10] >> shift) & GPIOMEM_FSEL_MASK;
+}
+
+
+void gpiomem_fsel_set(struct gpiomem_t *mem, int pin, int fsel)
+{
+    volatile uint32_t *reg = &(mem->regs[GPIOMEM_GPFSEL0 + pin / 10]);
+    int shift = (pin % 10) * 3;
+    *reg = (*reg & ~(GPIOMEM_FSEL_MASK << shift)) | ((fsel & GPIOMEM_FSEL_MASK) << shift);
+}
+
+
+void gpiomem_write(struct gpiomem_t *mem, int pin, int value)
+{
+    if (value)
+        mem->regs[GPIOMEM_GPSET0 + pin / 32] = 1U << (pin % 32);
+    else
+        mem->regs[GPIOMEM_GPCLR0 + pin / 32] = 1U << (pin % 32);
+}
+
+
+/*
+ * ldr backend, no syscalls on the measurement path: the direction flips
+ * are register writes and ldr.c busy-polls the level register against a
+ * CLOCK_MONOTONIC_RAW deadline (vDSO).
+ */
+
+static int gpiomem_ldr_open(struct ldr_sensor_t *ldr, int gpio, const char *arg)
+{
+    struct gpiomem_t *mem;
+
+    if ((gpio < 0) || (gpio > GPIOMEM_MAX_PIN)) {
+        LOG_ERROR("Error: GPIO pin %d out of range for gpiomem\n", gpio);
+        return -1;
+    }
+    mem = malloc(sizeof(struct gpiomem_t));
+    if (mem == NULL)
+        return -1;
+    ldr->backend_data = mem;
+    if (gpiomem_open(mem, arg ? arg : GPIOMEM_DEFAULT_PATH))
+        return -1;
+    ldr->gpio = gpio;
+    return 0;
+}
+
+
+static void gpiomem_ldr_close(struct ldr_sensor_t *ldr)
+{
+    struct gpiomem_t *mem = (struct gpiomem_t *)ldr->backend_data;
+
+    if (mem) {
+        if (mem->regs && (ldr->gpio >= 0))
+            gpiomem_fsel_set(mem, ldr->gpio, GPIOMEM_FSEL_INPUT);
+        gpiomem_close(mem);
+        free(mem);
+        ldr->backend_data = NULL;
+    }
+    ldr->gpio = -1;
+}
+
+
+static int gpiomem_ldr_drain(struct ldr_sensor_t *ldr)
+{
+    struct gpiomem_t *mem = (struct gpiomem_t *)ldr->backend_data;
+
+    // clear first so the pin never drives high
+    gpiomem_write(mem, ldr->gpio, 0);
+    gpiomem_fsel_set(mem, ldr->gpio, GPIOMEM_FSEL_OUTPUT);
+    return 0;
+}
+
+
+static int gpiomem_ldr_charge(struct ldr_sensor_t *ldr, struct timespec *start_time)
+{
+    struct gpiomem_t *mem = (struct gpiomem_t *)ldr->backend_data;
+
+    gpiomem_fsel_set(mem, ldr->gpio, GPIOMEM_FSEL_INPUT);
+    clock_gettime(CLOCK_MONOTONIC_RAW, start_time);
+    return 0;
+}
+
+
+static int gpiomem_ldr_read_level(struct ldr_sensor_t *ldr)
+{
+    struct gpiomem_t *mem = (struct gpiomem_t *)ldr->backend_data;
+    return gpiomem_read(mem, ldr->gpio);
+}
+
+
+static void gpiomem_ldr_clock(struct ldr_sensor_t *ldr, struct timespec *now)
+{
+    clock_gettime(CLOCK_MONOTONIC_RAW, now);
+}
+
+
+const struct ldr_gpio_ops ldr_gpiomem_ops =
+{
+    .name = "gpiomem",
+    .open = gpiomem_ldr_open,
+    .close = gpiomem_ldr_close,
+    .drain = gpiomem_ldr_drain,
+    .charge = gpiomem_ldr_charge,
+    .read_level = gpiomem_ldr_read_level,
+    .clock = gpiomem_ldr_clock,
+};
@@ -0,0 +1,60 @@
+/*
+ *    Filename: gpiomem.h
+ * Description: Memory mapped BCM283x GPIO registers.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GPIOMEM_H_
+#define _GPIOMEM_H_
+
+#include <stdint.h>
+
+#define GPIOMEM_DEFAULT_PATH    "/dev/gpiomem"
+#define GPIOMEM_BLOCK_SIZE      4096
+#define GPIOMEM_MAX_PIN         53
+
+// register offsets in 32-bit words
+#define GPIOMEM_GPFSEL0         0
+#define GPIOMEM_GPSET0          7
+#define GPIOMEM_GPCLR0          10
+#define GPIOMEM_GPLEV0          13
+
+#define GPIOMEM_FSEL_INPUT      0
+#define GPIOMEM_FSEL_OUTPUT     1
+#define GPIOMEM_FSEL_MASK       7
+
+
+// A mapping of the GPIO register block. A plain file of at least
+// GPIOMEM_BLOCK_SIZE bytes can stand in for /dev/gpiomem, the level
+// register is then driven by whoever else maps the file.
+struct gpiomem_t
+{
+    int fd;
+    volatile uint32_t *regs;
+};
+
+
+int gpiomem_open(struct gpiomem_t *mem, const char *path);
+void gpiomem_close(struct gpiomem_t *mem);
+int gpiomem_fsel_get(const struct gpiomem_t *mem, int pin);
+void gpiomem_fsel_set(struct gpiomem_t *mem, int pin, int fsel);
+void gpiomem_write(struct gpiomem_t *mem, int pin, int value);
+
+static inline int gpiomem_read(const struct gpiomem_t *mem, int pin)
+{
+    return (mem->regs[GPIOMEM_GPLEV0 + pin / 32] >> (pin % 32)) & 1;
+}
+
+
+#endif // _GPIOMEM_H_
@@ -0,0 +1,734 @@
+/*
+ *    Filename: ldr-analyze.c
+ * Description: Summarizes raw LDR logs and exports downsampled series.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "utils.h"
+#include "rawlog.h"
+#include "ldr.h"
+
+
+#define ANALYZE_DEFAULT_POINTS      1000
+#define ANALYZE_MAX_POINTS          1000000
+#define ANALYZE_DEFAULT_GAP_S       60
+#define ANALYZE_SVG_WIDTH           1200
+#define ANALYZE_SVG_HEIGHT          400
+#define ANALYZE_SVG_MARGIN          50
+
+#define ANALYZE_METHOD_LTTB         0
+#define ANALYZE_METHOD_MINMAX       1
+
+#define ANALYZE_FORMAT_CSV          0
+#define ANALYZE_FORMAT_SVG          1
+
+
+// Streams the samples of one log inside [begin_ns, end_ns]. v1 logs have
+// no timestamps and are given one sample every v1_period_ms from epoch.
+struct analyze_input_t
+{
+    const char *path;
+    struct rawlog_reader_t reader;
+    unsigned int v1_period_ms;
+    uint64_t v1_index;
+    int64_t begin_ns;
+    int64_t end_ns;
+};
+
+struct analyze_point_t
+{
+    int64_t realtime_ns;
+    double value_ms;
+    uint8_t state;
+    uint8_t timeout;
+};
+
+struct analyze_summary_t
+{
+    uint64_t samples;
+    uint64_t timeouts;
+    uint64_t transitions;
+    int64_t first_ns;
+    int64_t last_ns;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t sum_us;
+    int64_t state_ns[3];
+    uint64_t gaps;
+    int64_t gap_ns_total;
+    int64_t gap_ns_max;
+};
+
+// running average of one LTTB bucket
+struct analyze_bucket_t
+{
+    double time;
+    double value;
+    uint64_t count;
+};
+
+
+
+static int analyze_open(struct analyze_input_t *input)
+{
+    if (rawlog_reader_open(&(input->reader), input->path))
+        return -1;
+    input->v1_index = 0;
+    if ((input->begin_ns > INT64_MIN) && (input->reader.version != RAWLOG_VERSION_1))
+        rawlog_reader_seek(&(input->reader), input->begin_ns);
+    return 0;
+}
+
+
+static void analyze_close(struct analyze_input_t *input)
+{
+    rawlog_reader_close(&(input->reader));
+}
+
+
+// returns 1 with a sample, 0 at the end of the window or log, -1 on error
+static int analyze_next(struct analyze_input_t *input, struct rawlog_sample_t *sample)
+{
+    int ret;
+
+    while ((ret = rawlog_reader_next(&(input->reader), sample)) == 1) {
+        if (input->reader.version == RAWLOG_VERSION_1)
+            sample->realtime_ns = (int64_t)(input->v1_index++) * input->v1_period_ms * 1000000;
+        if (sample->realtime_ns < input->begin_ns)
+            continue;
+        if (sample->realtime_ns > input->end_ns)
+            return 0;
+        return 1;
+    }
+    if (ret < 0)
+        LOG_ERROR("Error: %s is corrupt\n", input->path);
+    return ret;
+}
+
+
+static void format_time(int64_t realtime_ns, char *buf, size_t size)
+{
+    time_t seconds = (time_t)(realtime_ns / 1000000000);
+    struct tm tm;
+    size_t len;
+
+    localtime_r(&seconds, &tm);
+    len = strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(buf + len, size - len, ".%03d", (int)((realtime_ns / 1000000) % 1000));
+}
+
+
+static void format_duration(int64_t ns, char *buf, size_t size)
+{
+    int64_t seconds = ns / 1000000000;
+    snprintf(buf, size, "%lldd %02lld:%02lld:%02lld", (long long)(seconds / 86400),
+             (long long)((seconds / 3600) % 24), (long long)((seconds / 60) % 60),
+             (long long)(seconds % 60));
+}
+
+
+// @epoch, or local time as YYYY-MM-DD[ HH:MM[:SS]], the T separator works too
+static int parse_time(const char *str, int64_t *realtime_ns)
+{
+    struct tm tm;
+    time_t seconds;
+    char *end = NULL;
+    int fields;
+
+    if (str[0] == '@') {
+        double epoch = strtod(str + 1, &end);
+        if ((end == str + 1) || (*end != 0))
+            return -1;
+        *realtime_ns = (int64_t)(epoch * 1000000000.0);
+        return 0;
+    }
+    memset(&tm, 0, sizeof(tm));
+    fields = sscanf(str, "%d-%d-%d%*c%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                    &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+    if ((fields != 3) && (fields != 5) && (fields != 6))
+        return -1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    seconds = mktime(&tm);
+    if (seconds == (time_t)-1)
+        return -1;
+    *realtime_ns = (int64_t)seconds * 1000000000;
+    return 0;
+}
+
+
+static int analyze_summary(struct analyze_input_t *input, unsigned int gap_s,
+                           struct analyze_summary_t *summary)
+{
+    struct rawlog_sample_t sample;
+    struct rawlog_sample_t prev;
+    int64_t gap_ns = (int64_t)gap_s * 1000000000;
+    int ret;
+
+    memset(summary, 0, sizeof(struct analyze_summary_t));
+    summary->min_us = UINT32_MAX;
+    if (analyze_open(input))
+        return -1;
+    while ((ret = analyze_next(input, &sample)) == 1) {
+        if (summary->samples == 0) {
+            summary->first_ns = sample.realtime_ns;
+        } else {
+            int64_t interval = sample.realtime_ns - prev.realtime_ns;
+            if (interval < 0) {
+                // the clock was set back between sessions
+            } else if (interval > gap_ns) {
+                summary->gaps++;
+                summary->gap_ns_total += interval;
+                if (interval > summary->gap_ns_max)
+                    summary->gap_ns_max = interval;
+            } else if (prev.state < 3) {
+                summary->state_ns[prev.state] += interval;
+            }
+            if ((sample.state != prev.state) && (prev.state != LDR_UNKNOWN))
+                summary->transitions++;
+        }
+        summary->samples++;
+        summary->last_ns = sample.realtime_ns;
+        // a saturated sample only reads the timeout, not a charge time
+        if (sample.timeout) {
+            summary->timeouts++;
+        } else {
+            if (sample.duration_us < summary->min_us)
+                summary->min_us = sample.duration_us;
+            if (sample.duration_us > summary->max_us)
+                summary->max_us = sample.duration_us;
+            summary->sum_us += sample.duration_us;
+        }
+        prev = sample;
+    }
+    analyze_close(input);
+    return ret;
+}
+
+
+static void print_summary(const struct analyze_input_t *input, const struct analyze_summary_t *summary,
+                          unsigned int gap_s, FILE *stream)
+{
+    const struct rawlog_reader_t *reader = &(input->reader);
+    int64_t span_ns = summary->last_ns - summary->first_ns;
+    char buf[64];
+    char buf2[64];
+    int i;
+    static const char *state_names[] = { "unknown", "bright", "dark" };
+
+    fprintf(stream, "file: %s\n", input->path);
+    if (reader->version == RAWLOG_VERSION_1)
+        fprintf(stream, "format: v1, assuming a sample every %u ms\n", input->v1_period_ms);
+    else if (reader->version == RAWLOG_VERSION_CIRC)
+        fprintf(stream, "format: circular, generation %u\n", reader->sessions);
+    else
+        fprintf(stream, "format: v2\n");
+    if (reader->version != RAWLOG_VERSION_1)
+        fprintf(stream, "gpio: %d, thresholds: high %u.%03u ms, low %u.%03u ms, complete darkness %u.%03u ms\n",
+                reader->info.gpio,
+                reader->info.high_threshold_us / 1000, reader->info.high_threshold_us % 1000,
+                reader->info.low_threshold_us / 1000, reader->info.low_threshold_us % 1000,
+                reader->info.complete_darkness_threshold_us / 1000,
+                reader->info.complete_darkness_threshold_us % 1000);
+    fprintf(stream, "samples: %llu\n", (unsigned long long)summary->samples);
+    if (summary->samples == 0)
+        return;
+    format_time(summary->first_ns, buf, sizeof(buf));
+    format_time(summary->last_ns, buf2, sizeof(buf2));
+    fprintf(stream, "time: %s to %s\n", buf, buf2);
+    format_duration(span_ns, buf, sizeof(buf));
+    fprintf(stream, "span: %s\n", buf);
+    fprintf(stream, "timeouts: %llu (%.1f%%)\n", (unsigned long long)summary->timeouts,
+            summary->timeouts * 100.0 / summary->samples);
+    if (summary->samples > summary->timeouts)
+        fprintf(stream, "charge time: min %u.%03u ms, avg %.3f ms, max %u.%03u ms, timeouts excluded\n",
+                summary->min_us / 1000, summary->min_us % 1000,
+                summary->sum_us / 1000.0 / (summary->samples - summary->timeouts),
+                summary->max_us / 1000, summary->max_us % 1000);
+    else
+        fprintf(stream, "charge time: every sample timed out\n");
+    for (i = LDR_BRIGHT; i <= LDR_DARK; i++) {
+        format_duration(summary->state_ns[i], buf, sizeof(buf));
+        fprintf(stream, "%s: %s (%.1f%%)\n", state_names[i], buf,
+                span_ns > 0 ? summary->state_ns[i] * 100.0 / span_ns : 0.0);
+    }
+    fprintf(stream, "transitions: %llu\n", (unsigned long long)summary->transitions);
+    format_duration(summary->gap_ns_total, buf, sizeof(buf));
+    format_duration(summary->gap_ns_max, buf2, sizeof(buf2));
+    fprintf(stream, "gaps over %u s: %llu, total %s, longest %s\n", gap_s,
+            (unsigned long long)summary->gaps, buf, buf2);
+}
+
+
+static int print_transitions(struct analyze_input_t *input, FILE *stream)
+{
+    struct rawlog_sample_t sample;
+    uint8_t state = LDR_UNKNOWN;
+    char buf[64];
+    int ret;
+
+    if (analyze_open(input))
+        return -1;
+    while ((ret = analyze_next(input, &sample)) == 1) {
+        if (sample.state == state)
+            continue;
+        format_time(sample.realtime_ns, buf, sizeof(buf));
+        // leaving the unknown state is not a transition, as in the summary
+        fprintf(stream, "%s %s%s %u.%03u ms\n", buf, state == LDR_UNKNOWN ? "initial " : "",
+                sample.state == LDR_DARK ? "dark" : sample.state == LDR_BRIGHT ? "bright" : "unknown",
+                sample.duration_us / 1000, sample.duration_us % 1000);
+        state = sample.state;
+    }
+    analyze_close(input);
+    return ret;
+}
+
+
+static void point_from_sample(struct analyze_point_t *point, const struct rawlog_sample_t *sample)
+{
+    point->realtime_ns = sample->realtime_ns;
+    point->value_ms = sample->duration_us / 1000.0;
+    point->state = sample->state;
+    point->timeout = sample->timeout;
+}
+
+
+static int bucket_of(int64_t realtime_ns, int64_t begin_ns, int64_t end_ns, size_t buckets)
+{
+    int64_t bucket;
+    if (end_ns <= begin_ns)
+        return 0;
+    bucket = (int64_t)((double)(realtime_ns - begin_ns) * buckets / (double)(end_ns - begin_ns));
+    if (bucket < 0)
+        return 0;
+    if (bucket >= (int64_t)buckets)
+        return (int)buckets - 1;
+    return (int)bucket;
+}
+
+
+// Min-max downsampling: the lowest and highest sample of every bucket,
+// in time order. One pass, constant memory.
+static int series_minmax(struct analyze_input_t *input, const struct analyze_summary_t *summary,
+                         struct analyze_point_t *points, size_t max_points, size_t *num_points)
+{
+    struct rawlog_sample_t sample;
+    struct analyze_point_t lo;
+    struct analyze_point_t hi;
+    size_t buckets = max_points / 2;
+    int bucket = -1;
+    int ret;
+
+    *num_points = 0;
+    if (analyze_open(input))
+        return -1;
+    while ((ret = analyze_next(input, &sample)) >= 0) {
+        int b = (ret == 1) ? bucket_of(sample.realtime_ns, summary->first_ns, summary->last_ns, buckets) : -1;
+        // a clock set back must not revisit a bucket
+        if ((ret == 1) && (b < bucket))
+            b = bucket;
+        if ((b != bucket) && (bucket >= 0)) {
+            if (lo.realtime_ns <= hi.realtime_ns) {
+                points[(*num_points)++] = lo;
+                if (hi.realtime_ns != lo.realtime_ns)
+                    points[(*num_points)++] = hi;
+            } else {
+                points[(*num_points)++] = hi;
+                points[(*num_points)++] = lo;
+            }
+        }
+        if (ret == 0)
+            break;
+        if (b != bucket) {
+            point_from_sample(&lo, &sample);
+            hi = lo;
+            bucket = b;
+        } else if (sample.duration_us / 1000.0 < lo.value_ms) {
+            point_from_sample(&lo, &sample);
+        } else if (sample.duration_us / 1000.0 > hi.value_ms) {
+            point_from_sample(&hi, &sample);
+        }
+    }
+    analyze_close(input);
+    return ret;
+}
+
+
+// Largest-Triangle-Three-Buckets. The first pass averages every bucket,
+// the second keeps the sample of each bucket that makes the largest
+// triangle with the last kept sample and the average of the next bucket.
+// Memory is bounded by the number of points, not the log size.
+static int series_lttb(struct analyze_input_t *input, const struct analyze_summary_t *summary,
+                       struct analyze_point_t *points, size_t max_points, size_t *num_points)
+{
+    struct rawlog_sample_t sample;
+    struct analyze_bucket_t *avg;
+    struct analyze_point_t prev;
+    struct analyze_point_t best;
+    double best_area = -1;
+    size_t buckets = max_points > 2 ? max_points - 2 : 1;
+    uint64_t index = 0;
+    int bucket = -1;
+    int ret;
+    int i;
+
+    *num_points = 0;
+    avg = calloc(buckets + 1, sizeof(struct analyze_bucket_t));
+    if (avg == NULL)
+        return -1;
+
+    if (analyze_open(input)) {
+        free(avg);
+        return -1;
+    }
+    while ((ret = analyze_next(input, &sample)) == 1) {
+        struct analyze_bucket_t *b = &avg[bucket_of(sample.realtime_ns, summary->first_ns, summary->last_ns, buckets)];
+        b->time += (double)(sample.realtime_ns - summary->first_ns);
+        b->value += sample.duration_us / 1000.0;
+        b->count++;
+    }
+    analyze_close(input);
+    // empty buckets take the average of the next one that has samples,
+    // the last one is followed by the last sample
+    avg[buckets].time = (double)(summary->last_ns - summary->first_ns);
+    avg[buckets].value = 0;
+    avg[buckets].count = 0;
+    for (i = (int)buckets - 1; i >= 0; i--) {
+        if (avg[i].count) {
+            avg[i].time /= avg[i].count;
+            avg[i].value /= avg[i].count;
+        } else {
+            avg[i] = avg[i + 1];
+        }
+    }
+    if (ret < 0) {
+        free(avg);
+        return ret;
+    }
+
+    if (analyze_open(input)) {
+        free(avg);
+        return -1;
+    }
+    while ((ret = analyze_next(input, &sample)) == 1) {
+        int b = bucket_of(sample.realtime_ns, summary->first_ns, summary->last_ns, buckets);
+        const struct analyze_bucket_t *next;
+        double ax, ay, bx, by, area;
+
+        if (b < bucket)
+            b = bucket;
+        next = &avg[b + 1];
+
+        if (index++ == 0) {
+            point_from_sample(&prev, &sample);
+            points[(*num_points)++] = prev;
+            continue;
+        }
+        if ((b != bucket) && (bucket >= 0) && (best_area >= 0)) {
+            points[(*num_points)++] = best;
+            prev = best;
+            best_area = -1;
+        }
+        bucket = b;
+        if (index == summary->samples)
+            break;
+        ax = (double)(prev.realtime_ns - summary->first_ns);
+        ay = prev.value_ms;
+        bx = (double)(sample.realtime_ns - summary->first_ns);
+        by = sample.duration_us / 1000.0;
+        area = fabs((ax - next->time) * (by - ay) - (ax - bx) * (next->value - ay));
+        if (area > best_area) {
+            best_area = area;
+            point_from_sample(&best, &sample);
+        }
+    }
+    if (best_area >= 0)
+        points[(*num_points)++] = best;
+    if ((ret >= 0) && (index > 1))
+        point_from_sample(&points[(*num_points)++], &sample);
+    analyze_close(input);
+    free(avg);
+    return ret < 0 ? ret : 0;
+}
+
+
+static void write_csv(const struct analyze_point_t *points, size_t num_points, FILE *stream)
+{
+    char buf[64];
+    size_t i;
+
+    fprintf(stream, "epoch_s,time,charge_ms,state,timeout\n");
+    for (i = 0; i < num_points; i++) {
+        format_time(points[i].realtime_ns, buf, sizeof(buf));
+        fprintf(stream, "%.3f,%s,%.3f,%u,%u\n", points[i].realtime_ns / 1e9, buf,
+                points[i].value_ms, points[i].state, points[i].timeout);
+    }
+}
+
+
+static void write_svg(const struct analyze_input_t *input, const struct analyze_summary_t *summary,
+                      const struct analyze_point_t *points, size_t num_points, FILE *stream)
+{
+    const struct rawlog_info_t *info = &(input->reader.info);
+    double width = ANALYZE_SVG_WIDTH - 2 * ANALYZE_SVG_MARGIN;
+    double height = ANALYZE_SVG_HEIGHT - 2 * ANALYZE_SVG_MARGIN;
+    double span = (double)(summary->last_ns - summary->first_ns);
+    double max_ms = summary->max_us / 1000.0;
+    char buf[64];
+    size_t i;
+
+    if (span <= 0)
+        span = 1;
+    if (max_ms <= 0)
+        max_ms = 1;
+#define SVG_X(t) (ANALYZE_SVG_MARGIN + (double)((t) - summary->first_ns) * width / span)
+#define SVG_Y(v) (ANALYZE_SVG_MARGIN + height - (v) * height / max_ms)
+
+    fprintf(stream, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" font-family=\"sans-serif\" font-size=\"12\">\n",
+            ANALYZE_SVG_WIDTH, ANALYZE_SVG_HEIGHT);
+    fprintf(stream, "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n");
+    fprintf(stream, "<text x=\"%d\" y=\"20\">LDR log %s</text>\n", ANALYZE_SVG_MARGIN, input->path);
+    fprintf(stream, "<rect x=\"%d\" y=\"%d\" width=\"%.0f\" height=\"%.0f\" fill=\"none\" stroke=\"gray\"/>\n",
+            ANALYZE_SVG_MARGIN, ANALYZE_SVG_MARGIN, width, height);
+    fprintf(stream, "<text x=\"5\" y=\"%d\">%.1f ms</text>\n", ANALYZE_SVG_MARGIN + 4, max_ms);
+    fprintf(stream, "<text x=\"5\" y=\"%.0f\">0 ms</text>\n", ANALYZE_SVG_MARGIN + height + 4);
+    format_time(summary->first_ns, buf, sizeof(buf));
+    fprintf(stream, "<text x=\"%d\" y=\"%d\">%s</text>\n", ANALYZE_SVG_MARGIN,
+            ANALYZE_SVG_HEIGHT - ANALYZE_SVG_MARGIN / 2, buf);
+    format_time(summary->last_ns, buf, sizeof(buf));
+    fprintf(stream, "<text x=\"%d\" y=\"%d\" text-anchor=\"end\">%s</text>\n", ANALYZE_SVG_WIDTH - ANALYZE_SVG_MARGIN,
+            ANALYZE_SVG_HEIGHT - ANALYZE_SVG_MARGIN / 2, buf);
+    if (info->high_threshold_us && (info->high_threshold_us / 1000.0 <= max_ms))
+        fprintf(stream, "<line x1=\"%d\" x2=\"%.0f\" y1=\"%.1f\" y2=\"%.1f\" stroke=\"orange\" stroke-dasharray=\"4\"/>\n",
+                ANALYZE_SVG_MARGIN, ANALYZE_SVG_MARGIN + width,
+                SVG_Y(info->high_threshold_us / 1000.0), SVG_Y(info->high_threshold_us / 1000.0));
+    if (info->low_threshold_us && (info->low_threshold_us / 1000.0 <= max_ms))
+        fprintf(stream, "<line x1=\"%d\" x2=\"%.0f\" y1=\"%.1f\" y2=\"%.1f\" stroke=\"orange\" stroke-dasharray=\"4\"/>\n",
+                ANALYZE_SVG_MARGIN, ANALYZE_SVG_MARGIN + width,
+                SVG_Y(info->low_threshold_us / 1000.0), SVG_Y(info->low_threshold_us / 1000.0));
+
+    // state as a step line, dark at the top
+    fprintf(stream, "<polyline fill=\"none\" stroke=\"green\" points=\"");
+    for (i = 0; i < num_points; i++) {
+        double y = ANALYZE_SVG_MARGIN + height - (points[i].state == LDR_DARK ? height * 0.9 : height * 0.1);
+        if (i > 0)
+            fprintf(stream, "%.1f,%.1f ", SVG_X(points[i].realtime_ns),
+                    ANALYZE_SVG_MARGIN + height - (points[i - 1].state == LDR_DARK ? height * 0.9 : height * 0.1));
+        fprintf(stream, "%.1f,%.1f ", SVG_X(points[i].realtime_ns), y);
+    }
+    fprintf(stream, "\"/>\n");
+    fprintf(stream, "<polyline fill=\"none\" stroke=\"blue\" points=\"");
+    for (i = 0; i < num_points; i++)
+        fprintf(stream, "%.1f,%.1f ", SVG_X(points[i].realtime_ns), SVG_Y(points[i].value_ms));
+    fprintf(stream, "\"/>\n");
+    for (i = 0; i < num_points; i++) {
+        if (points[i].timeout)
+            fprintf(stream, "<circle cx=\"%.1f\" cy=\"%.1f\" r=\"2\" fill=\"red\"/>\n",
+                    SVG_X(points[i].realtime_ns), SVG_Y(points[i].value_ms));
+    }
+    fprintf(stream, "</svg>\n");
+#undef SVG_X
+#undef SVG_Y
+}
+
+
+static void syntax(const char *progname)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [options]\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Reads raw logs recorded with ldr-reader -r or -R in constant memory. Prints a\n");
+    fprintf(stderr, "summary by default.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, " -r [filepath]   Raw log to read, v1, v2 or circular.\n");
+    fprintf(stderr, " -b [time]       Start of the time window. Local time as YYYY-MM-DD[ HH:MM[:SS]],\n");
+    fprintf(stderr, "                 or @ and seconds since epoch. Example: \"2024-06-01 18:00\"\n");
+    fprintf(stderr, " -e [time]       End of the time window.\n");
+    fprintf(stderr, " -t              List state transitions instead of the summary.\n");
+    fprintf(stderr, " -s [points]     Output a series downsampled to about this many points instead of\n");
+    fprintf(stderr, "                 the summary. Default %d\n", ANALYZE_DEFAULT_POINTS);
+    fprintf(stderr, " -m [method]     Downsampling method, lttb or minmax. Default lttb\n");
+    fprintf(stderr, " -f [format]     Series format, csv or svg. Default csv\n");
+    fprintf(stderr, " -o [filepath]   Write output to file instead of stdout.\n");
+    fprintf(stderr, " -G [seconds]    Samples further apart than this are a gap. Default %d\n", ANALYZE_DEFAULT_GAP_S);
+    fprintf(stderr, " -p [period]     Sampling period in milliseconds assumed for v1 logs, which have\n");
+    fprintf(stderr, "                 no timestamps. Time starts at epoch. Default %d\n", LDR_DEFAULT_MIN_PERIOD_MS);
+    fprintf(stderr, " -v              Increase verbose mode (can set multiple times)\n");
+    fprintf(stderr, " -h              Display this help page\n");
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *progname = argv[0];
+    log_level_t new_log_level = LOG_INFO;
+    struct analyze_input_t input;
+    struct analyze_summary_t summary;
+    struct analyze_point_t *points = NULL;
+    const char *output_file = NULL;
+    FILE *stream = stdout;
+    unsigned char transitions = 0;
+    unsigned int max_points = 0;
+    int method = ANALYZE_METHOD_LTTB;
+    int format = ANALYZE_FORMAT_CSV;
+    unsigned int gap_s = ANALYZE_DEFAULT_GAP_S;
+    size_t num_points = 0;
+    int ret = 0;
+    int opt;
+
+    memset(&input, 0, sizeof(input));
+    input.v1_period_ms = LDR_DEFAULT_MIN_PERIOD_MS;
+    input.begin_ns = INT64_MIN;
+    input.end_ns = INT64_MAX;
+
+    while (((opt = getopt(argc, argv, "r:b:e:ts:m:f:o:G:p:vh")) != -1))
+    {
+        switch (opt)
+        {
+            case 'r':
+                input.path = optarg;
+                break;
+            case 'b':
+                if (parse_time(optarg, &input.begin_ns)) {
+                    LOG_ERROR("Error: invalid time: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            case 'e':
+                if (parse_time(optarg, &input.end_ns)) {
+                    LOG_ERROR("Error: invalid time: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            case 't':
+                transitions = 1;
+                break;
+            case 's':
+                if ((sscanf(optarg, "%u", &max_points) != 1) || (max_points < 4) ||
+                    (max_points > ANALYZE_MAX_POINTS)) {
+                    LOG_ERROR("Error: number of points must be between 4 and %d: %s\n", ANALYZE_MAX_POINTS, optarg);
+                    syntax(progname);
+                }
+                break;
+            case 'm':
+                if (strcmp(optarg, "lttb") == 0)
+                    method = ANALYZE_METHOD_LTTB;
+                else if (strcmp(optarg, "minmax") == 0)
+                    method = ANALYZE_METHOD_MINMAX;
+                else {
+                    LOG_ERROR("Error: unknown downsampling method: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            case 'f':
+                if (strcmp(optarg, "csv") == 0)
+                    format = ANALYZE_FORMAT_CSV;
+                else if (strcmp(optarg, "svg") == 0)
+                    format = ANALYZE_FORMAT_SVG;
+                else {
+                    LOG_ERROR("Error: unknown format: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            case 'o':
+                output_file = optarg;
+                break;
+            case 'G':
+                if (sscanf(optarg, "%u", &gap_s) != 1) {
+                    LOG_ERROR("Error: invalid gap: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            case 'p':
+                if ((sscanf(optarg, "%u", &input.v1_period_ms) != 1) || (input.v1_period_ms == 0)) {
+                    LOG_ERROR("Error: invalid sampling period: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            case 'v': new_log_level++; set_log_level(new_log_level); break;
+            case 'h': // fall through
+            default:
+                syntax(progname);
+                break;
+        }
+    }
+    if (input.path == NULL) {
+        LOG_ERROR("Error: no raw log given\n");
+        syntax(progname);
+    }
+    if ((format == ANALYZE_FORMAT_SVG) && (max_points == 0))
+        max_points = ANALYZE_DEFAULT_POINTS;
+    if (input.end_ns < input.begin_ns) {
+        LOG_ERROR("Error: the time window ends before it starts\n");
+        exit(EXIT_FAILURE);
+    }
+    if (output_file) {
+        stream = fopen(output_file, "w");
+        if (stream == NULL) {
+            LOG_ERROR("Error: Failed to open %s\n", output_file);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // the summary also finds the time range and the scale of the series
+    if (analyze_summary(&input, gap_s, &summary) < 0) {
+        ret = -1;
+        goto clean_up;
+    }
+
+    if (transitions) {
+        if (print_transitions(&input, stream) < 0)
+            ret = -1;
+    } else if (max_points) {
+        points = malloc(max_points * sizeof(struct analyze_point_t));
+        if (points == NULL) {
+            LOG_ERROR("Error: Out of memory for %u points\n", max_points);
+            ret = -1;
+            goto clean_up;
+        }
+        if (summary.samples <= max_points)
+            ret = series_minmax(&input, &summary, points, summary.samples * 2, &num_points);
+        else if (method == ANALYZE_METHOD_MINMAX)
+            ret = series_minmax(&input, &summary, points, max_points, &num_points);
+        else
+            ret = series_lttb(&input, &summary, points, max_points, &num_points);
+        if (ret < 0)
+            goto clean_up;
+        LOG_VERBOSE("%llu samples downsampled to %zu points\n",
+                    (unsigned long long)summary.samples, num_points);
+        if (format == ANALYZE_FORMAT_SVG)
+            write_svg(&input, &summary, points, num_points, stream);
+        else
+            write_csv(points, num_points, stream);
+    } else {
+        print_summary(&input, &summary, gap_s, stream);
+    }
+
+clean_up:
+    free(points);
+    if (stream != stdout)
+        fclose(stream);
+    exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+}
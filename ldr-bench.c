@@ -0,0 +1,619 @@
+/*
+ *    Filename: ldr-bench.c
+ * Description: Microbenchmarks of the measurement path on a fake sysfs GPIO tree.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "sysfsgpio.h"
+#include "rawlog.h"
+#include "ldr.h"
+
+
+#define BENCH_GPIO                  17
+#define BENCH_DEFAULT_CYCLES        20000
+#define BENCH_DEFAULT_UPDATES       2000000
+#define BENCH_DEFAULT_RECORDS       1000000
+#define BENCH_DEFAULT_REPEATS       15
+#define BENCH_MAX_REPEATS           64
+#define BENCH_DEFAULT_THRESHOLD_PCT 50
+#define BENCH_SIZE_RECORDS          8192
+#define BENCH_MAX_RESULTS           16
+
+
+struct bench_result_t
+{
+    const char *name;
+    double value;
+    const char *unit;
+    int higher_is_better;
+    int exact;                  // a count, compared without tolerance
+    double runs[BENCH_MAX_REPEATS];
+    int num_runs;
+};
+
+static struct bench_result_t results[BENCH_MAX_RESULTS];
+static int num_results = 0;
+static unsigned char recording = 0;    // off for the warm-up run
+
+
+/*
+ * syscall counting, the I/O calls of the objects linked in are wrapped
+ * with ld --wrap, see the Makefile
+ */
+
+static unsigned char counting = 0;
+static uint64_t syscalls = 0;
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+off_t __real_lseek(int fd, off_t offset, int whence);
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+ssize_t __wrap_read(int fd, void *buf, size_t count)
+{
+    if (counting)
+        syscalls++;
+    return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count)
+{
+    if (counting)
+        syscalls++;
+    return __real_write(fd, buf, count);
+}
+
+off_t __wrap_lseek(int fd, off_t offset, int whence)
+{
+    if (counting)
+        syscalls++;
+    return __real_lseek(fd, offset, whence);
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    if (counting)
+        syscalls++;
+    return __real_poll(fds, nfds, timeout);
+}
+
+
+// every repetition adds a run, the result is the median of the runs
+static void bench_add(const char *name, double value, const char *unit, int higher_is_better, int exact)
+{
+    struct bench_result_t *result;
+    int i;
+
+    if (!recording)
+        return;
+    for (i = 0; i < num_results; i++) {
+        if (strcmp(results[i].name, name) == 0)
+            break;
+    }
+    if (i == num_results) {
+        if (num_results >= BENCH_MAX_RESULTS)
+            return;
+        num_results++;
+    }
+    result = &results[i];
+    result->name = name;
+    result->unit = unit;
+    result->higher_is_better = higher_is_better;
+    result->exact = exact;
+    if (result->num_runs < BENCH_MAX_REPEATS)
+        result->runs[result->num_runs++] = value;
+    LOG_VERBOSE("%s: %.3f %s\n", name, value, unit);
+}
+
+
+static int bench_double_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+static void bench_finish(void)
+{
+    int i;
+
+    for (i = 0; i < num_results; i++) {
+        struct bench_result_t *result = &results[i];
+        qsort(result->runs, result->num_runs, sizeof(double), bench_double_cmp);
+        result->value = result->runs[result->num_runs / 2];
+    }
+}
+
+
+static double bench_elapsed_ns(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+
+/*
+ * fake sysfs tree
+ */
+
+static const char *gpio_files[] = { "direction", "edge", "value", "active_low" };
+#define NUM_GPIO_FILES  ((int)(sizeof(gpio_files) / sizeof(gpio_files[0])))
+
+static int bench_write_file(const char *dir, const char *name, const char *content)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("Error: failed to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    __real_write(fd, content, strlen(content));
+    close(fd);
+    return 0;
+}
+
+
+static int bench_tree_create(const char *root)
+{
+    char gpio_dir[PATH_MAX];
+    int ret = 0;
+    int i;
+
+    snprintf(gpio_dir, sizeof(gpio_dir), "%s/gpio%d", root, BENCH_GPIO);
+    if (mkdir(gpio_dir, 0755) && (errno != EEXIST)) {
+        LOG_ERROR("Error: failed to create %s: %s\n", gpio_dir, strerror(errno));
+        return -1;
+    }
+    ret |= bench_write_file(root, "export", "");
+    ret |= bench_write_file(root, "unexport", "");
+    for (i = 0; i < NUM_GPIO_FILES; i++)
+        ret |= bench_write_file(gpio_dir, gpio_files[i], (i == 2) ? "1\n" : "0\n");
+    return ret;
+}
+
+
+static void bench_tree_remove(const char *root)
+{
+    char path[PATH_MAX];
+    int i;
+
+    for (i = 0; i < NUM_GPIO_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/gpio%d/%s", root, BENCH_GPIO, gpio_files[i]);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/gpio%d", root, BENCH_GPIO);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/export", root);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/unexport", root);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/raw.log", root);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/size.log", root);
+    unlink(path);
+    rmdir(root);
+}
+
+
+/*
+ * benchmarks
+ */
+
+// One measurement cycle through the sysfs backend without the waits:
+// drain, charge, edge, state update and idle. Regular files never raise
+// POLLPRI, so the edge is read directly instead of polled for.
+static int bench_cycle(unsigned int cycles)
+{
+    struct ldr_sensor_t ldr;
+    struct timespec start;
+    struct timespec now;
+    unsigned int warmup = cycles / 10;
+    uint64_t cycle_syscalls;
+    unsigned int i;
+
+    if (ldr_init(&ldr, BENCH_GPIO, &ldr_sysfs_ops, NULL)) {
+        LOG_ERROR("Error: failed to open the fake GPIO %d\n", BENCH_GPIO);
+        return -1;
+    }
+    ldr_configure(&ldr, LDR_DEFAULT_HIGH_THRESHOLD_US, LDR_DEFAULT_LOW_THRESHOLD_US,
+                  LDR_DEFAULT_COMPLETE_DARKNESS_THRESHOLD_US, LDR_DEFAULT_HIGH_DURATION_MS,
+                  LDR_DEFAULT_LOW_DURATION_MS, LDR_DEFAULT_COMPLETE_DARKNESS_DURATION_MS);
+
+    for (i = 0; i < warmup + cycles; i++) {
+        if (i == warmup) {
+            syscalls = 0;
+            counting = 1;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        ldr.ops->drain(&ldr);
+        ldr.ops->charge(&ldr, &(ldr.charge_start_time));
+        ldr.ops->read_edge(&ldr, &now);
+        ldr_update_state(&ldr, (ldr_duration_t)timespec_diff_us(&now, &(ldr.charge_start_time)), &now);
+        ldr.ops->idle(&ldr);
+    }
+    bench_add("cycle_ns", bench_elapsed_ns(&start) / cycles, "ns", 0, 0);
+    counting = 0;
+    cycle_syscalls = syscalls;
+    bench_add("syscalls_per_cycle", (double)cycle_syscalls / cycles, "calls", 0, 1);
+
+    ldr_cleanup(&ldr);
+    return 0;
+}
+
+
+// The state machine alone, fed charge times that cross the thresholds
+// every few hundred samples so both debounce paths run.
+static int bench_update_state(unsigned int updates)
+{
+    struct ldr_sensor_t ldr;
+    struct timespec start;
+    struct timespec now = { 0, 0 };
+    unsigned int i;
+
+    ldr_reset(&ldr);
+    ldr_configure(&ldr, LDR_DEFAULT_HIGH_THRESHOLD_US, LDR_DEFAULT_LOW_THRESHOLD_US,
+                  LDR_DEFAULT_COMPLETE_DARKNESS_THRESHOLD_US, 100, 100, 50);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < updates; i++) {
+        ldr_duration_t duration_us = ((i / 256) & 1) ? 200000 + (i & 0xff) : 20000 + (i & 0xff);
+        now.tv_nsec += 10000000;
+        if (now.tv_nsec >= 1000000000) {
+            now.tv_nsec -= 1000000000;
+            now.tv_sec++;
+        }
+        ldr_update_state(&ldr, duration_us, &now);
+    }
+    bench_add("update_state_per_s", updates / (bench_elapsed_ns(&start) / 1e9), "updates/s", 1, 0);
+    return 0;
+}
+
+
+// Appends as fast as the writer thread keeps up, keeping the ring at
+// most half full so no record is dropped.
+static int bench_rawlog(const char *dir, unsigned int records)
+{
+    struct rawlog_config_t config;
+    struct rawlog_info_t info;
+    struct rawlog_t *log;
+    struct timespec start;
+    char path[PATH_MAX];
+    uint64_t dropped;
+    double append_ns = 0;
+    double elapsed_ns;
+    unsigned int i;
+
+    snprintf(path, sizeof(path), "%s/raw.log", dir);
+    unlink(path);
+    rawlog_default_config(&config);
+    config.flush_interval_ms = 10;
+    memset(&info, 0, sizeof(info));
+    info.gpio = BENCH_GPIO;
+    info.high_threshold_us = LDR_DEFAULT_HIGH_THRESHOLD_US;
+    info.low_threshold_us = LDR_DEFAULT_LOW_THRESHOLD_US;
+    info.complete_darkness_threshold_us = LDR_DEFAULT_COMPLETE_DARKNESS_THRESHOLD_US;
+    log = rawlog_open(path, &config, &info);
+    if (log == NULL)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < records; i++) {
+        struct timespec append_start;
+        // a slowly drifting reading, sampled every 350 ms
+        uint32_t duration_us = 50000 + ((i / 64) % 1000) * 10 + (i % 3);
+
+        if ((i % (RAWLOG_RING_SIZE / 2)) == 0) {
+            while (__atomic_load_n(&(log->records_written), __ATOMIC_RELAXED) + RAWLOG_RING_SIZE / 2 < i)
+                usleep(100);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &append_start);
+        rawlog_append(log, (uint64_t)i * 350000, duration_us, LDR_BRIGHT, 0);
+        append_ns += bench_elapsed_ns(&append_start);
+    }
+    // the log is freed on close, so wait for the writer to catch up
+    while (__atomic_load_n(&(log->records_written), __ATOMIC_RELAXED) +
+           __atomic_load_n(&(log->records_dropped), __ATOMIC_RELAXED) < records)
+        usleep(100);
+    elapsed_ns = bench_elapsed_ns(&start);
+    dropped = __atomic_load_n(&(log->records_dropped), __ATOMIC_RELAXED);
+    rawlog_close(log);
+
+    bench_add("rawlog_records_per_s", records / (elapsed_ns / 1e9), "records/s", 1, 0);
+    bench_add("rawlog_append_ns", append_ns / records, "ns", 0, 0);
+    bench_add("rawlog_records_dropped", (double)dropped, "records", 0, 1);
+    return 0;
+}
+
+
+// The size of a log at the default flush interval. Only the records
+// sampled within one interval are written together, so the writer is
+// woken by count and waited for after every interval's worth. The
+// readings and the sample times jitter like real ones do, so runs and
+// small differences do not make the log look smaller than it is.
+static int bench_rawlog_size(const char *dir, const char *name, unsigned int period_ms)
+{
+    struct rawlog_config_t config;
+    struct rawlog_info_t info;
+    struct rawlog_t *log;
+    struct stat st;
+    char path[PATH_MAX];
+    uint32_t seed = 1;
+    unsigned int i;
+
+    snprintf(path, sizeof(path), "%s/size.log", dir);
+    unlink(path);
+    rawlog_default_config(&config);
+    config.flush_records = config.flush_interval_ms / period_ms;
+    if (config.flush_records == 0)
+        config.flush_records = 1;
+    // only the count triggers a flush
+    config.flush_interval_ms = 3600000;
+    memset(&info, 0, sizeof(info));
+    info.gpio = BENCH_GPIO;
+    info.high_threshold_us = LDR_DEFAULT_HIGH_THRESHOLD_US;
+    info.low_threshold_us = LDR_DEFAULT_LOW_THRESHOLD_US;
+    info.complete_darkness_threshold_us = LDR_DEFAULT_COMPLETE_DARKNESS_THRESHOLD_US;
+    log = rawlog_open(path, &config, &info);
+    if (log == NULL)
+        return -1;
+
+    for (i = 0; i < BENCH_SIZE_RECORDS; i++) {
+        uint32_t duration_us;
+        uint64_t timestamp_us;
+
+        // +-30 us of noise on the reading, +-2 ms on the sample time
+        seed = seed * 1103515245 + 12345;
+        duration_us = 50000 + ((i / 64) % 1000) * 10 + (seed >> 16) % 61 - 30;
+        timestamp_us = (uint64_t)i * period_ms * 1000 + ((seed >> 8) & 0xFF) % 5 * 1000;
+        rawlog_append(log, timestamp_us, duration_us, LDR_BRIGHT, 0);
+        if (((i + 1) % config.flush_records) == 0) {
+            while (__atomic_load_n(&(log->records_written), __ATOMIC_RELAXED) < i + 1)
+                usleep(50);
+        }
+    }
+    rawlog_close(log);
+    if (stat(path, &st)) {
+        LOG_ERROR("Error: failed to stat %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    bench_add(name, (double)(st.st_size - RAWLOG_V2_HEADER_SIZE) / BENCH_SIZE_RECORDS, "bytes", 0, 1);
+    return 0;
+}
+
+
+/*
+ * results
+ */
+
+static int bench_write_json(const char *path)
+{
+    FILE *stream = stdout;
+    int i;
+
+    if (path) {
+        stream = fopen(path, "w");
+        if (stream == NULL) {
+            LOG_ERROR("Error: failed to open %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+    // one benchmark per line, bench_compare() relies on it
+    fprintf(stream, "{\n  \"benchmarks\": [\n");
+    for (i = 0; i < num_results; i++) {
+        fprintf(stream, "    {\"name\": \"%s\", \"value\": %.3f, \"unit\": \"%s\", \"better\": \"%s\", "
+                "\"exact\": %s}%s\n",
+                results[i].name, results[i].value, results[i].unit,
+                results[i].higher_is_better ? "higher" : "lower",
+                results[i].exact ? "true" : "false",
+                (i + 1 < num_results) ? "," : "");
+    }
+    fprintf(stream, "  ]\n}\n");
+    if (path)
+        fclose(stream);
+    return 0;
+}
+
+
+// Compares with a previous JSON output. Returns the number of results
+// that got worse, by more than threshold_pct for timings and at all for
+// exact counts, or -1 if error.
+static int bench_compare(const char *path, double threshold_pct)
+{
+    char line[512];
+    FILE *fp;
+    int regressions = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        LOG_ERROR("Error: failed to open baseline %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char name[64];
+        double baseline;
+        double value;
+        double change_pct;
+        double limit_pct;
+        int i;
+
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"value\": %lf", name, &baseline) != 2)
+            continue;
+        for (i = 0; i < num_results; i++) {
+            if (strcmp(results[i].name, name) == 0)
+                break;
+        }
+        if (i == num_results)
+            continue;
+        // counts are compared as written, to the third decimal
+        value = results[i].exact ? round(results[i].value * 1000) / 1000 : results[i].value;
+        limit_pct = results[i].exact ? 0 : threshold_pct;
+        // positive is worse
+        if (baseline == 0)
+            change_pct = (value == 0) ? 0 : (results[i].higher_is_better ? -100 : 100);
+        else
+            change_pct = (value - baseline) / baseline * 100;
+        if (results[i].higher_is_better)
+            change_pct = -change_pct;
+        LOG_ERROR("%-28s %14.3f -> %14.3f %-10s %+7.1f%%%s\n", name, baseline, value,
+                  results[i].unit, results[i].higher_is_better ? -change_pct : change_pct,
+                  (change_pct > limit_pct) ? "  REGRESSION" : "");
+        if (change_pct > limit_pct)
+            regressions++;
+    }
+    fclose(fp);
+    return regressions;
+}
+
+
+static void syntax(const char *progname)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [options]\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Benchmarks the measurement path against a fake sysfs GPIO tree and prints\n");
+    fprintf(stderr, "the results as JSON. Every result is the median of the repetitions, after\n");
+    fprintf(stderr, "a warm-up run. With a baseline, exits with status 2 if any timing is worse\n");
+    fprintf(stderr, "than the threshold, or any exact count such as syscalls per cycle is worse\n");
+    fprintf(stderr, "at all.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, " -d [dir]        Directory for the fake GPIO tree and the raw log, removed\n");
+    fprintf(stderr, "                 afterwards. Default a new directory in /dev/shm, or /tmp\n");
+    fprintf(stderr, " -n [cycles]     Measurement cycles. Default %d\n", BENCH_DEFAULT_CYCLES);
+    fprintf(stderr, " -u [updates]    State machine updates. Default %d\n", BENCH_DEFAULT_UPDATES);
+    fprintf(stderr, " -r [records]    Raw log records. Default %d\n", BENCH_DEFAULT_RECORDS);
+    fprintf(stderr, " -R [runs]       Repetitions of every benchmark, up to %d. Default %d\n",
+            BENCH_MAX_REPEATS, BENCH_DEFAULT_REPEATS);
+    fprintf(stderr, " -o [filepath]   Write the JSON results to a file instead of stdout\n");
+    fprintf(stderr, " -B [filepath]   Baseline JSON results to compare with\n");
+    fprintf(stderr, " -t [percent]    Regression threshold of the timings. Default %d\n", BENCH_DEFAULT_THRESHOLD_PCT);
+    fprintf(stderr, " -v              Increase verbose mode (can set multiple times)\n");
+    fprintf(stderr, " -h              Display this help page\n");
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *progname = argv[0];
+    log_level_t new_log_level = LOG_INFO;
+    char dir_template[PATH_MAX];
+    const char *dir = NULL;
+    const char *output = NULL;
+    const char *baseline = NULL;
+    double threshold_pct = BENCH_DEFAULT_THRESHOLD_PCT;
+    unsigned int cycles = BENCH_DEFAULT_CYCLES;
+    unsigned int updates = BENCH_DEFAULT_UPDATES;
+    unsigned int records = BENCH_DEFAULT_RECORDS;
+    unsigned int repeats = BENCH_DEFAULT_REPEATS;
+    unsigned int run;
+    int ret = 0;
+    int opt;
+
+    while (((opt = getopt(argc, argv, "d:n:u:r:R:o:B:t:vh")) != -1))
+    {
+        switch (opt)
+        {
+            case 'd': dir = optarg; break;
+            case 'n': cycles = strtoul(optarg, NULL, 10); break;
+            case 'u': updates = strtoul(optarg, NULL, 10); break;
+            case 'r': records = strtoul(optarg, NULL, 10); break;
+            case 'R': repeats = strtoul(optarg, NULL, 10); break;
+            case 'o': output = optarg; break;
+            case 'B': baseline = optarg; break;
+            case 't': threshold_pct = atof(optarg); break;
+            case 'v': new_log_level++; set_log_level(new_log_level); break;
+            case 'h':
+            default:
+                syntax(progname);
+                break;
+        }
+    }
+    if ((cycles == 0) || (updates == 0) || (records == 0)) {
+        LOG_ERROR("Error: counts must be positive\n");
+        syntax(progname);
+    }
+    if ((repeats == 0) || (repeats > BENCH_MAX_REPEATS)) {
+        LOG_ERROR("Error: repetitions must be 1 to %d\n", BENCH_MAX_REPEATS);
+        syntax(progname);
+    }
+
+    if (dir) {
+        if (mkdir(dir, 0755) && (errno != EEXIST)) {
+            LOG_ERROR("Error: failed to create %s: %s\n", dir, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    } else {
+        struct stat st;
+        // tmpfs, like sysfs, never touches a disk
+        snprintf(dir_template, sizeof(dir_template), "%s/ldr-bench.XXXXXX",
+                 (stat("/dev/shm", &st) == 0) ? "/dev/shm" : "/tmp");
+        dir = mkdtemp(dir_template);
+        if (dir == NULL) {
+            LOG_ERROR("Error: failed to create a temporary directory: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+    if (bench_tree_create(dir) || gpio_set_root(dir)) {
+        bench_tree_remove(dir);
+        return EXIT_FAILURE;
+    }
+
+    // the first run only warms up the caches and the CPU clock
+    for (run = 0; (run <= repeats) && (ret == 0); run++) {
+        recording = (run > 0);
+        if (bench_cycle(cycles) || bench_update_state(updates) || bench_rawlog(dir, records))
+            ret = -1;
+    }
+    // the sizes do not depend on timing, one run is enough
+    if ((ret == 0) &&
+        (bench_rawlog_size(dir, "rawlog_bytes_per_record", LDR_DEFAULT_MIN_PERIOD_MS) ||
+         bench_rawlog_size(dir, "rawlog_bytes_per_record_idle", LDR_DEFAULT_MAX_PERIOD_MS)))
+        ret = -1;
+    bench_tree_remove(dir);
+    if (ret)
+        return EXIT_FAILURE;
+    bench_finish();
+
+    if (bench_write_json(output))
+        return EXIT_FAILURE;
+    if (baseline) {
+        int regressions = bench_compare(baseline, threshold_pct);
+        if (regressions < 0)
+            return EXIT_FAILURE;
+        if (regressions > 0) {
+            LOG_ERROR("%d regression(s)\n", regressions);
+            return 2;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+/*
+ *    Filename: ldr-plugin.h
+ * Description: Plugin ABI for in-process ldr-reader actions.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _LDR_PLUGIN_H_
+#define _LDR_PLUGIN_H_
+
+// This is the only header a plugin needs. A plugin is a shared object
+// loaded with "ldr-reader -P plugin.so[:args]" that exports
+//
+//     const struct ldr_plugin_t *ldr_plugin_entry(void);
+//
+// All hooks are called from the ldr-reader event loop thread, right when
+// the event happens. They must not block: anything slow belongs in a
+// thread of the plugin's own. Any hook may be NULL.
+//
+// The ABI version is bumped whenever this structure or the meaning of a
+// hook changes, plugins built for another version are refused.
+
+#include <stdint.h>
+#include <time.h>
+
+#define LDR_PLUGIN_ABI_VERSION      1
+#define LDR_PLUGIN_ENTRY            "ldr_plugin_entry"
+
+// same values as the states printed by ldr-reader
+#define LDR_PLUGIN_STATE_UNKNOWN    0
+#define LDR_PLUGIN_STATE_BRIGHT     1
+#define LDR_PLUGIN_STATE_DARK       2
+
+struct ldr_plugin_t
+{
+    uint32_t abi_version;       // LDR_PLUGIN_ABI_VERSION
+    const char *name;
+
+    // args is the text after the ':' of the -P option, or "".
+    // returns 0 if ok, anything else stops ldr-reader from starting.
+    int (*init)(void **priv, const char *args);
+    // the LDR changed state, time is CLOCK_REALTIME
+    void (*on_transition)(void *priv, int gpio, int state, uint32_t duration_us,
+                          const struct timespec *time);
+    // every charge time, timeout is set if the capacitor didn't charge
+    // in time. state is the state after this sample.
+    void (*on_sample)(void *priv, int gpio, int state, uint32_t duration_us,
+                      int timeout, const struct timespec *time);
+    void (*shutdown)(void *priv);
+};
+
+typedef const struct ldr_plugin_t *(*ldr_plugin_entry_t)(void);
+
+
+#endif // _LDR_PLUGIN_H_
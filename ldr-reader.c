@@ -23,11 +23,24 @@
 #include <wordexp.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 
 #include "utils.h"
 #include "list.h"
+#include "loop.h"
 #include "sysfsgpio.h"
+#include "gpiochip.h"
+#include "simgpio.h"
+#include "gpiomem.h"
 #include "ldr.h"
+#include "exec.h"
+#include "coproc.h"
+#include "plugin.h"
+#include "ctl.h"
+#include "shmpub.h"
+#include "metrics.h"
+#include "profile.h"
+#include "calib.h"
 
 
 
@@ -47,15 +60,54 @@ struct trigger_action_t
     const char *cmd_dark;
     wordexp_t cmd_bright_exp_result;
     wordexp_t cmd_dark_exp_result;
+    const char *cmd_handler;
+    wordexp_t cmd_handler_exp_result;
+    unsigned char handler_samples;
+    int fd_output_lines;            // all output pins as one chardev request, or -1 for sysfs
+    int num_output_gpio;
+    uint64_t output_updates;
+    uint64_t output_settle_us_total;
+    int64_t output_settle_us_max;
+};
+
+// thresholds of one sensor, checked and waiting to be applied
+struct control_setting_t
+{
+    int index;
+    ldr_duration_t high_us;
+    ldr_duration_t low_us;
+    ldr_duration_t dark_us;
+    unsigned int high_ms;
+    unsigned int low_ms;
 };
 
 
+static struct loop_source_t signal_src = { .fd = -1 };
+static struct exec_t executor = { .timer = { .fd = -1 } };
+static struct trigger_action_t action;
+static struct coproc_t handler;
+static struct plugin_t plugins[PLUGIN_MAX];
+static int num_plugins = 0;
+static struct ctl_t control;
+static unsigned char control_enabled = 0;
+static struct timespec start_time;
+static struct ldr_shm_t *shm_state = NULL;
+static struct metrics_t metrics;
+static unsigned char metrics_enabled = 0;
+static struct loop_source_t profile_timer = { .fd = -1 };
+static const char *profile_path = NULL;
+static unsigned int profile_interval_s = PROFILE_DEFAULT_INTERVAL_S;
+static struct calib_t calib;
+static unsigned char calib_enabled = 0;
+static const char *capture_path = NULL;
+static struct calib_capture_t captures[LDR_MAX_SENSORS];
+static struct ldr_sensor_t ldr[LDR_MAX_SENSORS];
+static int num_ldr = 0;
 
 static const unsigned char usable_gpio_pins[] =
 {
     2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,32,40
 };
-static unsigned char terminate = 0;
 
 
 static int append_output_gpio(struct list_head *gpio_list_head, int gpio, unsigned char inverted)
@@ -74,8 +126,14 @@ static int append_output_gpio(struct list_head *gpio_list_head, int gpio, unsign
 }
 
 
-static void remove_all_output_gpio(struct list_head *gpio_list_head)
+static void remove_all_output_gpio(struct trigger_action_t *action)
 {
+    struct list_head *gpio_list_head = &(action->gpio_list_head);
+
+    if (action->fd_output_lines >= 0) {
+        close(action->fd_output_lines);
+        action->fd_output_lines = -1;
+    }
     if (gpio_list_head)
     {
         struct output_gpio_t *output_gpio = NULL;
@@ -95,11 +153,38 @@ static void remove_all_output_gpio(struct list_head *gpio_list_head)
 }
 
 
-static int init_all_output_gpio(struct list_head *gpio_list_head)
+// with a GPIO chip, all output pins are requested together so they switch
+// at once, otherwise each pin is driven through sysfs.
+static int init_all_output_gpio(struct trigger_action_t *action, const char *chip_path)
 {
+    struct list_head *gpio_list_head = &(action->gpio_list_head);
     struct output_gpio_t *output_gpio = NULL;
     struct list_head *entry;
     int ret = 0;
+
+    action->num_output_gpio = 0;
+    if (chip_path) {
+        int offsets[GPIOCHIP_MAX_LINES];
+        uint64_t active_low_mask = 0;
+        int chip_fd;
+
+        list_for_each(entry, gpio_list_head) {
+            list_entry(entry, struct output_gpio_t, list, output_gpio);
+            if (output_gpio->active_low)
+                active_low_mask |= (uint64_t)1 << action->num_output_gpio;
+            offsets[action->num_output_gpio++] = output_gpio->gpio;
+        }
+        if (action->num_output_gpio == 0)
+            return 0;
+        chip_fd = gpiochip_open(chip_path);
+        if (chip_fd < 0)
+            return -1;
+        action->fd_output_lines = gpiochip_request_outputs(chip_fd, offsets,
+                                                           action->num_output_gpio, active_low_mask);
+        close(chip_fd);
+        return (action->fd_output_lines < 0) ? -1 : 0;
+    }
+
     list_for_each(entry, gpio_list_head) {
         list_entry(entry, struct output_gpio_t, list, output_gpio);
         ret |= gpio_export(output_gpio->gpio);
@@ -111,11 +196,48 @@ static int init_all_output_gpio(struct list_head *gpio_list_head)
         output_gpio->fd_gpio_value = gpio_open_value(output_gpio->gpio);
         if (output_gpio->fd_gpio_value < 0)
             return -1;
+        action->num_output_gpio++;
     }
     return 0;
 }
 
 
+static int set_all_output_gpio(struct trigger_action_t *action, int value)
+{
+    struct output_gpio_t *output_gpio = NULL;
+    struct list_head *entry;
+    struct timespec start, end;
+    int64_t settle_us;
+    int ret = 0;
+
+    if (action->num_output_gpio == 0)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (action->fd_output_lines >= 0) {
+        uint64_t mask = (action->num_output_gpio < 64) ?
+                        (((uint64_t)1 << action->num_output_gpio) - 1) : ~(uint64_t)0;
+        ret = gpiochip_set_values(action->fd_output_lines, value ? mask : 0, mask);
+    } else {
+        const char *gpio_str = value ? "1\n" : "0\n";
+        list_for_each(entry, &(action->gpio_list_head)) {
+            list_entry(entry, struct output_gpio_t, list, output_gpio);
+            ret |= gpio_write_string(output_gpio->fd_gpio_value, gpio_str, "value");
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // time from the first pin changing to the last
+    settle_us = timespec_diff_us(&end, &start);
+    action->output_updates++;
+    action->output_settle_us_total += settle_us;
+    if (settle_us > action->output_settle_us_max)
+        action->output_settle_us_max = settle_us;
+    LOG_VERBOSE("Set %d output GPIO pins to %d in %lld us\n", action->num_output_gpio,
+                value, (long long)settle_us);
+    return ret;
+}
+
+
 static int gpio_in_list(struct list_head *gpio_list_head, int gpio)
 {
     struct output_gpio_t *output_gpio = NULL;
@@ -129,9 +251,34 @@ static int gpio_in_list(struct list_head *gpio_list_head, int gpio)
 }
 
 
+static void parse_command(const char *cmd, wordexp_t *exp_result)
+{
+    switch (wordexp(cmd, exp_result, WRDE_NOCMD))
+    {
+        case 0:
+            break;
+        case WRDE_BADCHAR:
+            LOG_ERROR("Error: bad char: %s\n", cmd);
+            exit(EXIT_FAILURE);
+        case WRDE_CMDSUB:
+            LOG_ERROR("Error: command substitution not allowed: %s\n", cmd);
+            exit(EXIT_FAILURE);
+        case WRDE_NOSPACE:
+            LOG_ERROR("Error: failed to allocate memory: %s\n", cmd);
+            exit(EXIT_FAILURE);
+        case WRDE_SYNTAX:
+            LOG_ERROR("Error: syntax error: %s\n", cmd);
+            exit(EXIT_FAILURE);
+        default:
+            LOG_ERROR("Error: unknown error: %s\n", cmd);
+            exit(EXIT_FAILURE);
+    }
+}
+
+
 static void trigger_action_cleanup(struct trigger_action_t *action)
 {
-    remove_all_output_gpio(&(action->gpio_list_head));
+    remove_all_output_gpio(action);
     if (action->cmd_bright) {
         wordfree(&(action->cmd_bright_exp_result));
         action->cmd_bright = NULL;
@@ -140,6 +287,10 @@ static void trigger_action_cleanup(struct trigger_action_t *action)
         wordfree(&(action->cmd_dark_exp_result));
         action->cmd_dark = NULL;
     }
+    if (action->cmd_handler) {
+        wordfree(&(action->cmd_handler_exp_result));
+        action->cmd_handler = NULL;
+    }
 }
 
 
@@ -147,64 +298,361 @@ static void trigger_action_init(struct trigger_action_t *action)
 {
     memset(action, 0, sizeof(struct trigger_action_t));
     INIT_LIST_HEAD(&(action->gpio_list_head));
+    action->fd_output_lines = -1;
 }
 
 
-static void handle_terminate_signal(int sig)
+// position of the sensor in ldr[], callbacks only get the pointer
+static int ldr_index(const struct ldr_sensor_t *sensor)
 {
-    if ((sig == SIGTERM) || (sig == SIGINT))
-        terminate = 1;
+    return (int)(sensor - ldr);
 }
 
 
-static void ldr_trigger_cb(void *priv_data, ldr_state_t new_state)
+// a threshold in ms, in us with a 'us' suffix, or in lux with a 'lux'
+// suffix if a calibration is loaded
+static int parse_threshold(const char *str, ldr_duration_t *duration_us)
+{
+    size_t len = strlen(str);
+    char *end;
+    double lux;
+
+    if ((len > 3) && (strcmp(str + len - 3, "lux") == 0)) {
+        lux = strtod(str, &end);
+        if (!calib_enabled || (end != str + len - 3) || (lux < 0))
+            return -1;
+        return calib_duration_us(&calib, lux, duration_us);
+    }
+    return ldr_parse_duration_us(str, duration_us);
+}
+
+
+static void print_all_stats(const struct trigger_action_t *action)
+{
+    int i;
+    for (i = 0; i < num_ldr; i++)
+        ldr_print_stats(&ldr[i], stdout);
+    if (action->cmd_handler)
+        coproc_print_stats(&handler, stdout);
+    for (i = 0; i < num_plugins; i++)
+        plugin_print_stats(&plugins[i], stdout);
+    if (control_enabled)
+        ctl_print_stats(&control, stdout);
+#ifdef LDR_PROFILE
+    profile_dump(stdout);
+#endif
+    if (action->output_updates) {
+        fprintf(stdout, "Outputs: %d pins via %s, updates %llu, settle avg %llu us, max %lld us\n",
+                action->num_output_gpio, (action->fd_output_lines >= 0) ? "chardev" : "sysfs",
+                (unsigned long long)action->output_updates,
+                (unsigned long long)(action->output_settle_us_total / action->output_updates),
+                (long long)action->output_settle_us_max);
+    }
+    fflush(stdout);
+}
+
+
+#ifdef LDR_PROFILE
+static void profile_timer_cb(void *priv_data, uint32_t events)
+{
+    loop_timer_ack(&profile_timer);
+    profile_write(profile_path);
+    loop_timer_arm_us(&profile_timer, (uint64_t)profile_interval_s * 1000000);
+}
+#endif
+
+
+static void handle_signal(void *priv_data, uint32_t events)
+{
+    struct loop_t *loop = (struct loop_t *)priv_data;
+    int sig;
+
+    while ((sig = loop_signal_read(&signal_src)) > 0) {
+        if ((sig == SIGTERM) || (sig == SIGINT))
+            loop_stop(loop);
+        else if (sig == SIGUSR1)
+            print_all_stats(&action);
+        else if (sig == SIGCHLD) {
+            exec_reap(&executor);
+            coproc_reap(&handler);
+        }
+    }
+}
+
+
+static const char *state_name(ldr_state_t state)
+{
+    switch (state)
+    {
+        case LDR_BRIGHT: return "bright";
+        case LDR_DARK:   return "dark";
+        default:         return "unknown";
+    }
+}
+
+
+// one JSON object per line, time is the wall clock in seconds, for the
+// handler and control socket subscribers. samples carry a timeout flag,
+// and are dropped first if the handler lags.
+static void publish_event(const struct trigger_action_t *action, const struct ldr_sensor_t *ldr,
+                          int sample, ldr_duration_t duration_us, int timeout)
+{
+    const char *timeout_str = "";
+    char lux_str[32] = "";
+    struct timespec now;
+    char line[224];
+    int to_handler = sample ? action->handler_samples : (action->cmd_handler != NULL);
+    int to_control = control_enabled &&
+                     ctl_subscribed(&control, sample ? CTL_SUB_SAMPLES : CTL_SUB_TRANSITIONS);
+    int len;
+
+    if (!to_handler && !to_control)
+        return;
+    if (sample)
+        timeout_str = timeout ? ",\"timeout\":true" : ",\"timeout\":false";
+    // a reading that timed out is at least that dark, its lux a bound
+    if (calib_enabled)
+        snprintf(lux_str, sizeof(lux_str), ",\"%s\":%.2f", timeout ? "lux_max" : "lux",
+                 calib_lux(&calib, duration_us));
+    clock_gettime(CLOCK_REALTIME, &now);
+    len = snprintf(line, sizeof(line),
+                   "{\"event\":\"%s\",\"gpio\":%d,\"state\":\"%s\",\"duration_us\":%u%s%s,"
+                   "\"time\":%lld.%06ld}\n",
+                   sample ? "sample" : "transition", ldr->gpio, state_name(ldr->state),
+                   duration_us, lux_str, timeout_str, (long long)now.tv_sec, now.tv_nsec / 1000);
+    if (to_handler)
+        coproc_send(&handler, line, len, sample);
+    if (to_control)
+        ctl_publish(&control, sample ? CTL_SUB_SAMPLES : CTL_SUB_TRANSITIONS, line, len);
+}
+
+
+// readings up to the maximum timeout, so captures do not saturate
+static void ldr_full_range(int index, int enable)
+{
+    ldr[index].full_range = enable;
+    if (enable)
+        ldr[index].charge_timeout_us = ldr[index].max_charge_timeout_us;
+}
+
+
+static void ldr_sample_cb(void *priv_data, const struct ldr_sensor_t *ldr,
+                          ldr_duration_t duration_us, int timeout)
 {
     struct trigger_action_t *action = (struct trigger_action_t *)priv_data;
-    struct output_gpio_t *output_gpio = NULL;
-    struct list_head *entry;
-    int ret = 0;
-    const char *gpio_str;
+    struct timespec now;
+    int i;
 
-    LOG_INFO("LDR state: %d\n", new_state);
+    if (num_plugins || shm_state)
+        clock_gettime(CLOCK_REALTIME, &now);
+    if (metrics_enabled)
+        metrics_sample(&metrics, ldr_index(ldr), duration_us, timeout);
+    if (shm_state)
+        shmpub_sample(shm_state, ldr_index(ldr), ldr->state, duration_us, timeout, &now);
+    for (i = 0; i < num_plugins; i++)
+        plugin_sample(&plugins[i], ldr->gpio, ldr->state, duration_us, timeout, &now);
+    // a saturated reading is only a lower bound, useless as a point
+    if (capture_path && !timeout) {
+        char path[PATH_MAX];
+        if (num_ldr > 1)
+            snprintf(path, sizeof(path), "%s.%d", capture_path, ldr->gpio);
+        else
+            snprintf(path, sizeof(path), "%s", capture_path);
+        if (calib_capture_add(&captures[ldr_index(ldr)], duration_us, path, ldr->gpio))
+            ldr_full_range(ldr_index(ldr), 0);
+    }
+    publish_event(action, ldr, 1, duration_us, timeout);
+}
 
-    if (new_state == LDR_DARK)
-        gpio_str = "0\n";
-    else
-        gpio_str = "1\n";
 
-    list_for_each(entry, &(action->gpio_list_head)) {
-        list_entry(entry, struct output_gpio_t, list, output_gpio);
-        ret |= gpio_write_string(output_gpio->fd_gpio_value, gpio_str, "value");
+static void control_status(struct ctl_client_t *client)
+{
+    char buf[CTL_BUFFER_SIZE];
+    struct timespec now;
+    int len;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    len = snprintf(buf, sizeof(buf), "{\"uptime_s\":%lld,\"ldrs\":[",
+                   (long long)timespec_diff_ms(&now, &start_time) / 1000);
+    for (i = 0; i < num_ldr; i++) {
+        const struct ldr_sensor_t *l = &ldr[i];
+        len += snprintf(buf + len, sizeof(buf) - len,
+                        "%s{\"gpio\":%d,\"state\":\"%s\",\"last_us\":%u,"
+                        "\"high_us\":%u,\"low_us\":%u,\"dark_us\":%u,"
+                        "\"high_s\":%u,\"low_s\":%u,\"period_ms\":%llu,"
+                        "\"samples\":%llu,\"timeouts\":%llu,\"range_timeouts\":%llu,\"transitions\":%llu}",
+                        i ? "," : "", l->gpio, state_name(l->state), l->last_duration_us,
+                        l->high_threshold_us, l->low_threshold_us, l->complete_darkness_threshold_us,
+                        l->high_threshold_duration_ms / 1000, l->low_threshold_duration_ms / 1000,
+                        (unsigned long long)(l->period_us / 1000),
+                        (unsigned long long)l->stats.samples, (unsigned long long)l->stats.timeouts,
+                        (unsigned long long)l->stats.range_timeouts, (unsigned long long)l->stats.transitions);
     }
+    ctl_reply(client, "%s]}", buf);
+}
 
-    if (new_state == LDR_DARK) {
-        if (action->cmd_dark) {
-            pid_t pid = fork();
-            if (pid == 0) {
-                // This is the child process.  Execute the command.
-                execv(action->cmd_dark_exp_result.we_wordv[0], action->cmd_dark_exp_result.we_wordv);
-                exit(EXIT_FAILURE);
-            } else if (pid < 0) {
-                // The fork failed
-                LOG_ERROR("Error: fork failed: %s\n", action->cmd_dark);
-            } else {
-                // This is the parent process, do nothing.  */
+
+// set <gpio|all> high=ms low=ms dark=ms high_s=s low_s=s
+static void control_set(struct ctl_client_t *client, char *args)
+{
+    struct control_setting_t settings[LDR_MAX_SENSORS];
+    char *saveptr = NULL;
+    char *token;
+    int gpio = -1;
+    int i, n = 0;
+
+    token = strtok_r(args, " ", &saveptr);
+    if ((token == NULL) || ((strcmp(token, "all") != 0) && (sscanf(token, "%d", &gpio) != 1))) {
+        ctl_reply(client, "{\"error\":\"usage: set <gpio|all> key=value ...\"}");
+        return;
+    }
+    args = saveptr;
+
+    // every sensor is checked before any is changed, so a failed set
+    // changes nothing
+    for (i = 0; i < num_ldr; i++) {
+        struct ldr_sensor_t *l = &ldr[i];
+        ldr_duration_t high_us = l->high_threshold_us;
+        ldr_duration_t low_us = l->low_threshold_us;
+        ldr_duration_t dark_us = l->complete_darkness_threshold_us;
+        unsigned int high_ms = l->high_threshold_duration_ms;
+        unsigned int low_ms = l->low_threshold_duration_ms;
+        char list[CTL_LINE_MAX];
+        unsigned int seconds;
+
+        if ((gpio >= 0) && (l->gpio != gpio))
+            continue;
+        snprintf(list, sizeof(list), "%s", args ? args : "");
+        saveptr = NULL;
+        for (token = strtok_r(list, " ", &saveptr); token; token = strtok_r(NULL, " ", &saveptr)) {
+            char *value = strchr(token, '=');
+            int ok = 0;
+            if (value) {
+                *value++ = 0;
+                if (strcmp(token, "high") == 0) {
+                    ok = (parse_threshold(value, &high_us) == 0);
+                } else if (strcmp(token, "low") == 0) {
+                    ok = (parse_threshold(value, &low_us) == 0);
+                } else if (strcmp(token, "dark") == 0) {
+                    ok = (parse_threshold(value, &dark_us) == 0);
+                } else if ((strcmp(token, "high_s") == 0) && (sscanf(value, "%u", &seconds) == 1)) {
+                    high_ms = seconds * 1000;
+                    ok = 1;
+                } else if ((strcmp(token, "low_s") == 0) && (sscanf(value, "%u", &seconds) == 1)) {
+                    low_ms = seconds * 1000;
+                    ok = 1;
+                }
             }
-        }
-    } else {
-        if (action->cmd_bright) {
-            pid_t pid = fork();
-            if (pid == 0) {
-                // This is the child process.  Execute the command.
-                execv(action->cmd_bright_exp_result.we_wordv[0], action->cmd_bright_exp_result.we_wordv);
-                exit(EXIT_FAILURE);
-            } else if (pid < 0) {
-                // The fork failed
-                LOG_ERROR("Error: fork failed: %s\n", action->cmd_bright);
-            } else {
-                // This is the parent process, do nothing.  */
+            if (!ok) {
+                ctl_reply(client, "{\"error\":\"invalid setting %s\"}", token);
+                return;
             }
         }
+        if ((low_us >= high_us) || (dark_us <= high_us)) {
+            ctl_reply(client, "{\"error\":\"thresholds must be low < high < dark\"}");
+            return;
+        }
+        // a saturated reading counts as the timeout, it must still read dark
+        if ((high_us > l->max_charge_timeout_us) ||
+            ((dark_us != l->complete_darkness_threshold_us) && (dark_us > l->max_charge_timeout_us))) {
+            ctl_reply(client, "{\"error\":\"thresholds must not exceed the charge timeout\"}");
+            return;
+        }
+        settings[n].index = i;
+        settings[n].high_us = high_us;
+        settings[n].low_us = low_us;
+        settings[n].dark_us = dark_us;
+        settings[n].high_ms = high_ms;
+        settings[n].low_ms = low_ms;
+        n++;
+    }
+    for (i = 0; i < n; i++) {
+        const struct control_setting_t *c = &settings[i];
+        struct ldr_sensor_t *l = &ldr[c->index];
+        ldr_configure(l, c->high_us, c->low_us, c->dark_us, c->high_ms, c->low_ms,
+                      l->complete_darkness_duration_ms);
+        LOG_INFO("LDR %d thresholds set to high %u us, low %u us, dark %u us\n",
+                 l->gpio, c->high_us, c->low_us, c->dark_us);
+    }
+    if (n == 0)
+        ctl_reply(client, "{\"error\":\"no such LDR\"}");
+    else
+        ctl_reply(client, "{\"ok\":true,\"updated\":%d}", n);
+}
+
+
+// calibrate <lux> [samples], pairs the next charge times with a lux
+// meter reading and appends the median to the capture file
+static void control_calibrate(struct ctl_client_t *client, char *args)
+{
+    int samples = CALIB_DEFAULT_CAPTURE;
+    double lux;
+    int i;
+
+    if (capture_path == NULL) {
+        ctl_reply(client, "{\"error\":\"capture needs ldr-reader -Y\"}");
+        return;
+    }
+    if ((sscanf(args, "%lf %d", &lux, &samples) < 1) || (lux < 0) ||
+        (samples < 1) || (samples > CALIB_MAX_CAPTURE)) {
+        ctl_reply(client, "{\"error\":\"usage: calibrate <lux> [1-%d samples]\"}", CALIB_MAX_CAPTURE);
+        return;
+    }
+    for (i = 0; i < num_ldr; i++) {
+        calib_capture_start(&captures[i], lux, samples);
+        ldr_full_range(i, 1);
+    }
+    ctl_reply(client, "{\"ok\":true,\"lux\":%g,\"samples\":%d}", lux, samples);
+}
+
+
+static void control_command(void *priv_data, struct ctl_client_t *client, char *line)
+{
+    if (strcmp(line, "status") == 0)
+        control_status(client);
+    else if (strncmp(line, "set ", 4) == 0)
+        control_set(client, line + 4);
+    else if (strncmp(line, "calibrate ", 10) == 0)
+        control_calibrate(client, line + 10);
+    else
+        ctl_reply(client, "{\"error\":\"unknown command\"}");
+}
+
+
+static void ldr_trigger_cb(void *priv_data, const struct ldr_sensor_t *ldr,
+                           ldr_state_t new_state, ldr_duration_t duration_us)
+{
+    struct trigger_action_t *action = (struct trigger_action_t *)priv_data;
+    struct timespec now;
+    int i;
+
+    if (calib_enabled) {
+        LOG_INFO("LDR %d state: %d (%u.%03u ms, %s%.1f lux)\n", ldr->gpio, new_state,
+                 duration_us / 1000, duration_us % 1000, ldr->last_timeout ? "at most " : "",
+                 calib_lux(&calib, duration_us));
+    } else {
+        LOG_INFO("LDR %d state: %d (%u.%03u ms)\n", ldr->gpio, new_state,
+                 duration_us / 1000, duration_us % 1000);
+    }
+
+    set_all_output_gpio(action, new_state != LDR_DARK);
+    if (num_plugins || shm_state)
+        clock_gettime(CLOCK_REALTIME, &now);
+    if (metrics_enabled)
+        metrics_transition(&metrics, ldr_index(ldr), new_state);
+    if (shm_state)
+        shmpub_transition(shm_state, ldr_index(ldr), new_state, &now);
+    for (i = 0; i < num_plugins; i++)
+        plugin_transition(&plugins[i], ldr->gpio, new_state, duration_us, &now);
+    publish_event(action, ldr, 0, duration_us, ldr->last_timeout);
+
+    if (new_state == LDR_DARK) {
+        if (action->cmd_dark)
+            exec_run(&executor, ldr->gpio, action->cmd_dark, action->cmd_dark_exp_result.we_wordv);
+    } else {
+        if (action->cmd_bright)
+            exec_run(&executor, ldr->gpio, action->cmd_bright, action->cmd_bright_exp_result.we_wordv);
     }
 }
 
@@ -217,16 +665,90 @@ static void syntax(const char *progname)
     fprintf(stderr, "\n");
     fprintf(stderr, "options:\n");
     fprintf(stderr, " -g [gpiopin]    LDR GPIO pin number. Example: 17\n");
+    fprintf(stderr, "                 Can be set up to %d times, all LDRs are read in the same cycle.\n", LDR_MAX_SENSORS);
+    fprintf(stderr, " -c [gpiochip]   Read LDR through GPIO character device instead of sysfs.\n");
+    fprintf(stderr, "                 GPIO pin is the line offset. Example: %s\n", GPIOCHIP_DEFAULT_PATH);
+    fprintf(stderr, " -m [gpiomem]    Read LDR by busy-polling memory mapped GPIO registers. Most precise,\n");
+    fprintf(stderr, "                 but holds the CPU for the charge time. Example: %s\n", GPIOMEM_DEFAULT_PATH);
+    fprintf(stderr, "                 A regular file works as a fake register block for testing.\n");
+    fprintf(stderr, " -o [path]       Root of the sysfs GPIO tree. Default %s\n", GPIO_DEFAULT_ROOT);
+    fprintf(stderr, " -S [options]    Simulate the LDR circuit instead of reading a GPIO pin.\n");
+    fprintf(stderr, SIMGPIO_USAGE);
     fprintf(stderr, " -G [gpiopin]    Light change event output GPIO pin number. High when bright.\n");
     fprintf(stderr, "                 Add 'i' to invert output. Can be set multiple times.\n");
     fprintf(stderr, "                 Example: 18 or 18i.\n");
-    fprintf(stderr, " -H [threshold]  High threshold in milliseconds (when dark). Default %d\n", LDR_DEFAULT_HIGH_THRESHOLD);
-    fprintf(stderr, " -L [threshold]  Low threshold in milliseconds (when bright). Default %d\n", LDR_DEFAULT_LOW_THRESHOLD);
+    fprintf(stderr, "                 With -c, all output pins are held as one request and switch together.\n");
+    fprintf(stderr, " -H [threshold]  High threshold in milliseconds (when dark). Default %d\n", LDR_DEFAULT_HIGH_THRESHOLD_US/1000);
+    fprintf(stderr, " -L [threshold]  Low threshold in milliseconds (when bright). Default %d\n", LDR_DEFAULT_LOW_THRESHOLD_US/1000);
+    fprintf(stderr, " -n [threshold]  Complete darkness threshold in milliseconds. Default %d\n", LDR_DEFAULT_COMPLETE_DARKNESS_THRESHOLD_US/1000);
+    fprintf(stderr, "                 Darker readings turn dark after %d.%03d s instead of the high threshold\n",
+            LDR_DEFAULT_COMPLETE_DARKNESS_DURATION_MS/1000, LDR_DEFAULT_COMPLETE_DARKNESS_DURATION_MS%1000);
+    fprintf(stderr, "                 debounce duration. Readings that time out count as darker.\n");
+    fprintf(stderr, "                 Thresholds take fractions or a 'us' suffix. Example: 2.5 or 2500us\n");
+    fprintf(stderr, "                 With -l, they can be in lux with a 'lux' suffix. Example: 20lux\n");
+    fprintf(stderr, " -l [filepath]   Calibration file, converts charge times to lux. Lines are points,\n");
+    fprintf(stderr, "                 '<ms> <lux>', or a fit of the LDR, 'model <k> <gamma>' for\n");
+    fprintf(stderr, "                 lux = (k / ms)^(1 / gamma). Lux is added to events and log lines,\n");
+    fprintf(stderr, "                 as lux_max for readings that timed out.\n");
+    fprintf(stderr, " -Y [filepath]   Calibration capture file. 'ldrctl calibrate <lux> [samples]' appends\n");
+    fprintf(stderr, "                 the median of the next %d charge times, paired with the lux meter\n", CALIB_DEFAULT_CAPTURE);
+    fprintf(stderr, "                 reading, as a point -l reads. Needs -u.\n");
+    fprintf(stderr, " -t [timeout]    Maximum charge timeout in milliseconds. Default %d\n", LDR_DEFAULT_MAX_CHARGE_TIMEOUT_MS);
+    fprintf(stderr, "                 The timeout follows the threshold that decides the next state, %d%% of\n", LDR_CHARGE_TIMEOUT_MARGIN_PCT);
+    fprintf(stderr, "                 the low threshold when dark, of the high or complete darkness threshold\n");
+    fprintf(stderr, "                 when bright.\n");
     fprintf(stderr, " -D [duration]   High threshold debounce duration in seconds. Default %d\n", LDR_DEFAULT_HIGH_DURATION_MS/1000);
     fprintf(stderr, " -d [duration]   Low threshold debounce duration in seconds. Default %d\n", LDR_DEFAULT_LOW_DURATION_MS/1000);
-    fprintf(stderr, " -X [command]    Command to run when dark\n");
+    fprintf(stderr, " -i [period]     Minimum sampling period in milliseconds. Default %d\n", LDR_DEFAULT_MIN_PERIOD_MS);
+    fprintf(stderr, " -I [period]     Maximum sampling period in milliseconds, used while the reading is far\n");
+    fprintf(stderr, "                 from the thresholds. Same as -i to disable backing off. Default %d\n", LDR_DEFAULT_MAX_PERIOD_MS);
+    fprintf(stderr, " -k [multiple]   Drain the capacitor for this multiple of the last charge time. Default %d.%02d\n",
+            LDR_DEFAULT_DRAIN_MULTIPLE_PCT/100, LDR_DEFAULT_DRAIN_MULTIPLE_PCT%100);
+    fprintf(stderr, " -K [drain]      Minimum drain time in milliseconds. Default %d\n", LDR_DEFAULT_MIN_DRAIN_US/1000);
+    fprintf(stderr, "                 Drain time never exceeds %d ms. Send SIGUSR1 to print statistics.\n", LDR_MAX_DRAIN_US/1000);
+    fprintf(stderr, " -q [filters]    Filter the charge times before they are compared with the thresholds.\n");
+    fprintf(stderr, FILTER_USAGE);
+    fprintf(stderr, "                 Raw logs and the drain time keep the unfiltered charge times.\n");
+    fprintf(stderr, " -X [command]    Command to run when dark. LDR_GPIO is set to the LDR GPIO pin.\n");
     fprintf(stderr, " -x [command]    Command to run when bright\n");
+    fprintf(stderr, " -j [count]      Maximum number of commands running at once. Default %d\n", EXEC_DEFAULT_MAX_RUNNING);
+    fprintf(stderr, " -T [timeout]    Command timeout in seconds, 0 for none. A command still running after\n");
+    fprintf(stderr, "                 this gets SIGTERM, then SIGKILL %d s later. Default %d\n",
+            EXEC_KILL_GRACE_MS/1000, EXEC_DEFAULT_TIMEOUT_MS/1000);
+    fprintf(stderr, " -C [policy]     What to do when a command is triggered while the last one for the\n");
+    fprintf(stderr, "                 same LDR is still running: queue (only the latest waits), skip,\n");
+    fprintf(stderr, "                 replace (terminate the running one), or parallel. Default queue\n");
+    fprintf(stderr, " -p [command]    Handler started once at launch and restarted if it exits. Each\n");
+    fprintf(stderr, "                 transition is written to its stdin as a line of JSON, lines it\n");
+    fprintf(stderr, "                 prints are logged. Example: {\"event\":\"transition\",\"gpio\":17,\n");
+    fprintf(stderr, "                 \"state\":\"dark\",\"duration_us\":170000,\"time\":1700000000.000000}\n");
+    fprintf(stderr, " -s              Also send every sample to the handler, as \"event\":\"sample\" with\n");
+    fprintf(stderr, "                 a \"timeout\" flag. Samples are dropped first if it falls behind.\n");
+    fprintf(stderr, " -P [plugin]     Load an action plugin, a shared object called directly on each\n");
+    fprintf(stderr, "                 transition and sample. Arguments follow a colon, see ldr-plugin.h.\n");
+    fprintf(stderr, "                 Can be set up to %d times. Example: ./plugin-udp.so:192.168.1.2:5000\n", PLUGIN_MAX);
+    fprintf(stderr, " -u [path]       Control socket, see ldrctl. Example: %s\n", CTL_DEFAULT_PATH);
+    fprintf(stderr, " -M [name]       Publish the latest reading of each LDR in POSIX shared memory,\n");
+    fprintf(stderr, "                 read it with ldr-shm.h or ldrctl -M. Example: %s\n", LDR_SHM_DEFAULT_NAME);
+    fprintf(stderr, " -E [addr]       Serve Prometheus metrics over HTTP on [host:]port, localhost if\n");
+    fprintf(stderr, "                 no host, or on a Unix socket path. Example: 9101\n");
+    fprintf(stderr, " -W [path[:sec]] Write hot path latency histograms to a file every sec seconds.\n");
+    fprintf(stderr, "                 Default %d. Needs a build with make PROFILE=1, which also adds them\n", PROFILE_DEFAULT_INTERVAL_S);
+    fprintf(stderr, "                 to the SIGUSR1 statistics.\n");
     fprintf(stderr, " -r [filepath]   Log raw values to file for debugging. Example: /var/log/ldr_raw.log\n");
+    fprintf(stderr, "                 With multiple LDRs, the GPIO pin is appended. Example: ldr_raw.log.17\n");
+    fprintf(stderr, "                 Records are buffered and written by a background thread.\n");
+    fprintf(stderr, " -V [version]    Raw log format. 1: 16-bit milliseconds and state, no timestamps.\n");
+    fprintf(stderr, "                 2: timestamped and compressed, with a header. Default %d\n", RAWLOG_DEFAULT_VERSION);
+    fprintf(stderr, "                 The log is appended to, don't mix versions in one file.\n");
+    fprintf(stderr, " -R [filepath]   Log raw values to a preallocated circular file instead, for read-only\n");
+    fprintf(stderr, "                 or flash storage. Survives restarts and crashes.\n");
+    fprintf(stderr, " -N [days]       Size the circular log to hold this many days at the minimum\n");
+    fprintf(stderr, "                 sampling period. Default %d\n", RAWLOG_CIRC_DEFAULT_DAYS);
+    fprintf(stderr, " -f [records]    Raw log flush size, write once this many records are buffered. Default %d\n", RAWLOG_DEFAULT_FLUSH_RECORDS);
+    fprintf(stderr, " -F [interval]   Raw log flush interval in milliseconds. Default %d\n", RAWLOG_DEFAULT_FLUSH_INTERVAL_MS);
+    fprintf(stderr, " -y [policy]     Raw log fsync policy: never, batch, or a number of seconds\n");
+    fprintf(stderr, "                 between fsyncs. Default never\n");
     fprintf(stderr, " -b              Run in the background\n");
     fprintf(stderr, " -v              Increase verbose mode (can set multiple times)\n");
     fprintf(stderr, " -h              Display this help page\n");
@@ -240,17 +762,42 @@ int main(int argc, char *argv[])
     const char *progname = "";
     log_level_t new_log_level = LOG_INFO;
     unsigned char daemonize = 0;
-    struct ldr_sensor_t ldr;
-    int ldr_gpio = -1;
+    struct ldr_sensor_t *ldrs[LDR_MAX_SENSORS];
+    int ldr_gpio[LDR_MAX_SENSORS];
+    const struct ldr_gpio_ops *ldr_ops = &ldr_sysfs_ops;
+    const char *ldr_backend_arg = NULL;
     const char *raw_value_log_file = "";
-    int fd_raw_value_log_file = -1;
-    unsigned int high_threshold = LDR_DEFAULT_HIGH_THRESHOLD;
-    unsigned int low_threshold = LDR_DEFAULT_LOW_THRESHOLD;
-    unsigned int complete_darkness_threshold = LDR_DEFAULT_COMPLETE_DARKNESS_THRESHOLD;
+    const char *circ_log_file = "";
+    unsigned int circ_log_days = RAWLOG_CIRC_DEFAULT_DAYS;
+    struct rawlog_config_t raw_log_config;
+    ldr_duration_t high_threshold_us = LDR_DEFAULT_HIGH_THRESHOLD_US;
+    ldr_duration_t low_threshold_us = LDR_DEFAULT_LOW_THRESHOLD_US;
+    ldr_duration_t complete_darkness_threshold_us = LDR_DEFAULT_COMPLETE_DARKNESS_THRESHOLD_US;
     unsigned int high_threshold_duration_ms = LDR_DEFAULT_HIGH_DURATION_MS;
     unsigned int low_threshold_duration_ms = LDR_DEFAULT_LOW_DURATION_MS;
     unsigned int complete_darkness_duration_ms = LDR_DEFAULT_COMPLETE_DARKNESS_DURATION_MS;
-    struct trigger_action_t action;
+    int max_charge_timeout_ms = LDR_DEFAULT_MAX_CHARGE_TIMEOUT_MS;
+    const char *high_threshold_str = NULL;
+    const char *low_threshold_str = NULL;
+    const char *complete_darkness_threshold_str = NULL;
+    const char *calib_path = NULL;
+    int min_period_ms = LDR_DEFAULT_MIN_PERIOD_MS;
+    int max_period_ms = LDR_DEFAULT_MAX_PERIOD_MS;
+    unsigned int drain_multiple_pct = LDR_DEFAULT_DRAIN_MULTIPLE_PCT;
+    ldr_duration_t min_drain_us = LDR_DEFAULT_MIN_DRAIN_US;
+    int exec_max_running = EXEC_DEFAULT_MAX_RUNNING;
+    int exec_timeout_s = EXEC_DEFAULT_TIMEOUT_MS / 1000;
+    exec_policy_t exec_policy = EXEC_POLICY_QUEUE;
+    const char *plugin_specs[PLUGIN_MAX];
+    int num_plugin_specs = 0;
+    const char *control_path = NULL;
+    const char *shm_name = NULL;
+    const char *metrics_addr = NULL;
+    struct filter_chain_t filter_chain = { .count = 0 };
+    unsigned char want_samples;
+    struct loop_t loop = { .fd_epoll = -1 };
+    struct ldr_cycle_t cycle = { .count = 0, .timer = { .fd = -1 } };
+    sigset_t signal_mask;
     int opt;
     int ret = 0;
     int i;
@@ -259,22 +806,56 @@ int main(int argc, char *argv[])
     trigger_action_init(&action);
 
     progname = argv[0];
+    rawlog_default_config(&raw_log_config);
 
-    while (((opt = getopt(argc, argv, "g:G:H:L:D:d:n:x:X:r:bvh")) != -1))
+    while (((opt = getopt(argc, argv, "g:c:m:o:S:G:H:L:n:t:l:Y:D:d:i:I:k:K:q:x:X:r:R:N:V:f:F:y:j:T:C:p:sP:u:M:E:W:bvh")) != -1))
     {
         switch (opt)
         {
             case 'g':
-                ldr_gpio = atoi(optarg);
-                for (i = 0; i < sizeof(usable_gpio_pins)/sizeof(usable_gpio_pins[0]); i++) {
-                    if (usable_gpio_pins[i] == ldr_gpio)
-                        break;
+                {
+                    int gpio = atoi(optarg);
+                    for (i = 0; i < sizeof(usable_gpio_pins)/sizeof(usable_gpio_pins[0]); i++) {
+                        if (usable_gpio_pins[i] == gpio)
+                            break;
+                    }
+                    if (i >= sizeof(usable_gpio_pins)/sizeof(usable_gpio_pins[0])) {
+                        LOG_ERROR("Error: Invalid LDR GPIO pin %d\n", gpio);
+                        exit(EXIT_FAILURE);
+                    }
+                    for (i = 0; i < num_ldr; i++) {
+                        if (ldr_gpio[i] == gpio) {
+                            LOG_ERROR("Error: LDR GPIO pin %d already specified\n", gpio);
+                            exit(EXIT_FAILURE);
+                        }
+                    }
+                    if (num_ldr >= LDR_MAX_SENSORS) {
+                        LOG_ERROR("Error: Too many LDR GPIO pins, maximum is %d\n", LDR_MAX_SENSORS);
+                        exit(EXIT_FAILURE);
+                    }
+                    ldr_gpio[num_ldr++] = gpio;
+                    LOG_VERBOSE("LDR GPIO pin %d\n", gpio);
                 }
-                if (i >= sizeof(usable_gpio_pins)/sizeof(usable_gpio_pins[0])) {
-                    LOG_ERROR("Error: Invalid LDR GPIO pin %d\n", ldr_gpio);
+                break;
+
+            case 'c':
+                ldr_ops = &ldr_chardev_ops;
+                ldr_backend_arg = optarg;
+                break;
+
+            case 'm':
+                ldr_ops = &ldr_gpiomem_ops;
+                ldr_backend_arg = optarg;
+                break;
+
+            case 'o':
+                if (gpio_set_root(optarg))
                     exit(EXIT_FAILURE);
-                }
-                LOG_VERBOSE("LDR GPIO pin %d\n", ldr_gpio);
+                break;
+
+            case 'S':
+                ldr_ops = &ldr_sim_ops;
+                ldr_backend_arg = optarg;
                 break;
 
             case 'G':
@@ -312,18 +893,23 @@ int main(int argc, char *argv[])
                 }
                 break;
 
-            case 'H':
-                high_threshold = atoi(optarg);
-                if (high_threshold < 0) {
-                    LOG_ERROR("Error: Invalid high threshold %d\n", high_threshold);
-                    exit(EXIT_FAILURE);
-                }
+            // parsed once the calibration is loaded
+            case 'H': high_threshold_str = optarg; break;
+            case 'L': low_threshold_str = optarg; break;
+            case 'n': complete_darkness_threshold_str = optarg; break;
+
+            case 'l':
+                calib_path = optarg;
+                break;
+
+            case 'Y':
+                capture_path = optarg;
                 break;
 
-            case 'L':
-                low_threshold = atoi(optarg);
-                if (low_threshold < 0) {
-                    LOG_ERROR("Error: Invalid low threshold %d\n", low_threshold);
+            case 't':
+                max_charge_timeout_ms = atoi(optarg);
+                if (max_charge_timeout_ms <= 0) {
+                    LOG_ERROR("Error: Invalid charge timeout %s\n", optarg);
                     exit(EXIT_FAILURE);
                 }
                 break;
@@ -346,55 +932,163 @@ int main(int argc, char *argv[])
                 low_threshold_duration_ms = low_threshold_duration_ms * 1000;
                 break;
 
-            case 'X':
-                action.cmd_dark = optarg;
-                switch (wordexp(action.cmd_dark, &action.cmd_dark_exp_result, WRDE_NOCMD))
+            case 'i':
+                min_period_ms = atoi(optarg);
+                if (min_period_ms <= 0) {
+                    LOG_ERROR("Error: Invalid minimum sampling period %d\n", min_period_ms);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'I':
+                max_period_ms = atoi(optarg);
+                if (max_period_ms <= 0) {
+                    LOG_ERROR("Error: Invalid maximum sampling period %d\n", max_period_ms);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'q':
+                if (filter_parse(optarg, &filter_chain))
+                    syntax(progname);
+                break;
+
+            case 'k':
                 {
-                    case 0:
-                        break;
-                    case WRDE_BADCHAR:
-                        LOG_ERROR("Error: bad char: %s\n", action.cmd_dark);
-                        exit(EXIT_FAILURE);
-                    case WRDE_CMDSUB:
-                        LOG_ERROR("Error: command substitution not allowed: %s\n", action.cmd_dark);
-                        exit(EXIT_FAILURE);
-                    case WRDE_NOSPACE:
-                        LOG_ERROR("Error: failed to allocate memory: %s\n", action.cmd_dark);
-                        exit(EXIT_FAILURE);
-                    case WRDE_SYNTAX:
-                        LOG_ERROR("Error: syntax error: %s\n", action.cmd_dark);
-                        exit(EXIT_FAILURE);
-                    default:
-                        LOG_ERROR("Error: unknown error: %s\n", action.cmd_dark);
+                    double multiple = atof(optarg);
+                    if ((multiple <= 0) || (multiple > 1000)) {
+                        LOG_ERROR("Error: Invalid drain multiple %s\n", optarg);
                         exit(EXIT_FAILURE);
+                    }
+                    drain_multiple_pct = (unsigned int)(multiple * 100 + 0.5);
+                }
+                break;
+
+            case 'K':
+                if (ldr_parse_duration_us(optarg, &min_drain_us) || (min_drain_us > LDR_MAX_DRAIN_US)) {
+                    LOG_ERROR("Error: Invalid minimum drain time %s\n", optarg);
+                    exit(EXIT_FAILURE);
                 }
                 break;
+
+            case 'X':
+                action.cmd_dark = optarg;
+                parse_command(action.cmd_dark, &action.cmd_dark_exp_result);
+                break;
             case 'x':
                 action.cmd_bright = optarg;
-                switch (wordexp(action.cmd_bright, &action.cmd_bright_exp_result, WRDE_NOCMD))
-                {
-                    case 0:
-                        break;
-                    case WRDE_BADCHAR:
-                        LOG_ERROR("Error: bad char: %s\n", action.cmd_bright);
-                        exit(EXIT_FAILURE);
-                    case WRDE_CMDSUB:
-                        LOG_ERROR("Error: command substitution not allowed: %s\n", action.cmd_bright);
-                        exit(EXIT_FAILURE);
-                    case WRDE_NOSPACE:
-                        LOG_ERROR("Error: failed to allocate memory: %s\n", action.cmd_bright);
-                        exit(EXIT_FAILURE);
-                    case WRDE_SYNTAX:
-                        LOG_ERROR("Error: syntax error: %s\n", action.cmd_bright);
-                        exit(EXIT_FAILURE);
-                    default:
-                        LOG_ERROR("Error: unknown error: %s\n", action.cmd_bright);
+                parse_command(action.cmd_bright, &action.cmd_bright_exp_result);
+                break;
+            case 'p':
+                action.cmd_handler = optarg;
+                parse_command(action.cmd_handler, &action.cmd_handler_exp_result);
+                break;
+            case 's':
+                action.handler_samples = 1;
+                break;
+            case 'u':
+                control_path = optarg;
+                break;
+            case 'M':
+                shm_name = optarg;
+                break;
+            case 'E':
+                metrics_addr = optarg;
+                break;
+            case 'W':
+            {
+                char *sep = strrchr(optarg, ':');
+                if (sep) {
+                    *sep = 0;
+                    profile_interval_s = strtoul(sep + 1, NULL, 10);
+                    if (profile_interval_s == 0) {
+                        LOG_ERROR("Error: invalid profile interval: %s\n", sep + 1);
                         exit(EXIT_FAILURE);
+                    }
                 }
+                profile_path = optarg;
                 break;
+            }
+            case 'P':
+                if (num_plugin_specs >= PLUGIN_MAX) {
+                    LOG_ERROR("Error: Too many plugins, maximum is %d\n", PLUGIN_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                plugin_specs[num_plugin_specs++] = optarg;
+                break;
+
             case 'r':
                 raw_value_log_file = optarg;
                 break;
+            case 'R':
+                circ_log_file = optarg;
+                break;
+            case 'N':
+                if (sscanf(optarg, "%u", &circ_log_days) != 1 ||
+                    circ_log_days == 0 || circ_log_days > 366) {
+                    LOG_ERROR("Error: invalid circular log length: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            case 'V':
+                if (sscanf(optarg, "%d", &(raw_log_config.version)) != 1 ||
+                    (raw_log_config.version != RAWLOG_VERSION_1 &&
+                     raw_log_config.version != RAWLOG_VERSION_2)) {
+                    LOG_ERROR("Error: invalid raw log version: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            case 'f':
+                if (sscanf(optarg, "%u", &(raw_log_config.flush_records)) != 1 ||
+                    raw_log_config.flush_records == 0) {
+                    LOG_ERROR("Error: invalid raw log flush size: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            case 'F':
+                if (sscanf(optarg, "%u", &(raw_log_config.flush_interval_ms)) != 1 ||
+                    raw_log_config.flush_interval_ms == 0) {
+                    LOG_ERROR("Error: invalid raw log flush interval: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            case 'y':
+                if (strcmp(optarg, "never") == 0) {
+                    raw_log_config.fsync_policy = RAWLOG_FSYNC_NEVER;
+                } else if (strcmp(optarg, "batch") == 0) {
+                    raw_log_config.fsync_policy = RAWLOG_FSYNC_BATCH;
+                } else if ((sscanf(optarg, "%u", &(raw_log_config.fsync_interval_s)) == 1) &&
+                           (raw_log_config.fsync_interval_s > 0)) {
+                    raw_log_config.fsync_policy = RAWLOG_FSYNC_PERIODIC;
+                } else {
+                    LOG_ERROR("Error: invalid raw log fsync policy: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+
+            case 'j':
+                exec_max_running = atoi(optarg);
+                if ((exec_max_running <= 0) || (exec_max_running > EXEC_MAX_CHILDREN)) {
+                    LOG_ERROR("Error: Invalid command count %s, maximum is %d\n", optarg, EXEC_MAX_CHILDREN);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'T':
+                exec_timeout_s = atoi(optarg);
+                if (exec_timeout_s < 0) {
+                    LOG_ERROR("Error: Invalid command timeout %d\n", exec_timeout_s);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'C':
+                if (exec_parse_policy(optarg, &exec_policy)) {
+                    LOG_ERROR("Error: invalid command policy: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+
             case 'b': daemonize = 1; break;
             case 'v': new_log_level++; set_log_level(new_log_level); break;
             case 'h': // fall through
@@ -410,24 +1104,80 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (capture_path && (control_path == NULL)) {
+        LOG_ERROR("Error: calibration capture needs the control socket, -u\n");
+        exit(EXIT_FAILURE);
+    }
+    if (calib_path) {
+        if (calib_load(&calib, calib_path))
+            exit(EXIT_FAILURE);
+        calib_enabled = 1;
+    }
+    if (high_threshold_str && parse_threshold(high_threshold_str, &high_threshold_us)) {
+        LOG_ERROR("Error: Invalid high threshold %s\n", high_threshold_str);
+        exit(EXIT_FAILURE);
+    }
+    if (low_threshold_str && parse_threshold(low_threshold_str, &low_threshold_us)) {
+        LOG_ERROR("Error: Invalid low threshold %s\n", low_threshold_str);
+        exit(EXIT_FAILURE);
+    }
+    if (complete_darkness_threshold_str &&
+        parse_threshold(complete_darkness_threshold_str, &complete_darkness_threshold_us)) {
+        LOG_ERROR("Error: Invalid complete darkness threshold %s\n", complete_darkness_threshold_str);
+        exit(EXIT_FAILURE);
+    }
+
 
-    if (ldr_gpio < 0) {
+    if (num_ldr == 0) {
         LOG_ERROR("Error: LDR GPIO pin not specified\n");
         exit(EXIT_FAILURE);
     }
-    if (gpio_in_list(&action.gpio_list_head, ldr_gpio)) {
-        LOG_ERROR("Error: LDR GPIO pin %d is used as output\n", ldr_gpio);
-        exit(EXIT_FAILURE);
+    for (i = 0; i < num_ldr; i++) {
+        if (gpio_in_list(&action.gpio_list_head, ldr_gpio[i])) {
+            LOG_ERROR("Error: LDR GPIO pin %d is used as output\n", ldr_gpio[i]);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    if (high_threshold <= low_threshold) {
+    if (high_threshold_us <= low_threshold_us) {
         LOG_ERROR("Error: high threshold must be greater than low threshold\n");
         exit(EXIT_FAILURE);
     }
-    if (complete_darkness_threshold <= high_threshold) {
+    if (complete_darkness_threshold_us <= high_threshold_us) {
         LOG_ERROR("Error: complete darkness threshold must be greater than high threshold\n");
         exit(EXIT_FAILURE);
     }
+    // a saturated reading counts as the timeout, it must still read dark
+    if ((uint64_t)max_charge_timeout_ms * 1000 < high_threshold_us) {
+        LOG_ERROR("Error: charge timeout must not be less than high threshold\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((uint64_t)max_charge_timeout_ms * 1000 < complete_darkness_threshold_us) {
+        LOG_ERROR("Warning: charge timeout is less than complete darkness threshold, "
+                  "complete darkness is never detected\n");
+    }
+    if (max_period_ms < min_period_ms) {
+        LOG_ERROR("Error: maximum sampling period must not be less than minimum sampling period\n");
+        exit(EXIT_FAILURE);
+    }
+    if (action.handler_samples && (action.cmd_handler == NULL)) {
+        LOG_ERROR("Error: sending samples needs a handler\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((strlen(raw_value_log_file) > 0) && (strlen(circ_log_file) > 0)) {
+        LOG_ERROR("Error: raw log and circular log can't be used together\n");
+        exit(EXIT_FAILURE);
+    }
+    if (strlen(circ_log_file) > 0) {
+        // enough for the worst case, every sample at the minimum period
+        uint64_t records = (uint64_t)circ_log_days * 24 * 3600 * 1000 / min_period_ms;
+        if (records > RAWLOG_CIRC_MAX_RECORDS) {
+            LOG_ERROR("Error: circular log of %u days at %d ms is too large\n", circ_log_days, min_period_ms);
+            exit(EXIT_FAILURE);
+        }
+        raw_log_config.circ_records = (uint32_t)records;
+        raw_value_log_file = circ_log_file;
+    }
 
 
 
@@ -489,50 +1239,176 @@ int main(int argc, char *argv[])
     }
 
 
-    signal(SIGINT, handle_terminate_signal);
-    signal(SIGTERM, handle_terminate_signal);
-
-    if (ldr_init(&ldr, ldr_gpio)) {
-        LOG_ERROR("Error: Failed to initialize LDR GPIO pin\n");
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (i = 0; i < num_ldr; i++) {
+        ldr_reset(&ldr[i]);
+        ldrs[i] = &ldr[i];
+    }
+    if (loop_init(&loop)) {
+        ret = -1;
+        goto clean_up;
+    }
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGINT);
+    sigaddset(&signal_mask, SIGTERM);
+    sigaddset(&signal_mask, SIGUSR1);
+    sigaddset(&signal_mask, SIGCHLD);
+    if (loop_signal_init(&loop, &signal_src, &signal_mask, handle_signal, &loop)) {
+        ret = -1;
+        goto clean_up;
+    }
+    if (exec_init(&executor, &loop, exec_max_running,
+                  (unsigned int)exec_timeout_s * 1000, exec_policy)) {
         ret = -1;
         goto clean_up;
     }
-    if (strlen(raw_value_log_file) > 0) {
-        fd_raw_value_log_file = open(raw_value_log_file, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        if (fd_raw_value_log_file < 0) {
-            LOG_ERROR("Error: Failed to open %s for logging\n", raw_value_log_file);
+    for (i = 0; i < num_plugin_specs; i++) {
+        if (plugin_load(&plugins[num_plugins], plugin_specs[i])) {
+            ret = -1;
+            goto clean_up;
+        }
+        num_plugins++;
+    }
+    if (control_path) {
+        if (ctl_init(&control, &loop, control_path, control_command, &action)) {
+            ret = -1;
+            goto clean_up;
+        }
+        control_enabled = 1;
+    }
+    if (action.cmd_handler) {
+        // a handler that went away must not take us with it
+        signal(SIGPIPE, SIG_IGN);
+        if (coproc_init(&handler, &loop, action.cmd_handler, action.cmd_handler_exp_result.we_wordv)) {
             ret = -1;
             goto clean_up;
         }
-        ldr.fd_raw_value_log_file = fd_raw_value_log_file;
     }
-    ldr_configure(&ldr, high_threshold, low_threshold,
-                  complete_darkness_threshold, high_threshold_duration_ms,
-                  low_threshold_duration_ms, complete_darkness_duration_ms);
 
+    // samples are only dispatched if something wants them
+    want_samples = action.handler_samples || control_enabled || shm_name || metrics_addr || capture_path;
+    for (i = 0; i < num_plugins; i++) {
+        if (plugins[i].desc->on_sample)
+            want_samples = 1;
+    }
+    for (i = 0; i < num_ldr; i++) {
+        if (ldr_init(&ldr[i], ldr_gpio[i], ldr_ops, ldr_backend_arg)) {
+            LOG_ERROR("Error: Failed to initialize LDR GPIO pin %d\n", ldr_gpio[i]);
+            ret = -1;
+            goto clean_up;
+        }
+        ldr_configure(&ldr[i], high_threshold_us, low_threshold_us,
+                      complete_darkness_threshold_us, high_threshold_duration_ms,
+                      low_threshold_duration_ms, complete_darkness_duration_ms);
+        ldr_configure_period(&ldr[i], min_period_ms, max_period_ms);
+        ldr_configure_timeout(&ldr[i], max_charge_timeout_ms);
+        ldr_configure_drain(&ldr[i], drain_multiple_pct, min_drain_us);
+        ldr_configure_filter(&ldr[i], &filter_chain);
+
+        ldr_register_callback(&ldr[i], ldr_trigger_cb, &action);
+        if (want_samples)
+            ldr_register_sample_callback(&ldr[i], ldr_sample_cb, &action);
+
+        if (strlen(raw_value_log_file) > 0) {
+            char path[PATH_MAX];
+            struct rawlog_info_t info;
+            struct timespec now;
+
+            if (num_ldr > 1)
+                snprintf(path, sizeof(path), "%s.%d", raw_value_log_file, ldr_gpio[i]);
+            else
+                snprintf(path, sizeof(path), "%s", raw_value_log_file);
+            memset(&info, 0, sizeof(info));
+            info.gpio = ldr[i].gpio;
+            info.high_threshold_us = ldr[i].high_threshold_us;
+            info.low_threshold_us = ldr[i].low_threshold_us;
+            info.complete_darkness_threshold_us = ldr[i].complete_darkness_threshold_us;
+            clock_gettime(CLOCK_REALTIME, &now);
+            info.start_realtime_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+            ldr_clock(&ldr[i], &now);
+            info.start_clock_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+            ldr[i].raw_log = rawlog_open(path, &raw_log_config, &info);
+            if (ldr[i].raw_log == NULL) {
+                ret = -1;
+                goto clean_up;
+            }
+        }
+    }
 
-    ldr_register_callback(&ldr, ldr_trigger_cb, &action);
+    if (metrics_addr) {
+        if (metrics_init(&metrics, &loop, metrics_addr, ldr, num_ldr, &executor)) {
+            ret = -1;
+            goto clean_up;
+        }
+        metrics_enabled = 1;
+    }
+
+    if (profile_path) {
+#ifdef LDR_PROFILE
+        if (loop_timer_init(&loop, &profile_timer, profile_timer_cb, NULL) ||
+            loop_timer_arm_us(&profile_timer, (uint64_t)profile_interval_s * 1000000)) {
+            ret = -1;
+            goto clean_up;
+        }
+#else
+        LOG_ERROR("Error: -W needs a build with make PROFILE=1\n");
+        ret = -1;
+        goto clean_up;
+#endif
+    }
+
+    if (shm_name) {
+        shm_state = shmpub_open(shm_name, ldr_gpio, num_ldr);
+        if (shm_state == NULL) {
+            ret = -1;
+            goto clean_up;
+        }
+    }
 
     // init output GPIO pins
-    if (init_all_output_gpio(&action.gpio_list_head)) {
+    if (init_all_output_gpio(&action, (ldr_ops == &ldr_chardev_ops) ? ldr_backend_arg : NULL)) {
         LOG_ERROR("Error: Failed to initialize output GPIO pins\n");
         ret = -1;
         goto clean_up;
     }
 
 
-    while (!terminate) {
-        ldr_read_once(&ldr);
+    if (ldr_cycle_init(&cycle, &loop, ldrs, num_ldr)) {
+        LOG_ERROR("Error: Failed to set up LDR measurement cycle\n");
+        ret = -1;
+        goto clean_up;
     }
+    ldr_cycle_begin(&cycle);
+
+    ret = loop_run(&loop);
 
 
 
 clean_up:
+    ldr_cycle_cleanup(&cycle);
+    exec_cleanup(&executor, &loop);
+    coproc_cleanup(&handler);
+    if (control_enabled)
+        ctl_cleanup(&control);
+    shmpub_close(shm_state, shm_name);
+    shm_state = NULL;
+    if (metrics_enabled)
+        metrics_cleanup(&metrics);
+#ifdef LDR_PROFILE
+    if (profile_path)
+        profile_write(profile_path);
+#endif
+    loop_source_close(&loop, &profile_timer);
+    for (i = 0; i < num_plugins; i++)
+        plugin_unload(&plugins[i]);
+    num_plugins = 0;
+    loop_source_close(&loop, &signal_src);
+    loop_cleanup(&loop);
     trigger_action_cleanup(&action);
-    ldr_cleanup(&ldr);
-    if (fd_raw_value_log_file >= 0) {
-        close(fd_raw_value_log_file);
-        fd_raw_value_log_file = -1;
+    for (i = 0; i < num_ldr; i++) {
+        ldr_cleanup(&ldr[i]);
+        rawlog_close(ldr[i].raw_log);
+        ldr[i].raw_log = NULL;
     }
 
     exit(ret);
@@ -0,0 +1,506 @@
+/*
+ *    Filename: ldr-replay.c
+ * Description: Replays recorded raw LDR logs through the state machine
+ *              for a sweep of thresholds and debounce durations.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "rawlog.h"
+#include "ldr.h"
+
+
+#define REPLAY_MAX_INPUTS           64
+#define REPLAY_DEFAULT_FLAP_WINDOW_S 600
+#define REPLAY_MAX_THREADS          64
+
+
+struct replay_sample_t
+{
+    struct timespec time;
+    ldr_duration_t duration_us;
+    unsigned char timeout;              // saturated, at least duration_us
+};
+
+struct replay_log_t
+{
+    struct replay_sample_t *samples;
+    size_t count;
+    size_t size;
+};
+
+// min, max and step, in us for thresholds and ms for durations
+struct replay_range_t
+{
+    uint32_t min;
+    uint32_t max;
+    uint32_t step;
+};
+
+struct replay_config_t
+{
+    ldr_duration_t high_threshold_us;
+    ldr_duration_t low_threshold_us;
+    ldr_duration_t complete_darkness_threshold_us;
+    unsigned int high_threshold_duration_ms;
+    unsigned int low_threshold_duration_ms;
+    unsigned int complete_darkness_duration_ms;
+};
+
+struct replay_result_t
+{
+    uint64_t transitions;
+    uint64_t flaps;
+    uint64_t latency_ms_total;
+    uint64_t latency_ms_max;
+    uint64_t dark_ms;
+    uint64_t undecided;                 // saturated samples below the deciding threshold
+};
+
+struct replay_sweep_t
+{
+    const struct replay_log_t *log;
+    const struct replay_config_t *configs;
+    const struct filter_chain_t *filter;
+    struct replay_result_t *results;
+    size_t num_configs;
+    size_t next;
+    unsigned int flap_window_ms;
+};
+
+
+
+static int replay_add_sample(struct replay_log_t *log, const struct timespec *time,
+                             ldr_duration_t duration_us, int timeout)
+{
+    if (log->count == log->size) {
+        size_t size = log->size ? log->size * 2 : 65536;
+        struct replay_sample_t *samples = realloc(log->samples, size * sizeof(struct replay_sample_t));
+        if (samples == NULL) {
+            LOG_ERROR("Error: Out of memory after %zu samples\n", log->count);
+            return -1;
+        }
+        log->samples = samples;
+        log->size = size;
+    }
+    log->samples[log->count].time = *time;
+    log->samples[log->count].duration_us = duration_us;
+    log->samples[log->count].timeout = timeout ? 1 : 0;
+    log->count++;
+    return 0;
+}
+
+
+// Loads a raw log. v2 and circular logs carry wall clock timestamps, v1
+// logs are given one sample every v1_period_ms after the previous log.
+static int replay_load(struct replay_log_t *log, const char *path, unsigned int v1_period_ms)
+{
+    struct rawlog_reader_t reader;
+    struct rawlog_sample_t sample;
+    struct timespec time = {0, 0};
+    int ret;
+
+    if (rawlog_reader_open(&reader, path))
+        return -1;
+    if (log->count > 0)
+        time = log->samples[log->count - 1].time;
+    while ((ret = rawlog_reader_next(&reader, &sample)) == 1) {
+        if (reader.version == RAWLOG_VERSION_1) {
+            time.tv_sec += v1_period_ms / 1000;
+            time.tv_nsec += (v1_period_ms % 1000) * 1000000;
+            if (time.tv_nsec >= 1000000000) {
+                time.tv_sec++;
+                time.tv_nsec -= 1000000000;
+            }
+        } else {
+            time.tv_sec = sample.realtime_ns / 1000000000;
+            time.tv_nsec = sample.realtime_ns % 1000000000;
+        }
+        if (replay_add_sample(log, &time, sample.duration_us, sample.timeout)) {
+            ret = -1;
+            break;
+        }
+    }
+    if (ret < 0)
+        LOG_ERROR("Error: %s is corrupt after %zu samples\n", path, log->count);
+    rawlog_reader_close(&reader);
+    return ret;
+}
+
+
+static void replay_run(const struct replay_log_t *log, const struct replay_config_t *config,
+                       const struct filter_chain_t *filter, unsigned int flap_window_ms,
+                       struct replay_result_t *result)
+{
+    struct ldr_sensor_t ldr;
+    struct timespec last_transition;
+    struct timespec state_since;
+    size_t i;
+
+    memset(result, 0, sizeof(struct replay_result_t));
+    ldr_reset(&ldr);
+    ldr_configure(&ldr, config->high_threshold_us, config->low_threshold_us,
+                  config->complete_darkness_threshold_us, config->high_threshold_duration_ms,
+                  config->low_threshold_duration_ms, config->complete_darkness_duration_ms);
+    ldr_configure_filter(&ldr, filter);
+
+    for (i = 0; i < log->count; i++) {
+        const struct timespec *now = &(log->samples[i].time);
+        ldr_state_t old_state = ldr.state;
+        struct timespec crossed = ldr.cross_threshold_start_time;
+        unsigned char debouncing = ldr.debouncing;
+        ldr_duration_t duration_us = log->samples[i].duration_us;
+
+        // A saturated sample is at least as dark as it reads. It decides
+        // the state if that is past the threshold the state is waiting
+        // for, otherwise it is taken as dark and counted as undecided.
+        if (log->samples[i].timeout) {
+            ldr_duration_t deciding_us = (ldr.state == LDR_DARK) ?
+                                         config->low_threshold_us : config->high_threshold_us;
+            if (duration_us < deciding_us)
+                result->undecided++;
+            if (duration_us < config->high_threshold_us)
+                duration_us = config->high_threshold_us;
+        }
+        ldr_update_state(&ldr, filter_apply(&(ldr.filter), duration_us), now);
+        if (old_state == LDR_UNKNOWN) {
+            state_since = *now;
+            last_transition = *now;
+            // the first transition is never a flap
+            last_transition.tv_sec -= flap_window_ms / 1000 + 1;
+            continue;
+        }
+        if (ldr.state == old_state)
+            continue;
+        // the decision latency is the time from the first sample past
+        // the threshold to the transition
+        if (debouncing) {
+            uint64_t latency_ms = (uint64_t)timespec_diff_ms(now, &crossed);
+            result->latency_ms_total += latency_ms;
+            if (latency_ms > result->latency_ms_max)
+                result->latency_ms_max = latency_ms;
+        }
+        if (timespec_diff_ms(now, &last_transition) < flap_window_ms)
+            result->flaps++;
+        if (old_state == LDR_DARK)
+            result->dark_ms += timespec_diff_ms(now, &state_since);
+        result->transitions++;
+        last_transition = *now;
+        state_since = *now;
+    }
+    if ((ldr.state == LDR_DARK) && (log->count > 0))
+        result->dark_ms += timespec_diff_ms(&(log->samples[log->count - 1].time), &state_since);
+}
+
+
+static void *replay_worker(void *arg)
+{
+    struct replay_sweep_t *sweep = (struct replay_sweep_t *)arg;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&(sweep->next), 1, __ATOMIC_RELAXED)) < sweep->num_configs)
+        replay_run(sweep->log, &(sweep->configs[i]), sweep->filter, sweep->flap_window_ms,
+                   &(sweep->results[i]));
+    return NULL;
+}
+
+
+// min[:max[:step]], thresholds in milliseconds like ldr-reader,
+// durations in seconds
+static int parse_range(const char *str, int threshold, struct replay_range_t *range)
+{
+    char buf[64];
+    char *field[3];
+    uint32_t value[3];
+    int count = 0;
+    int i;
+
+    if (strlen(str) >= sizeof(buf))
+        return -1;
+    strcpy(buf, str);
+    field[count++] = buf;
+    for (i = 0; buf[i] && (count < 3); i++) {
+        if (buf[i] == ':') {
+            buf[i] = 0;
+            field[count++] = &buf[i + 1];
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (threshold) {
+            ldr_duration_t us;
+            if (ldr_parse_duration_us(field[i], &us))
+                return -1;
+            value[i] = us;
+        } else {
+            char *end = NULL;
+            double seconds = strtod(field[i], &end);
+            if ((end == field[i]) || (*end != 0) || (seconds < 0) || (seconds > 4000000))
+                return -1;
+            value[i] = (uint32_t)(seconds * 1000.0 + 0.5);
+        }
+    }
+    range->min = value[0];
+    range->max = (count > 1) ? value[1] : value[0];
+    range->step = (count > 2) ? value[2] : 0;
+    if (range->max < range->min)
+        return -1;
+    if (range->step == 0)
+        range->step = (range->max > range->min) ? range->max - range->min : 1;
+    return 0;
+}
+
+
+static size_t range_count(const struct replay_range_t *range)
+{
+    return (range->max - range->min) / range->step + 1;
+}
+
+
+static void syntax(const char *progname)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [options]\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Replays raw logs recorded with ldr-reader -r or -R through the LDR state\n");
+    fprintf(stderr, "machine for every combination of the given ranges, and prints the\n");
+    fprintf(stderr, "transitions, flaps and decision latency of each combination.\n");
+    fprintf(stderr, "Ranges are min[:max[:step]]. Example: -H 100:200:10\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, " -r [filepath]   Raw log to replay. Can be set up to %d times, replayed in order.\n", REPLAY_MAX_INPUTS);
+    fprintf(stderr, " -H [range]      High threshold in milliseconds. Default %d\n", LDR_DEFAULT_HIGH_THRESHOLD_US/1000);
+    fprintf(stderr, " -L [range]      Low threshold in milliseconds. Default %d\n", LDR_DEFAULT_LOW_THRESHOLD_US/1000);
+    fprintf(stderr, " -n [range]      Complete darkness threshold in milliseconds. Default %d\n", LDR_DEFAULT_COMPLETE_DARKNESS_THRESHOLD_US/1000);
+    fprintf(stderr, " -D [range]      High threshold debounce duration in seconds. Default %d\n", LDR_DEFAULT_HIGH_DURATION_MS/1000);
+    fprintf(stderr, " -d [range]      Low threshold debounce duration in seconds. Default %d\n", LDR_DEFAULT_LOW_DURATION_MS/1000);
+    fprintf(stderr, " -N [range]      Complete darkness debounce duration in seconds. Default %d.%03d\n",
+            LDR_DEFAULT_COMPLETE_DARKNESS_DURATION_MS/1000, LDR_DEFAULT_COMPLETE_DARKNESS_DURATION_MS%1000);
+    fprintf(stderr, " -q [filters]    Filter the charge times like ldr-reader -q.\n");
+    fprintf(stderr, FILTER_USAGE);
+    fprintf(stderr, " -w [seconds]    A transition within this time of the previous one is a flap. Default %d\n", REPLAY_DEFAULT_FLAP_WINDOW_S);
+    fprintf(stderr, " -p [period]     Sampling period in milliseconds assumed for v1 logs, which have\n");
+    fprintf(stderr, "                 no timestamps. Default %d\n", LDR_DEFAULT_MIN_PERIOD_MS);
+    fprintf(stderr, " -j [threads]    Number of threads. Default is the number of CPUs\n");
+    fprintf(stderr, " -v              Increase verbose mode (can set multiple times)\n");
+    fprintf(stderr, " -h              Display this help page\n");
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *progname = argv[0];
+    log_level_t new_log_level = LOG_INFO;
+    const char *inputs[REPLAY_MAX_INPUTS];
+    int num_inputs = 0;
+    struct replay_range_t high = { LDR_DEFAULT_HIGH_THRESHOLD_US, LDR_DEFAULT_HIGH_THRESHOLD_US, 1 };
+    struct replay_range_t low = { LDR_DEFAULT_LOW_THRESHOLD_US, LDR_DEFAULT_LOW_THRESHOLD_US, 1 };
+    struct replay_range_t dark = { LDR_DEFAULT_COMPLETE_DARKNESS_THRESHOLD_US, LDR_DEFAULT_COMPLETE_DARKNESS_THRESHOLD_US, 1 };
+    struct replay_range_t high_duration = { LDR_DEFAULT_HIGH_DURATION_MS, LDR_DEFAULT_HIGH_DURATION_MS, 1 };
+    struct replay_range_t low_duration = { LDR_DEFAULT_LOW_DURATION_MS, LDR_DEFAULT_LOW_DURATION_MS, 1 };
+    struct replay_range_t dark_duration = { LDR_DEFAULT_COMPLETE_DARKNESS_DURATION_MS, LDR_DEFAULT_COMPLETE_DARKNESS_DURATION_MS, 1 };
+    unsigned int flap_window_s = REPLAY_DEFAULT_FLAP_WINDOW_S;
+    struct filter_chain_t filter_chain = { .count = 0 };
+    unsigned int v1_period_ms = LDR_DEFAULT_MIN_PERIOD_MS;
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct replay_log_t log;
+    struct replay_sweep_t sweep;
+    struct replay_config_t *configs;
+    struct replay_result_t *results;
+    pthread_t threads[REPLAY_MAX_THREADS];
+    struct timespec start;
+    struct timespec end;
+    size_t max_configs;
+    size_t num_configs = 0;
+    size_t num_undecidable = 0;
+    uint32_t h, l, n, hd, ld, nd;
+    int num_threads_started = 1;
+    size_t i;
+    int opt;
+
+    while (((opt = getopt(argc, argv, "r:H:L:n:D:d:N:q:w:p:j:vh")) != -1))
+    {
+        switch (opt)
+        {
+            case 'q':
+                if (filter_parse(optarg, &filter_chain))
+                    syntax(progname);
+                break;
+            case 'r':
+                if (num_inputs >= REPLAY_MAX_INPUTS) {
+                    LOG_ERROR("Error: too many raw logs\n");
+                    syntax(progname);
+                }
+                inputs[num_inputs++] = optarg;
+                break;
+            case 'H':
+            case 'L':
+            case 'n':
+            {
+                struct replay_range_t *range = (opt == 'H') ? &high : (opt == 'L') ? &low : &dark;
+                if (parse_range(optarg, 1, range)) {
+                    LOG_ERROR("Error: invalid threshold range: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            }
+            case 'D':
+            case 'd':
+            case 'N':
+            {
+                struct replay_range_t *range = (opt == 'D') ? &high_duration :
+                                               (opt == 'd') ? &low_duration : &dark_duration;
+                if (parse_range(optarg, 0, range)) {
+                    LOG_ERROR("Error: invalid duration range: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            }
+            case 'w':
+                if ((sscanf(optarg, "%u", &flap_window_s) != 1) || (flap_window_s > 4000000)) {
+                    LOG_ERROR("Error: invalid flap window: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            case 'p':
+                if ((sscanf(optarg, "%u", &v1_period_ms) != 1) || (v1_period_ms == 0)) {
+                    LOG_ERROR("Error: invalid sampling period: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            case 'j':
+                num_threads = atoi(optarg);
+                if (num_threads <= 0) {
+                    LOG_ERROR("Error: invalid number of threads: %s\n", optarg);
+                    syntax(progname);
+                }
+                break;
+            case 'v': new_log_level++; set_log_level(new_log_level); break;
+            case 'h': // fall through
+            default:
+                syntax(progname);
+                break;
+        }
+    }
+    if (num_inputs == 0) {
+        LOG_ERROR("Error: no raw log given\n");
+        syntax(progname);
+    }
+    if (num_threads > REPLAY_MAX_THREADS)
+        num_threads = REPLAY_MAX_THREADS;
+
+    memset(&log, 0, sizeof(log));
+    for (opt = 0; opt < num_inputs; opt++) {
+        if (replay_load(&log, inputs[opt], v1_period_ms))
+            exit(EXIT_FAILURE);
+    }
+    if (log.count == 0) {
+        LOG_ERROR("Error: no samples to replay\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the same checks as ldr-reader, skipping combinations it would refuse
+    max_configs = range_count(&high) * range_count(&low) * range_count(&dark) *
+                  range_count(&high_duration) * range_count(&low_duration) * range_count(&dark_duration);
+    configs = malloc(max_configs * sizeof(struct replay_config_t));
+    results = malloc(max_configs * sizeof(struct replay_result_t));
+    if ((configs == NULL) || (results == NULL)) {
+        LOG_ERROR("Error: Out of memory for %zu combinations\n", max_configs);
+        exit(EXIT_FAILURE);
+    }
+    for (h = high.min; h <= high.max; h += high.step)
+    for (l = low.min; l <= low.max; l += low.step)
+    for (n = dark.min; n <= dark.max; n += dark.step)
+    for (hd = high_duration.min; hd <= high_duration.max; hd += high_duration.step)
+    for (ld = low_duration.min; ld <= low_duration.max; ld += low_duration.step)
+    for (nd = dark_duration.min; nd <= dark_duration.max; nd += dark_duration.step) {
+        if ((l >= h) || (n <= h))
+            continue;
+        configs[num_configs].high_threshold_us = h;
+        configs[num_configs].low_threshold_us = l;
+        configs[num_configs].complete_darkness_threshold_us = n;
+        configs[num_configs].high_threshold_duration_ms = hd;
+        configs[num_configs].low_threshold_duration_ms = ld;
+        configs[num_configs].complete_darkness_duration_ms = nd;
+        num_configs++;
+    }
+    if (num_configs == 0) {
+        LOG_ERROR("Error: every combination has a low threshold above the high threshold,\n");
+        LOG_ERROR("       or a complete darkness threshold below it\n");
+        exit(EXIT_FAILURE);
+    }
+    if (num_threads > (long)num_configs)
+        num_threads = (long)num_configs;
+
+    LOG_VERBOSE("Replaying %zu samples for %zu combinations on %ld threads\n",
+                log.count, num_configs, num_threads);
+    memset(&sweep, 0, sizeof(sweep));
+    sweep.log = &log;
+    sweep.configs = configs;
+    sweep.filter = &filter_chain;
+    sweep.results = results;
+    sweep.num_configs = num_configs;
+    sweep.flap_window_ms = flap_window_s * 1000;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // the main thread is a worker too
+    for (; num_threads_started < num_threads; num_threads_started++) {
+        if (pthread_create(&threads[num_threads_started], NULL, replay_worker, &sweep)) {
+            LOG_ERROR("Error: Failed to start replay thread\n");
+            break;
+        }
+    }
+    replay_worker(&sweep);
+    for (opt = 1; opt < num_threads_started; opt++)
+        pthread_join(threads[opt], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("# %zu samples, %.1f days, %zu combinations\n", log.count,
+           timespec_diff_ms(&(log.samples[log.count - 1].time), &(log.samples[0].time)) / 86400000.0,
+           num_configs);
+    printf("# high_ms low_ms dark_ms high_s low_s dark_s transitions flaps latency_avg_s latency_max_s dark_pct undecided\n");
+    for (i = 0; i < num_configs; i++) {
+        const struct replay_config_t *c = &configs[i];
+        const struct replay_result_t *r = &results[i];
+        int64_t span_ms = timespec_diff_ms(&(log.samples[log.count - 1].time), &(log.samples[0].time));
+        printf("%.3f %.3f %.3f %.3f %.3f %.3f %llu %llu %.1f %.1f %.1f %llu\n",
+               c->high_threshold_us / 1000.0, c->low_threshold_us / 1000.0,
+               c->complete_darkness_threshold_us / 1000.0,
+               c->high_threshold_duration_ms / 1000.0, c->low_threshold_duration_ms / 1000.0,
+               c->complete_darkness_duration_ms / 1000.0,
+               (unsigned long long)r->transitions, (unsigned long long)r->flaps,
+               r->transitions ? r->latency_ms_total / 1000.0 / r->transitions : 0.0,
+               r->latency_ms_max / 1000.0,
+               span_ms > 0 ? r->dark_ms * 100.0 / span_ms : 0.0,
+               (unsigned long long)r->undecided);
+        if (r->undecided)
+            num_undecidable++;
+    }
+    // the reader stopped timing those samples before the threshold
+    if (num_undecidable)
+        printf("# %zu combinations have thresholds beyond the recorded timeout, "
+               "their undecided samples were taken as dark\n", num_undecidable);
+    LOG_VERBOSE("Sweep took %lld ms\n", (long long)timespec_diff_ms(&end, &start));
+
+    free(configs);
+    free(results);
+    free(log.samples);
+    return 0;
+}
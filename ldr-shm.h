@@ -0,0 +1,163 @@
+/*
+ *    Filename: ldr-shm.h
+ * Description: Shared memory layout and header-only reader for the latest readings.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _LDR_SHM_H_
+#define _LDR_SHM_H_
+
+// ldr-reader started with -M publishes the latest reading of every LDR
+// in a POSIX shared memory segment. This header is all a reader needs:
+//
+//     struct ldr_shm_t *shm = ldr_shm_open(LDR_SHM_DEFAULT_NAME);
+//     struct ldr_shm_snapshot_t snap;
+//     ldr_shm_read(shm, ldr_shm_find(shm, 17), &snap);
+//     if (snap.state == LDR_SHM_STATE_DARK) ...
+//
+// Reading is a few loads, with no syscalls and no locks: each sensor is
+// a seqlock, the writer makes the sequence odd while it updates the
+// slot and the reader retries if it changed under it. Link with -lrt on
+// glibc older than 2.34.
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LDR_SHM_DEFAULT_NAME    "/ldr-reader"
+#define LDR_SHM_MAGIC           0x53524c44      // "LDRS"
+#define LDR_SHM_VERSION         1
+#define LDR_SHM_MAX_SENSORS     8
+
+#define LDR_SHM_STATE_UNKNOWN   0
+#define LDR_SHM_STATE_BRIGHT    1
+#define LDR_SHM_STATE_DARK      2
+
+// one cache line per sensor, so sensors don't share lines
+struct ldr_shm_sensor_t
+{
+    uint32_t seq;               // odd while being written
+    int32_t gpio;
+    uint32_t state;
+    uint32_t duration_us;       // last charge time
+    uint32_t timeout;           // last sample timed out
+    uint32_t reserved;
+    uint64_t samples;
+    uint64_t transitions;
+    int64_t sample_time_ns;     // CLOCK_REALTIME of the last sample
+    int64_t transition_time_ns; // CLOCK_REALTIME of the last transition
+    uint8_t pad[8];
+} __attribute__((aligned(64)));
+
+struct ldr_shm_t
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t num_sensors;
+    int32_t pid;                // of the writer
+    uint8_t pad[44];
+    struct ldr_shm_sensor_t sensors[LDR_SHM_MAX_SENSORS];
+};
+
+struct ldr_shm_snapshot_t
+{
+    uint32_t seq;
+    int gpio;
+    int state;
+    uint32_t duration_us;
+    int timeout;
+    uint64_t samples;
+    uint64_t transitions;
+    int64_t sample_time_ns;
+    int64_t transition_time_ns;
+};
+
+
+// maps the segment read-only, returns NULL if it isn't there or is
+// from an incompatible version.
+static inline struct ldr_shm_t *ldr_shm_open(const char *name)
+{
+    struct ldr_shm_t *shm;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(struct ldr_shm_t))) {
+        close(fd);
+        return NULL;
+    }
+    shm = (struct ldr_shm_t *)mmap(NULL, sizeof(struct ldr_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return NULL;
+    if ((shm->magic != LDR_SHM_MAGIC) || (shm->version != LDR_SHM_VERSION)) {
+        munmap(shm, sizeof(struct ldr_shm_t));
+        return NULL;
+    }
+    return shm;
+}
+
+// returns the sensor index for the GPIO pin, or -1
+static inline int ldr_shm_find(const struct ldr_shm_t *shm, int gpio)
+{
+    uint32_t i;
+
+    for (i = 0; (i < shm->num_sensors) && (i < LDR_SHM_MAX_SENSORS); i++) {
+        if (shm->sensors[i].gpio == gpio)
+            return (int)i;
+    }
+    return -1;
+}
+
+// consistent snapshot of one sensor. returns 0, or -1 if no such index.
+static inline int ldr_shm_read(const struct ldr_shm_t *shm, int index,
+                               struct ldr_shm_snapshot_t *snap)
+{
+    const volatile struct ldr_shm_sensor_t *s;
+    uint32_t seq;
+
+    if ((index < 0) || (index >= (int)shm->num_sensors) || (index >= LDR_SHM_MAX_SENSORS))
+        return -1;
+    s = &(shm->sensors[index]);
+    do {
+        seq = __atomic_load_n(&(s->seq), __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        snap->gpio = s->gpio;
+        snap->state = s->state;
+        snap->duration_us = s->duration_us;
+        snap->timeout = s->timeout;
+        snap->samples = s->samples;
+        snap->transitions = s->transitions;
+        snap->sample_time_ns = s->sample_time_ns;
+        snap->transition_time_ns = s->transition_time_ns;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || (seq != __atomic_load_n(&(s->seq), __ATOMIC_RELAXED)));
+    snap->seq = seq;
+    return 0;
+}
+
+static inline void ldr_shm_close(struct ldr_shm_t *shm)
+{
+    if (shm)
+        munmap(shm, sizeof(struct ldr_shm_t));
+}
+
+
+#endif // _LDR_SHM_H_
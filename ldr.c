@@ -17,13 +17,39 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "utils.h"
 #include "sysfsgpio.h"
+#include "gpiochip.h"
 #include "ldr.h"
+#include "profile.h"
 
 
-void ldr_cleanup(struct ldr_sensor_t *ldr)
+/*
+ * sysfs backend
+ */
+
+static int ldr_sysfs_open(struct ldr_sensor_t *ldr, int gpio, const char *arg)
+{
+    if (gpio_export(gpio)) {
+        return -1;
+    }
+    ldr->gpio = gpio;
+    ldr->fd_gpio_direction = gpio_open_direction(ldr->gpio);
+    ldr->fd_gpio_edge = gpio_open_edge(ldr->gpio);
+    ldr->fd_gpio_value = gpio_open_value(ldr->gpio);
+    if ((ldr->fd_gpio_direction < 0) ||
+        (ldr->fd_gpio_edge < 0) ||
+        (ldr->fd_gpio_value < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+
+static void ldr_sysfs_close(struct ldr_sensor_t *ldr)
 {
     if (ldr->fd_gpio_direction >= 0) {
         close(ldr->fd_gpio_direction);
@@ -44,57 +70,255 @@ void ldr_cleanup(struct ldr_sensor_t *ldr)
 }
 
 
-int ldr_init(struct ldr_sensor_t *ldr, int ldr_gpio)
+static int ldr_sysfs_drain(struct ldr_sensor_t *ldr)
+{
+    int ret = 0;
+    ret |= gpio_write_string(ldr->fd_gpio_direction, "out\n", "direction");
+    ret |= gpio_write_string(ldr->fd_gpio_value, "0\n", "value");
+    return ret;
+}
+
+
+static int ldr_sysfs_charge(struct ldr_sensor_t *ldr, struct timespec *start_time)
+{
+    char value_str[3];
+    int ret = 0;
+    ret |= gpio_write_string(ldr->fd_gpio_direction, "in\n", "direction");
+    ret |= gpio_write_string(ldr->fd_gpio_edge, "rising\n", "edge");
+    clock_gettime(CLOCK_MONOTONIC, start_time);
+    // consume any prior interrupt
+    lseek(ldr->fd_gpio_value, 0, SEEK_SET);
+    read(ldr->fd_gpio_value, value_str, sizeof(value_str));
+    return ret;
+}
+
+
+static int ldr_sysfs_event_fd(struct ldr_sensor_t *ldr, short *events)
+{
+    *events = POLLPRI;
+    return ldr->fd_gpio_value;
+}
+
+
+static int ldr_sysfs_read_edge(struct ldr_sensor_t *ldr, struct timespec *edge_time)
+{
+    char value_str[3];
+    clock_gettime(CLOCK_MONOTONIC, edge_time);
+    // consume interrupt
+    lseek(ldr->fd_gpio_value, 0, SEEK_SET);
+    read(ldr->fd_gpio_value, value_str, sizeof(value_str));
+    return 1;
+}
+
+
+static int ldr_sysfs_idle(struct ldr_sensor_t *ldr)
+{
+    // reset the edge back to none
+    return gpio_write_string(ldr->fd_gpio_edge, "none\n", "edge");
+}
+
+
+const struct ldr_gpio_ops ldr_sysfs_ops =
+{
+    .name = "sysfs",
+    .open = ldr_sysfs_open,
+    .close = ldr_sysfs_close,
+    .drain = ldr_sysfs_drain,
+    .charge = ldr_sysfs_charge,
+    .event_fd = ldr_sysfs_event_fd,
+    .read_edge = ldr_sysfs_read_edge,
+    .idle = ldr_sysfs_idle,
+};
+
+
+/*
+ * GPIO character device backend
+ */
+
+static int ldr_chardev_open(struct ldr_sensor_t *ldr, int gpio, const char *arg)
+{
+    int fd_chip;
+
+    fd_chip = gpiochip_open(arg ? arg : GPIOCHIP_DEFAULT_PATH);
+    if (fd_chip < 0)
+        return -1;
+    ldr->fd_gpio_line = gpiochip_request_line(fd_chip, gpio, GPIO_OUT, GPIO_LOW);
+    close(fd_chip);
+    if (ldr->fd_gpio_line < 0)
+        return -1;
+    ldr->gpio = gpio;
+    return 0;
+}
+
+
+static void ldr_chardev_close(struct ldr_sensor_t *ldr)
+{
+    if (ldr->fd_gpio_line >= 0) {
+        close(ldr->fd_gpio_line);
+        ldr->fd_gpio_line = -1;
+    }
+    ldr->gpio = -1;
+}
+
+
+static int ldr_chardev_drain(struct ldr_sensor_t *ldr)
+{
+    // edge detection is off while the line is an output
+    return gpiochip_line_output(ldr->fd_gpio_line, GPIO_LOW);
+}
+
+
+static int ldr_chardev_charge(struct ldr_sensor_t *ldr, struct timespec *start_time)
+{
+    gpiochip_line_flush_events(ldr->fd_gpio_line);
+    // charging starts as soon as the kernel flips the direction, before
+    // the ioctl returns.
+    clock_gettime(CLOCK_MONOTONIC, start_time);
+    return gpiochip_line_input(ldr->fd_gpio_line, GPIO_EDGE_RISING);
+}
+
+
+static int ldr_chardev_event_fd(struct ldr_sensor_t *ldr, short *events)
+{
+    *events = POLLIN;
+    return ldr->fd_gpio_line;
+}
+
+
+static int ldr_chardev_read_edge(struct ldr_sensor_t *ldr, struct timespec *edge_time)
+{
+    // the kernel timestamps the edge, so wakeup latency does not count
+    return gpiochip_read_edge(ldr->fd_gpio_line, edge_time);
+}
+
+
+const struct ldr_gpio_ops ldr_chardev_ops =
+{
+    .name = "chardev",
+    .open = ldr_chardev_open,
+    .close = ldr_chardev_close,
+    .drain = ldr_chardev_drain,
+    .charge = ldr_chardev_charge,
+    .event_fd = ldr_chardev_event_fd,
+    .read_edge = ldr_chardev_read_edge,
+};
+
+
+
+void ldr_cleanup(struct ldr_sensor_t *ldr)
+{
+    if (ldr->ops) {
+        ldr->ops->close(ldr);
+        ldr->ops = NULL;
+    }
+}
+
+
+void ldr_reset(struct ldr_sensor_t *ldr)
 {
     memset(ldr, 0, sizeof(struct ldr_sensor_t));
     ldr->gpio = -1;
     ldr->fd_gpio_direction = -1;
     ldr->fd_gpio_edge = -1;
     ldr->fd_gpio_value = -1;
-    ldr->fd_raw_value_log_file = -1;
+    ldr->fd_gpio_line = -1;
 
     clock_gettime(CLOCK_MONOTONIC, &(ldr->cross_threshold_start_time));
-    ldr->high_threshold = LDR_DEFAULT_HIGH_THRESHOLD;
-    ldr->low_threshold = LDR_DEFAULT_LOW_THRESHOLD;
-    ldr->complete_darkness_threshold = LDR_DEFAULT_COMPLETE_DARKNESS_THRESHOLD;
+    ldr->high_threshold_us = LDR_DEFAULT_HIGH_THRESHOLD_US;
+    ldr->low_threshold_us = LDR_DEFAULT_LOW_THRESHOLD_US;
+    ldr->complete_darkness_threshold_us = LDR_DEFAULT_COMPLETE_DARKNESS_THRESHOLD_US;
     ldr->high_threshold_duration_ms = LDR_DEFAULT_HIGH_DURATION_MS;
     ldr->low_threshold_duration_ms = LDR_DEFAULT_LOW_DURATION_MS;
     ldr->complete_darkness_duration_ms = LDR_DEFAULT_COMPLETE_DARKNESS_DURATION_MS;
+    ldr->max_charge_timeout_us = LDR_DEFAULT_MAX_CHARGE_TIMEOUT_MS * 1000;
+    ldr->charge_timeout_us = ldr->max_charge_timeout_us;
+    ldr->min_period_us = (uint64_t)LDR_DEFAULT_MIN_PERIOD_MS * 1000;
+    ldr->max_period_us = (uint64_t)LDR_DEFAULT_MAX_PERIOD_MS * 1000;
+    ldr->period_us = ldr->min_period_us;
+    ldr->drain_multiple_pct = LDR_DEFAULT_DRAIN_MULTIPLE_PCT;
+    ldr->min_drain_us = LDR_DEFAULT_MIN_DRAIN_US;
+    // no reading yet, drain for as long as we ever do
+    ldr->drain_us = LDR_MAX_DRAIN_US;
+}
 
-    if (gpio_export(ldr_gpio)) {
-        return -1;
-    }
-    ldr->gpio = ldr_gpio;
-    ldr->fd_gpio_direction = gpio_open_direction(ldr->gpio);
-    ldr->fd_gpio_edge = gpio_open_edge(ldr->gpio);
-    ldr->fd_gpio_value = gpio_open_value(ldr->gpio);
-    if ((ldr->fd_gpio_direction < 0) ||
-        (ldr->fd_gpio_edge < 0) ||
-        (ldr->fd_gpio_value < 0)) {
+
+int ldr_init(struct ldr_sensor_t *ldr, int ldr_gpio,
+             const struct ldr_gpio_ops *ops, const char *backend_arg)
+{
+    ldr_reset(ldr);
+
+    ldr->ops = ops;
+    if (ops->open(ldr, ldr_gpio, backend_arg)) {
         ldr_cleanup(ldr);
         return -1;
     }
+    // time stamps come from the backend clock, which may be simulated
+    ldr_clock(ldr, &(ldr->cross_threshold_start_time));
     return 0;
 }
 
 
+void ldr_clock(struct ldr_sensor_t *ldr, struct timespec *now)
+{
+    if (ldr->ops && ldr->ops->clock)
+        ldr->ops->clock(ldr, now);
+    else
+        clock_gettime(CLOCK_MONOTONIC, now);
+}
+
+
 void ldr_configure(struct ldr_sensor_t *ldr,
-                   unsigned int high_threshold,
-                   unsigned int low_threshold,
-                   unsigned int complete_darkness_threshold,
+                   ldr_duration_t high_threshold_us,
+                   ldr_duration_t low_threshold_us,
+                   ldr_duration_t complete_darkness_threshold_us,
                    unsigned int high_threshold_duration_ms,
                    unsigned int low_threshold_duration_ms,
                    unsigned int complete_darkness_duration_ms)
 {
-    ldr->high_threshold = high_threshold;
-    ldr->low_threshold = low_threshold;
-    ldr->complete_darkness_threshold = complete_darkness_threshold;
+    ldr->high_threshold_us = high_threshold_us;
+    ldr->low_threshold_us = low_threshold_us;
+    ldr->complete_darkness_threshold_us = complete_darkness_threshold_us;
     ldr->high_threshold_duration_ms = high_threshold_duration_ms;
     ldr->low_threshold_duration_ms = low_threshold_duration_ms;
     ldr->complete_darkness_duration_ms = complete_darkness_duration_ms;
 }
 
 
+void ldr_configure_timeout(struct ldr_sensor_t *ldr, unsigned int max_charge_timeout_ms)
+{
+    ldr->max_charge_timeout_us = max_charge_timeout_ms * 1000;
+    if (ldr->max_charge_timeout_us < LDR_MIN_CHARGE_TIMEOUT_US)
+        ldr->max_charge_timeout_us = LDR_MIN_CHARGE_TIMEOUT_US;
+    ldr->charge_timeout_us = ldr->max_charge_timeout_us;
+}
+
+
+void ldr_configure_period(struct ldr_sensor_t *ldr,
+                          unsigned int min_period_ms,
+                          unsigned int max_period_ms)
+{
+    ldr->min_period_us = (uint64_t)min_period_ms * 1000;
+    ldr->max_period_us = (uint64_t)max_period_ms * 1000;
+    ldr->period_us = ldr->min_period_us;
+}
+
+
+void ldr_configure_filter(struct ldr_sensor_t *ldr, const struct filter_chain_t *filter)
+{
+    memcpy(&(ldr->filter), filter, sizeof(struct filter_chain_t));
+    filter_reset(&(ldr->filter));
+}
+
+
+void ldr_configure_drain(struct ldr_sensor_t *ldr,
+                         unsigned int drain_multiple_pct,
+                         uint32_t min_drain_us)
+{
+    ldr->drain_multiple_pct = drain_multiple_pct;
+    ldr->min_drain_us = min_drain_us;
+}
+
+
 void ldr_register_callback(struct ldr_sensor_t *ldr,
                            LDRTriggerCallback cb, void *priv_data)
 {
@@ -104,83 +328,627 @@ void ldr_register_callback(struct ldr_sensor_t *ldr,
 }
 
 
-static void ldr_update_state(struct ldr_sensor_t *ldr, int ldr_duration_ms,
-                             struct timespec *now)
+void ldr_register_sample_callback(struct ldr_sensor_t *ldr,
+                                  LDRSampleCallback cb, void *priv_data)
 {
-    int time_diff_ms = (now->tv_sec - ldr->cross_threshold_start_time.tv_sec) * 1000 + (now->tv_nsec - ldr->cross_threshold_start_time.tv_nsec) / 1000000;
+    ldr->sample_cb = cb;
+    ldr->sample_priv_data = priv_data;
+}
+
+
+static void ldr_trigger(struct ldr_sensor_t *ldr, ldr_duration_t ldr_duration_us)
+{
+    if (ldr->trigger_cb) {
+        PROFILE_BEGIN(cb_start);
+        ldr->trigger_cb(ldr->priv_data, ldr, ldr->state, ldr_duration_us);
+        PROFILE_END(PROFILE_TRIGGER_CB, cb_start);
+    }
+}
+
+
+// The debounce time starts at the first sample that crosses the threshold,
+// so it does not depend on how long ago the previous sample was taken.
+void ldr_update_state(struct ldr_sensor_t *ldr, ldr_duration_t ldr_duration_us,
+                      const struct timespec *now)
+{
+    int64_t time_diff_ms;
+    ldr->last_duration_us = ldr_duration_us;
     if (ldr->state == LDR_BRIGHT) {
-        if (ldr_duration_ms >= ldr->high_threshold) {
-            if (((ldr_duration_ms >= ldr->complete_darkness_threshold) &&
+        if (ldr_duration_us >= ldr->high_threshold_us) {
+            if (!ldr->debouncing) {
+                memcpy(&(ldr->cross_threshold_start_time), now, sizeof(struct timespec));
+                ldr->debouncing = 1;
+            }
+            time_diff_ms = timespec_diff_ms(now, &(ldr->cross_threshold_start_time));
+            if (((ldr_duration_us >= ldr->complete_darkness_threshold_us) &&
                  (time_diff_ms >= ldr->complete_darkness_duration_ms)) ||
                 (time_diff_ms >= ldr->high_threshold_duration_ms)) {
                 ldr->state = LDR_DARK;
+                ldr->debouncing = 0;
                 memcpy(&(ldr->cross_threshold_start_time), now, sizeof(struct timespec));
-                if (ldr->trigger_cb)
-                    ldr->trigger_cb(ldr->priv_data, ldr->state);
+                ldr->stats.transitions++;
+                ldr_trigger(ldr, ldr_duration_us);
             }
-        } else
+        } else {
             memcpy(&(ldr->cross_threshold_start_time), now, sizeof(struct timespec));
+            ldr->debouncing = 0;
+        }
     } else if (ldr->state == LDR_DARK) {
-        if (ldr_duration_ms < ldr->low_threshold) {
+        if (ldr_duration_us < ldr->low_threshold_us) {
+            if (!ldr->debouncing) {
+                memcpy(&(ldr->cross_threshold_start_time), now, sizeof(struct timespec));
+                ldr->debouncing = 1;
+            }
+            time_diff_ms = timespec_diff_ms(now, &(ldr->cross_threshold_start_time));
             if (time_diff_ms >= ldr->low_threshold_duration_ms) {
                 ldr->state = LDR_BRIGHT;
+                ldr->debouncing = 0;
                 memcpy(&(ldr->cross_threshold_start_time), now, sizeof(struct timespec));
-                if (ldr->trigger_cb)
-                    ldr->trigger_cb(ldr->priv_data, ldr->state);
+                ldr->stats.transitions++;
+                ldr_trigger(ldr, ldr_duration_us);
             }
-        } else
+        } else {
             memcpy(&(ldr->cross_threshold_start_time), now, sizeof(struct timespec));
+            ldr->debouncing = 0;
+        }
     } else {
-        if ((ldr_duration_ms >= ldr->complete_darkness_threshold) ||
-            (ldr_duration_ms >= (ldr->high_threshold + ldr->low_threshold)/2))
+        if ((ldr_duration_us >= ldr->complete_darkness_threshold_us) ||
+            (ldr_duration_us >= (ldr->high_threshold_us + ldr->low_threshold_us)/2))
             ldr->state = LDR_DARK;
         else
             ldr->state = LDR_BRIGHT;
+        ldr->debouncing = 0;
         memcpy(&(ldr->cross_threshold_start_time), now, sizeof(struct timespec));
-        if (ldr->trigger_cb)
-            ldr->trigger_cb(ldr->priv_data, ldr->state);
+        ldr_trigger(ldr, ldr_duration_us);
+    }
+}
+
+
+// Picks the sampling period after a sample. Back off while the reading
+// sits far from the threshold that could end the current state, go back
+// to the minimum period near the threshold or while debouncing. A dark
+// reading that timed out is past the timeout, which is already beyond
+// the low threshold.
+static void ldr_schedule(struct ldr_sensor_t *ldr, ldr_duration_t ldr_duration_us, int edge)
+{
+    int near;
+
+    if (ldr->debouncing || (ldr->state == LDR_UNKNOWN))
+        near = 1;
+    else if (ldr->state == LDR_BRIGHT)
+        near = ((uint64_t)ldr_duration_us * LDR_SCHEDULE_NEAR_RATIO >= ldr->high_threshold_us);
+    else
+        near = edge && (ldr_duration_us < (uint64_t)ldr->low_threshold_us * LDR_SCHEDULE_NEAR_RATIO);
+
+    if (near)
+        ldr->period_us = ldr->min_period_us;
+    else
+        ldr->period_us += ldr->period_us / 2;
+    if (ldr->period_us > ldr->max_period_us)
+        ldr->period_us = ldr->max_period_us;
+    if (ldr->period_us < ldr->min_period_us)
+        ldr->period_us = ldr->min_period_us;
+}
+
+
+// Picks the charge timeout of the next cycle. A reading only has to be
+// timed until it decides the next state: past the low threshold when
+// dark, past the high threshold when bright, and past the complete
+// darkness threshold once a bright sensor reads dark or times out, so the
+// fast path can see it. A reading that times out is at least as dark as
+// the timeout. Only the maximum timeout saturates the sensor.
+static void ldr_range_timeout(struct ldr_sensor_t *ldr, ldr_duration_t ldr_duration_us, int edge)
+{
+    uint64_t timeout_us;
+
+    if (ldr->full_range)
+        timeout_us = ldr->max_charge_timeout_us;
+    else if (ldr->state == LDR_DARK)
+        timeout_us = ldr->low_threshold_us;
+    else if ((ldr->state == LDR_UNKNOWN) || !edge || (ldr_duration_us >= ldr->high_threshold_us))
+        timeout_us = ldr->complete_darkness_threshold_us;
+    else
+        timeout_us = ldr->high_threshold_us;
+    timeout_us = timeout_us * LDR_CHARGE_TIMEOUT_MARGIN_PCT / 100;
+    if (timeout_us > ldr->max_charge_timeout_us)
+        timeout_us = ldr->max_charge_timeout_us;
+    if (timeout_us < LDR_MIN_CHARGE_TIMEOUT_US)
+        timeout_us = LDR_MIN_CHARGE_TIMEOUT_US;
+    ldr->charge_timeout_us = (uint32_t)timeout_us;
+}
+
+
+// The capacitor only needs to be drained for a few RC time constants, and
+// the last charge time is proportional to the RC constant. A timed out
+// reading charged no longer than it was timed, so that bounds the drain.
+static void ldr_schedule_drain(struct ldr_sensor_t *ldr, ldr_duration_t ldr_duration_us)
+{
+    uint64_t drain_us = (uint64_t)ldr_duration_us * ldr->drain_multiple_pct / 100;
+
+    if (drain_us < ldr->min_drain_us)
+        drain_us = ldr->min_drain_us;
+    if (drain_us > LDR_MAX_DRAIN_US)
+        drain_us = LDR_MAX_DRAIN_US;
+    ldr->drain_us = (uint32_t)drain_us;
+}
+
+
+// drains all capacitors, returns the drain time needed by the sensor that
+// needs the longest one.
+static uint32_t ldr_drain_all(struct ldr_sensor_t **ldrs, int count, int *ret)
+{
+    uint32_t drain_us = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        struct ldr_sensor_t *ldr = ldrs[i];
+        PROFILE_BEGIN(drain_start);
+        *ret |= ldr->ops->drain(ldr);
+        PROFILE_END(PROFILE_DRAIN_WRITE, drain_start);
+        if (ldr->drain_us > drain_us)
+            drain_us = ldr->drain_us;
     }
-    if (ldr->fd_raw_value_log_file >= 0) {
-        char rawbuf[3];
-        rawbuf[2] = (char)(ldr->state);
-        rawbuf[1] = (char)((ldr_duration_ms >> 8) & 0xFF);
-        rawbuf[0] = (char)(ldr_duration_ms & 0xFF);
-        write(ldr->fd_raw_value_log_file, rawbuf, sizeof(rawbuf));
+    for (i = 0; i < count; i++) {
+        struct ldr_stats_t *stats = &(ldrs[i]->stats);
+        stats->cycles++;
+        stats->drain_us_last = drain_us;
+        stats->drain_us_total += drain_us;
+        if ((stats->drain_us_min == 0) || (drain_us < stats->drain_us_min))
+            stats->drain_us_min = drain_us;
+        if (drain_us > stats->drain_us_max)
+            stats->drain_us_max = drain_us;
     }
+    return drain_us;
 }
 
 
-int ldr_read_once(struct ldr_sensor_t *ldr)
+// completes the charge phase of one sensor. edge is 1 if the backend saw
+// the edge at now, 0 if the charge timed out at now.
+static void ldr_finish_charge(struct ldr_sensor_t *ldr, int edge, struct timespec *now)
+{
+    int64_t duration_us = timespec_diff_us(now, &(ldr->charge_start_time));
+    // ranged timeouts only cut a reading short once it has decided the state
+    int saturated = !edge && (ldr->charge_timeout_us >= ldr->max_charge_timeout_us);
+    if (duration_us < 0)
+        duration_us = 0;
+    // a saturated reading is at least the timeout, however early the
+    // timeout was noticed
+    if (!edge && (duration_us < ldr->charge_timeout_us))
+        duration_us = ldr->charge_timeout_us;
+    ldr->last_timeout = !edge;
+    PROFILE_BEGIN(update_start);
+    // the drain time and the logs follow the raw reading, only the
+    // state machine sees the filtered one
+    ldr_update_state(ldr, filter_apply(&(ldr->filter), (ldr_duration_t)duration_us), now);
+    PROFILE_END(PROFILE_UPDATE_STATE, update_start);
+    ldr_schedule(ldr, (ldr_duration_t)duration_us, edge);
+    ldr_schedule_drain(ldr, (ldr_duration_t)duration_us);
+    ldr_range_timeout(ldr, (ldr_duration_t)duration_us, edge);
+    if (ldr->raw_log) {
+        uint64_t timestamp_us = (uint64_t)now->tv_sec * 1000000 + now->tv_nsec / 1000;
+        PROFILE_BEGIN(rawlog_start);
+        rawlog_append(ldr->raw_log, timestamp_us, (ldr_duration_t)duration_us,
+                      (uint8_t)ldr->state, !edge);
+        PROFILE_END(PROFILE_RAWLOG, rawlog_start);
+    }
+    ldr->stats.samples++;
+    if (saturated)
+        ldr->stats.timeouts++;
+    else if (!edge)
+        ldr->stats.range_timeouts++;
+    if (ldr->sample_cb) {
+        PROFILE_BEGIN(cb_start);
+        ldr->sample_cb(ldr->sample_priv_data, ldr, (ldr_duration_t)duration_us, !edge);
+        PROFILE_END(PROFILE_SAMPLE_CB, cb_start);
+    }
+    LOG_VERBOSE("%d: %d.%03d ms%s, next drain %u.%03u ms\n", ldr->gpio,
+                (int)(duration_us / 1000), (int)(duration_us % 1000),
+                saturated ? " (saturated)" : edge ? "" : " (timeout)",
+                ldr->drain_us / 1000, ldr->drain_us % 1000);
+}
+
+
+// Busy-polls the level of sensors whose backend has no event fd, each
+// against its own deadline on the backend clock. Returns once every one
+// of them has seen its edge or timed out.
+static void ldr_spin_charge(struct ldr_sensor_t **spin, int num_spin)
+{
+    struct timespec now;
+    int i, n;
+
+    while (num_spin > 0) {
+        for (i = 0, n = 0; i < num_spin; i++) {
+            struct ldr_sensor_t *ldr = spin[i];
+            int level = ldr->ops->read_level(ldr);
+            ldr_clock(ldr, &now);
+            if (level > 0) {
+                ldr_finish_charge(ldr, 1, &now);
+            } else if (timespec_diff_us(&now, &(ldr->charge_start_time)) >=
+                       (int64_t)ldr->charge_timeout_us) {
+                ldr_finish_charge(ldr, 0, &now);
+            } else {
+                spin[n++] = ldr;
+            }
+        }
+        num_spin = n;
+    }
+}
+
+
+// Measures all sensors in one cycle: every capacitor is drained at the
+// same time, then all of them charge together and a single poll() waits
+// for the edges. Each edge is timestamped separately, so N sensors cost
+// one cycle instead of N.
+int ldr_read_all(struct ldr_sensor_t **ldrs, int count)
 {
-    struct timespec start_time;
+    struct pollfd pfds[LDR_MAX_SENSORS];
+    struct ldr_sensor_t *pending[LDR_MAX_SENSORS];
+    struct ldr_sensor_t *spin[LDR_MAX_SENSORS];
+    struct timespec charge_begin;
     struct timespec now;
-    int time_diff_ms = 0;
+    int time_diff_ms;
+    int num_pending = 0;
+    int num_spin = 0;
     int poll_ret;
     int ret = 0;
+    int i, n;
+
+    if (count > LDR_MAX_SENSORS)
+        count = LDR_MAX_SENSORS;
 
     // drain capacitor
-    ret |= gpio_write_string(ldr->fd_gpio_direction, "out\n", "direction");
-    ret |= gpio_write_string(ldr->fd_gpio_value, "0\n", "value");
-    udelay(100000);
-    // no need to read too quickly, add additional delay
-    if (time_diff_ms < 250)
-        udelay((250 - time_diff_ms)*1000);
+    PROFILE_BEGIN(cycle_start);
+    udelay(ldr_drain_all(ldrs, count, &ret));
+    PROFILE_END(PROFILE_DRAIN, cycle_start);
     // change to input to let capacitor charge
-    ret |= gpio_write_string(ldr->fd_gpio_direction, "in\n", "direction");
-    ret |= gpio_write_string(ldr->fd_gpio_edge, "rising\n", "edge");
-    if (ret != 0)
-        return ret;
-    // time the interrupt
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
-    poll_ret = gpio_wait_for_interrupt_fd(ldr->fd_gpio_value, 400);
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    if (poll_ret >= 0) {
-        time_diff_ms = (now.tv_sec - start_time.tv_sec) * 1000 + (now.tv_nsec - start_time.tv_nsec) / 1000000;
-        ldr_update_state(ldr, time_diff_ms, &now);
-        LOG_VERBOSE("%d ms\n", time_diff_ms);
+    for (i = 0; i < count; i++) {
+        int charge_ret;
+        PROFILE_BEGIN(charge_start);
+        charge_ret = ldrs[i]->ops->charge(ldrs[i], &(ldrs[i]->charge_start_time));
+        PROFILE_END(PROFILE_CHARGE_ARM, charge_start);
+        if (charge_ret != 0) {
+            ldrs[i]->stats.errors++;
+            ret = -1;
+        }
+        else if (ldrs[i]->ops->event_fd == NULL)
+            spin[num_spin++] = ldrs[i];
+        else
+            pending[num_pending++] = ldrs[i];
+    }
+    ldr_spin_charge(spin, num_spin);
+    // time the interrupts
+    clock_gettime(CLOCK_MONOTONIC, &charge_begin);
+    while (num_pending > 0) {
+        int timeout_ms = -1;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        time_diff_ms = timespec_diff_ms(&now, &charge_begin);
+        for (i = 0, n = 0; i < num_pending; i++) {
+            int remaining_ms = (int)((pending[i]->charge_timeout_us + 999) / 1000) - time_diff_ms;
+            if (remaining_ms <= 0) {
+                // timed out
+                ldr_clock(pending[i], &now);
+                ldr_finish_charge(pending[i], 0, &now);
+                continue;
+            }
+            if ((timeout_ms < 0) || (remaining_ms < timeout_ms))
+                timeout_ms = remaining_ms;
+            pending[n] = pending[i];
+            pfds[n].fd = pending[n]->ops->event_fd(pending[n], &pfds[n].events);
+            pfds[n].revents = 0;
+            n++;
+        }
+        num_pending = n;
+        if (num_pending == 0)
+            break;
+        poll_ret = poll(pfds, num_pending, timeout_ms);
+        if (poll_ret < 0) {
+            if (errno != EINTR)
+                LOG_ERROR("Error: poll failed: %s\n", strerror(errno));
+            // drop the rest of this cycle
+            ret = -1;
+            break;
+        }
+        for (i = 0, n = 0; i < num_pending; i++) {
+            if (pfds[i].revents) {
+                int edge;
+                PROFILE_BEGIN(edge_start);
+                edge = pending[i]->ops->read_edge(pending[i], &now);
+                PROFILE_END(PROFILE_READ_EDGE, edge_start);
+                if (edge >= 0)
+                    ldr_finish_charge(pending[i], edge, &now);
+                else
+                    pending[i]->stats.errors++;
+            } else {
+                pending[n++] = pending[i];
+            }
+        }
+        num_pending = n;
+    }
+    PROFILE_END(PROFILE_CYCLE, cycle_start);
+    for (i = 0; i < count; i++) {
+        if (ldrs[i]->ops->idle) {
+            PROFILE_BEGIN(idle_start);
+            ret |= ldrs[i]->ops->idle(ldrs[i]);
+            PROFILE_END(PROFILE_IDLE, idle_start);
+        }
     }
-    // reset the edge back to none
-    ret |= gpio_write_string(ldr->fd_gpio_edge, "none\n", "edge");
 
     return ret;
 }
+
+
+int ldr_read_once(struct ldr_sensor_t *ldr)
+{
+    return ldr_read_all(&ldr, 1);
+}
+
+
+
+/*
+ * event loop driven measurement cycle
+ */
+
+static void ldr_cycle_end(struct ldr_cycle_t *cycle)
+{
+    struct timespec now;
+    uint64_t period_us = 0;
+    int64_t elapsed_us;
+    int i;
+
+    PROFILE_END(PROFILE_CYCLE, cycle->cycle_start);
+    loop_timer_disarm(&(cycle->timer));
+    for (i = 0; i < cycle->count; i++) {
+        struct ldr_sensor_t *ldr = cycle->slots[i].ldr;
+        cycle->slots[i].pending = 0;
+        if (ldr->ops->idle) {
+            PROFILE_BEGIN(idle_start);
+            ldr->ops->idle(ldr);
+            PROFILE_END(PROFILE_IDLE, idle_start);
+        }
+    }
+    cycle->num_pending = 0;
+    cycle->phase = LDR_PHASE_IDLE;
+
+    // the next cycle starts one period after this one started, the
+    // shortest period any of the sensors asks for wins
+    for (i = 0; i < cycle->count; i++) {
+        if ((i == 0) || (cycle->slots[i].ldr->period_us < period_us))
+            period_us = cycle->slots[i].ldr->period_us;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_us = timespec_diff_us(&now, &(cycle->cycle_start));
+    if ((int64_t)period_us <= elapsed_us)
+        ldr_cycle_begin(cycle);
+    else
+        loop_timer_arm_us(&(cycle->timer), period_us - elapsed_us);
+}
+
+
+// arms the timer for the earliest charge deadline of the pending sensors,
+// timing out the ones that are already past it.
+static void ldr_cycle_check_timeouts(struct ldr_cycle_t *cycle)
+{
+    struct timespec now;
+    int64_t elapsed_us;
+    int64_t next_us = -1;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_us = timespec_diff_us(&now, &(cycle->charge_begin));
+    for (i = 0; i < cycle->count; i++) {
+        struct ldr_cycle_slot_t *slot = &(cycle->slots[i]);
+        int64_t remaining_us;
+        if (!slot->pending)
+            continue;
+        remaining_us = (int64_t)slot->ldr->charge_timeout_us - elapsed_us;
+        if (remaining_us <= 0) {
+            struct timespec ldr_now;
+            ldr_clock(slot->ldr, &ldr_now);
+            slot->pending = 0;
+            cycle->num_pending--;
+            ldr_finish_charge(slot->ldr, 0, &ldr_now);
+        } else if ((next_us < 0) || (remaining_us < next_us)) {
+            next_us = remaining_us;
+        }
+    }
+    if (cycle->num_pending == 0)
+        ldr_cycle_end(cycle);
+    else
+        loop_timer_arm_us(&(cycle->timer), next_us);
+}
+
+
+static void ldr_cycle_charge(struct ldr_cycle_t *cycle)
+{
+    struct ldr_sensor_t *spin[LDR_MAX_SENSORS];
+    int num_spin = 0;
+    int i;
+
+    PROFILE_END(PROFILE_DRAIN, cycle->cycle_start);
+    cycle->phase = LDR_PHASE_CHARGE;
+    cycle->num_pending = 0;
+    for (i = 0; i < cycle->count; i++) {
+        struct ldr_cycle_slot_t *slot = &(cycle->slots[i]);
+        int charge_ret;
+        PROFILE_BEGIN(charge_start);
+        charge_ret = slot->ldr->ops->charge(slot->ldr, &(slot->ldr->charge_start_time));
+        PROFILE_END(PROFILE_CHARGE_ARM, charge_start);
+        // no reading this cycle, the state stays as it is
+        if (charge_ret != 0) {
+            slot->ldr->stats.errors++;
+            continue;
+        }
+        if (slot->ldr->ops->event_fd == NULL) {
+            spin[num_spin++] = slot->ldr;
+        } else {
+            slot->pending = 1;
+            cycle->num_pending++;
+        }
+    }
+    // busy-polled backends hold the loop for the charge time, that is the
+    // price of timing without syscalls
+    ldr_spin_charge(spin, num_spin);
+    clock_gettime(CLOCK_MONOTONIC, &(cycle->charge_begin));
+    ldr_cycle_check_timeouts(cycle);
+}
+
+
+static void ldr_cycle_timer_cb(void *priv_data, uint32_t events)
+{
+    struct ldr_cycle_t *cycle = (struct ldr_cycle_t *)priv_data;
+
+    // an edge handled earlier in the same batch may have re-armed the
+    // timer, which leaves nothing to read: the event is stale
+    if (loop_timer_ack(&(cycle->timer)))
+        return;
+    if (cycle->phase == LDR_PHASE_IDLE)
+        ldr_cycle_begin(cycle);
+    else if (cycle->phase == LDR_PHASE_DRAIN)
+        ldr_cycle_charge(cycle);
+    else if (cycle->phase == LDR_PHASE_CHARGE)
+        ldr_cycle_check_timeouts(cycle);
+}
+
+
+static void ldr_cycle_edge_cb(void *priv_data, uint32_t events)
+{
+    struct ldr_cycle_slot_t *slot = (struct ldr_cycle_slot_t *)priv_data;
+    struct ldr_cycle_t *cycle = slot->cycle;
+    struct timespec now;
+    int edge;
+
+    // always consume the event, stale ones outside the charge phase are
+    // dropped
+    PROFILE_BEGIN(edge_start);
+    edge = slot->ldr->ops->read_edge(slot->ldr, &now);
+    PROFILE_END(PROFILE_READ_EDGE, edge_start);
+    if ((cycle->phase != LDR_PHASE_CHARGE) || !slot->pending || (edge < 0))
+        return;
+    slot->pending = 0;
+    cycle->num_pending--;
+    ldr_finish_charge(slot->ldr, edge, &now);
+    if (cycle->num_pending == 0)
+        ldr_cycle_end(cycle);
+}
+
+
+int ldr_cycle_init(struct ldr_cycle_t *cycle, struct loop_t *loop,
+                   struct ldr_sensor_t **ldrs, int count)
+{
+    int i;
+
+    memset(cycle, 0, sizeof(struct ldr_cycle_t));
+    cycle->loop = loop;
+    cycle->timer.fd = -1;
+    if (count > LDR_MAX_SENSORS)
+        count = LDR_MAX_SENSORS;
+    for (i = 0; i < LDR_MAX_SENSORS; i++)
+        cycle->slots[i].src.fd = -1;
+
+    if (loop_timer_init(loop, &(cycle->timer), ldr_cycle_timer_cb, cycle))
+        return -1;
+    for (i = 0; i < count; i++) {
+        struct ldr_cycle_slot_t *slot = &(cycle->slots[i]);
+        short events;
+        int fd;
+
+        slot->cycle = cycle;
+        slot->ldr = ldrs[i];
+        cycle->count++;
+        if (ldrs[i]->ops->event_fd == NULL)
+            continue;
+        fd = ldrs[i]->ops->event_fd(ldrs[i], &events);
+        if (loop_add(loop, &(slot->src), fd, (uint32_t)events, ldr_cycle_edge_cb, slot)) {
+            slot->src.fd = -1;
+            ldr_cycle_cleanup(cycle);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// starts a cycle by draining all capacitors, the rest of the cycle runs
+// from the event loop and the next cycle is scheduled when one completes.
+void ldr_cycle_begin(struct ldr_cycle_t *cycle)
+{
+    struct ldr_sensor_t *ldrs[LDR_MAX_SENSORS];
+    uint32_t drain_us;
+    int ret = 0;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &(cycle->cycle_start));
+    for (i = 0; i < cycle->count; i++)
+        ldrs[i] = cycle->slots[i].ldr;
+    drain_us = ldr_drain_all(ldrs, cycle->count, &ret);
+    cycle->phase = LDR_PHASE_DRAIN;
+    loop_timer_arm_us(&(cycle->timer), drain_us);
+}
+
+
+void ldr_cycle_cleanup(struct ldr_cycle_t *cycle)
+{
+    int i;
+
+    for (i = 0; i < cycle->count; i++) {
+        // fds belong to the sensor backends
+        loop_remove(cycle->loop, &(cycle->slots[i].src));
+        cycle->slots[i].src.fd = -1;
+    }
+    cycle->count = 0;
+    loop_source_close(cycle->loop, &(cycle->timer));
+}
+
+
+void ldr_print_stats(const struct ldr_sensor_t *ldr, FILE *stream)
+{
+    const struct ldr_stats_t *stats = &(ldr->stats);
+    uint64_t drain_us_avg = stats->cycles ? stats->drain_us_total / stats->cycles : 0;
+
+    fprintf(stream, "LDR %d: samples %llu, saturated %llu (%.1f%%), ranged timeouts %llu, errors %llu, "
+            "transitions %llu\n", ldr->gpio,
+            (unsigned long long)stats->samples, (unsigned long long)stats->timeouts,
+            stats->samples ? stats->timeouts * 100.0 / stats->samples : 0.0,
+            (unsigned long long)stats->range_timeouts,
+            (unsigned long long)stats->errors, (unsigned long long)stats->transitions);
+    fprintf(stream, "LDR %d: last %u.%03u ms, period %llu ms, charge timeout %u.%03u ms\n", ldr->gpio,
+            ldr->last_duration_us / 1000, ldr->last_duration_us % 1000,
+            (unsigned long long)(ldr->period_us / 1000),
+            ldr->charge_timeout_us / 1000, ldr->charge_timeout_us % 1000);
+    fprintf(stream, "LDR %d: drain last %u.%03u ms, min %u.%03u ms, avg %llu.%03llu ms, max %u.%03u ms\n", ldr->gpio,
+            stats->drain_us_last / 1000, stats->drain_us_last % 1000,
+            stats->drain_us_min / 1000, stats->drain_us_min % 1000,
+            (unsigned long long)(drain_us_avg / 1000), (unsigned long long)(drain_us_avg % 1000),
+            stats->drain_us_max / 1000, stats->drain_us_max % 1000);
+    if (ldr->filter.count) {
+        fprintf(stream, "LDR %d: filter stages %d, outliers rejected %llu\n", ldr->gpio,
+                ldr->filter.count, (unsigned long long)filter_rejected(&(ldr->filter)));
+    }
+    if (ldr->raw_log) {
+        char name[32];
+        snprintf(name, sizeof(name), "LDR %d raw log", ldr->gpio);
+        rawlog_print_stats(ldr->raw_log, name, stream);
+    }
+}
+
+
+// parse a charge time given in milliseconds, with optional fraction, or
+// in microseconds with a "us" suffix. Examples: 160, 2.5, 2500us
+int ldr_parse_duration_us(const char *str, ldr_duration_t *duration_us)
+{
+    char *end = NULL;
+    double value;
+
+    value = strtod(str, &end);
+    if ((end == str) || (value < 0))
+        return -1;
+    if (strcmp(end, "us") == 0)
+        value = value / 1000.0;
+    else if ((*end != 0) && (strcmp(end, "ms") != 0))
+        return -1;
+    if (value * 1000.0 > UINT32_MAX)
+        return -1;
+    *duration_us = (ldr_duration_t)(value * 1000.0 + 0.5);
+    return 0;
+}
@@ -18,14 +18,36 @@
 #ifndef _LDR_H_
 #define _LDR_H_
 
+#include <stdio.h>
 #include <time.h>
+#include <stdint.h>
 
-#define LDR_DEFAULT_HIGH_THRESHOLD                  160
-#define LDR_DEFAULT_LOW_THRESHOLD                   30
-#define LDR_DEFAULT_COMPLETE_DARKNESS_THRESHOLD     790
+#include "loop.h"
+#include "rawlog.h"
+#include "filter.h"
+
+// charge times and thresholds are in microseconds
+#define LDR_DEFAULT_HIGH_THRESHOLD_US               160000
+#define LDR_DEFAULT_LOW_THRESHOLD_US                30000
+#define LDR_DEFAULT_COMPLETE_DARKNESS_THRESHOLD_US  790000
 #define LDR_DEFAULT_HIGH_DURATION_MS                60000
 #define LDR_DEFAULT_LOW_DURATION_MS                 300000
 #define LDR_DEFAULT_COMPLETE_DARKNESS_DURATION_MS   790
+// the charge timeout follows the threshold that decides the next state,
+// with this margin, up to the maximum
+#define LDR_DEFAULT_MAX_CHARGE_TIMEOUT_MS           1000
+#define LDR_CHARGE_TIMEOUT_MARGIN_PCT               125
+#define LDR_MIN_CHARGE_TIMEOUT_US                   1000
+// drain time is a multiple of the last charge time, within these limits
+#define LDR_DEFAULT_DRAIN_MULTIPLE_PCT              200
+#define LDR_DEFAULT_MIN_DRAIN_US                    10000
+#define LDR_MAX_DRAIN_US                            100000
+#define LDR_DEFAULT_MIN_PERIOD_MS                   350
+#define LDR_DEFAULT_MAX_PERIOD_MS                   5000
+// a reading within this factor of a threshold counts as near it
+#define LDR_SCHEDULE_NEAR_RATIO                     2
+
+#define LDR_MAX_SENSORS                             8
 
 
 typedef enum
@@ -35,45 +57,181 @@ typedef enum
     LDR_DARK
 } ldr_state_t;
 
-typedef void (*LDRTriggerCallback)(void *priv_data, ldr_state_t new_state);
+typedef enum
+{
+    LDR_PHASE_IDLE = 0,
+    LDR_PHASE_DRAIN,
+    LDR_PHASE_CHARGE
+} ldr_phase_t;
+
+// capacitor charge time in microseconds
+typedef uint32_t ldr_duration_t;
+
+struct ldr_sensor_t;
+
+typedef void (*LDRTriggerCallback)(void *priv_data, const struct ldr_sensor_t *ldr,
+                                   ldr_state_t new_state, ldr_duration_t duration_us);
+// called for every charge time, timeout is set if no edge was seen
+typedef void (*LDRSampleCallback)(void *priv_data, const struct ldr_sensor_t *ldr,
+                                  ldr_duration_t duration_us, int timeout);
+
+// GPIO backend used to drain, charge and time the capacitor.
+struct ldr_gpio_ops
+{
+    const char *name;
+    int (*open)(struct ldr_sensor_t *ldr, int gpio, const char *arg);
+    void (*close)(struct ldr_sensor_t *ldr);
+    // drive the pin low to drain the capacitor
+    int (*drain)(struct ldr_sensor_t *ldr);
+    // release the pin and arm rising edge detection, start_time is set to
+    // when charging started
+    int (*charge)(struct ldr_sensor_t *ldr, struct timespec *start_time);
+    // fd and poll events that signal the end of the charge phase
+    int (*event_fd)(struct ldr_sensor_t *ldr, short *events);
+    // consume the event and set edge_time. returns 1 if it was an edge,
+    // 0 if the charge timed out, -1 if error.
+    int (*read_edge)(struct ldr_sensor_t *ldr, struct timespec *edge_time);
+    // backends without event_fd are busy-polled through read_level
+    int (*read_level)(struct ldr_sensor_t *ldr);
+    // optional, disarm edge detection after the charge phase
+    int (*idle)(struct ldr_sensor_t *ldr);
+    // optional, time source if not CLOCK_MONOTONIC
+    void (*clock)(struct ldr_sensor_t *ldr, struct timespec *now);
+};
+
+extern const struct ldr_gpio_ops ldr_sysfs_ops;
+extern const struct ldr_gpio_ops ldr_chardev_ops;
+extern const struct ldr_gpio_ops ldr_sim_ops;
+extern const struct ldr_gpio_ops ldr_gpiomem_ops;
+
+struct ldr_stats_t
+{
+    uint64_t cycles;
+    uint64_t samples;
+    uint64_t timeouts;          // saturated at the maximum charge timeout
+    uint64_t range_timeouts;    // ended by a shorter auto-ranged timeout, already decided
+    uint64_t errors;            // charge phases lost to backend errors
+    uint64_t transitions;
+    uint64_t drain_us_total;
+    uint32_t drain_us_last;
+    uint32_t drain_us_min;
+    uint32_t drain_us_max;
+};
 
 struct ldr_sensor_t
 {
+    const struct ldr_gpio_ops *ops;
+    void *backend_data;
+
     int gpio;
 
     int fd_gpio_direction;
     int fd_gpio_edge;
     int fd_gpio_value;
+    int fd_gpio_line;
 
+    struct timespec charge_start_time;
     struct timespec cross_threshold_start_time;
 
     ldr_state_t state;
-    unsigned int high_threshold;
-    unsigned int low_threshold;
-    unsigned int complete_darkness_threshold;
+    unsigned char debouncing;
+    ldr_duration_t last_duration_us;
+    unsigned char last_timeout;         // the last reading timed out, a lower bound
+    ldr_duration_t high_threshold_us;
+    ldr_duration_t low_threshold_us;
+    ldr_duration_t complete_darkness_threshold_us;
     unsigned int high_threshold_duration_ms;
     unsigned int low_threshold_duration_ms;
     unsigned int complete_darkness_duration_ms;
+    uint32_t charge_timeout_us;         // of the next charge phase
+    uint32_t max_charge_timeout_us;
+    unsigned char full_range;           // time every reading up to the maximum
 
-    int fd_raw_value_log_file;
+    // adaptive sampling period
+    uint64_t min_period_us;
+    uint64_t max_period_us;
+    uint64_t period_us;
+
+    // adaptive drain time
+    unsigned int drain_multiple_pct;
+    uint32_t min_drain_us;
+    uint32_t drain_us;
+
+    // charge times pass through it before the state machine
+    struct filter_chain_t filter;
+
+    struct ldr_stats_t stats;
+
+    struct rawlog_t *raw_log;
 
     LDRTriggerCallback trigger_cb;
     void *priv_data;
+    LDRSampleCallback sample_cb;
+    void *sample_priv_data;
 };
 
 
-int ldr_init(struct ldr_sensor_t *ldr, int ldr_gpio);
+struct ldr_cycle_t;
+
+struct ldr_cycle_slot_t
+{
+    struct ldr_cycle_t *cycle;
+    struct ldr_sensor_t *ldr;
+    struct loop_source_t src;
+    unsigned char pending;
+};
+
+// Non-blocking measurement cycle for a group of sensors, driven by the
+// event loop: drain, charge and timeout are timerfd / edge fd events.
+struct ldr_cycle_t
+{
+    struct loop_t *loop;
+    struct loop_source_t timer;
+    struct ldr_cycle_slot_t slots[LDR_MAX_SENSORS];
+    int count;
+    int num_pending;
+    ldr_phase_t phase;
+    struct timespec cycle_start;
+    struct timespec charge_begin;
+};
+
+
+void ldr_reset(struct ldr_sensor_t *ldr);
+int ldr_init(struct ldr_sensor_t *ldr, int ldr_gpio,
+             const struct ldr_gpio_ops *ops, const char *backend_arg);
+void ldr_clock(struct ldr_sensor_t *ldr, struct timespec *now);
 void ldr_configure(struct ldr_sensor_t *ldr,
-                   unsigned int high_threshold,
-                   unsigned int low_threshold,
-                   unsigned int complete_darkness_threshold,
+                   ldr_duration_t high_threshold_us,
+                   ldr_duration_t low_threshold_us,
+                   ldr_duration_t complete_darkness_threshold_us,
                    unsigned int high_threshold_duration_ms,
                    unsigned int low_threshold_duration_ms,
                    unsigned int complete_darkness_duration_ms);
+void ldr_configure_timeout(struct ldr_sensor_t *ldr, unsigned int max_charge_timeout_ms);
+void ldr_configure_period(struct ldr_sensor_t *ldr,
+                          unsigned int min_period_ms,
+                          unsigned int max_period_ms);
+void ldr_configure_filter(struct ldr_sensor_t *ldr, const struct filter_chain_t *filter);
+void ldr_configure_drain(struct ldr_sensor_t *ldr,
+                         unsigned int drain_multiple_pct,
+                         uint32_t min_drain_us);
 void ldr_register_callback(struct ldr_sensor_t *ldr,
                            LDRTriggerCallback cb, void *priv_data);
+void ldr_register_sample_callback(struct ldr_sensor_t *ldr,
+                                  LDRSampleCallback cb, void *priv_data);
+// feeds one charge time through the state machine, also used for replay
+void ldr_update_state(struct ldr_sensor_t *ldr, ldr_duration_t ldr_duration_us,
+                      const struct timespec *now);
 int ldr_read_once(struct ldr_sensor_t *ldr);
+int ldr_read_all(struct ldr_sensor_t **ldrs, int count);
+void ldr_print_stats(const struct ldr_sensor_t *ldr, FILE *stream);
 void ldr_cleanup(struct ldr_sensor_t *ldr);
+int ldr_parse_duration_us(const char *str, ldr_duration_t *duration_us);
+
+int ldr_cycle_init(struct ldr_cycle_t *cycle, struct loop_t *loop,
+                   struct ldr_sensor_t **ldrs, int count);
+void ldr_cycle_begin(struct ldr_cycle_t *cycle);
+void ldr_cycle_cleanup(struct ldr_cycle_t *cycle);
 
 
 #endif // _LDR_H_
@@ -0,0 +1,177 @@
+/*
+ *    Filename: ldrctl.c
+ * Description: Client for the ldr-reader control socket.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "utils.h"
+#include "ctl.h"
+#include "ldr-shm.h"
+
+
+// same JSON as the status command, from a lock-free snapshot
+static int print_shm(const char *name)
+{
+    struct ldr_shm_t *shm = ldr_shm_open(name);
+    struct ldr_shm_snapshot_t snap;
+    int i;
+
+    if (shm == NULL) {
+        LOG_ERROR("Error: no ldr-reader shared memory %s\n", name);
+        return -1;
+    }
+    for (i = 0; ldr_shm_read(shm, i, &snap) == 0; i++) {
+        fprintf(stdout, "{\"gpio\":%d,\"state\":%d,\"last_us\":%u,\"timeout\":%s,"
+                "\"samples\":%llu,\"transitions\":%llu,\"sample_time\":%lld.%06lld,"
+                "\"transition_time\":%lld.%06lld,\"seq\":%u}\n",
+                snap.gpio, snap.state, snap.duration_us, snap.timeout ? "true" : "false",
+                (unsigned long long)snap.samples, (unsigned long long)snap.transitions,
+                (long long)(snap.sample_time_ns / 1000000000), (long long)(snap.sample_time_ns % 1000000000 / 1000),
+                (long long)(snap.transition_time_ns / 1000000000),
+                (long long)(snap.transition_time_ns % 1000000000 / 1000), snap.seq);
+    }
+    ldr_shm_close(shm);
+    return 0;
+}
+
+
+static void syntax(const char *progname)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [options] command [arguments]\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Talks to ldr-reader started with -u. Replies are printed as JSON lines.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "commands:\n");
+    fprintf(stderr, " status                          State, last reading, thresholds and uptime\n");
+    fprintf(stderr, " set <gpio|all> key=value ...    Change settings at runtime. Keys: high, low and\n");
+    fprintf(stderr, "                                 dark thresholds in ms (or with 'us' or 'lux'),\n");
+    fprintf(stderr, "                                 high_s and low_s debounce durations in seconds\n");
+    fprintf(stderr, " calibrate <lux> [samples]       Pair the next charge times with a lux meter reading\n");
+    fprintf(stderr, "                                 and add the point to the ldr-reader -Y file\n");
+    fprintf(stderr, " subscribe [samples]             Print transitions, and samples, until interrupted\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, " -u [path]       Control socket. Default %s\n", CTL_DEFAULT_PATH);
+    fprintf(stderr, " -M [name]       Instead of a command, print the readings ldr-reader -M publishes\n");
+    fprintf(stderr, "                 in shared memory. Example: %s\n", LDR_SHM_DEFAULT_NAME);
+    fprintf(stderr, " -h              Display this help page\n");
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *progname = argv[0];
+    const char *path = CTL_DEFAULT_PATH;
+    const char *shm_name = NULL;
+    struct sockaddr_un addr;
+    char request[CTL_LINE_MAX];
+    char buf[CTL_BUFFER_SIZE];
+    size_t len = 0;
+    int subscribe;
+    int error = 0;
+    int opt;
+    int fd;
+    int i;
+
+    while ((opt = getopt(argc, argv, "u:M:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'u': path = optarg; break;
+            case 'M': shm_name = optarg; break;
+            case 'h': // fall through
+            default:
+                syntax(progname);
+                break;
+        }
+    }
+    if (shm_name)
+        exit(print_shm(shm_name) ? EXIT_FAILURE : EXIT_SUCCESS);
+    if (optind >= argc)
+        syntax(progname);
+
+    // the command is the remaining arguments, joined with spaces
+    request[0] = 0;
+    for (i = optind; i < argc; i++) {
+        len += snprintf(request + len, sizeof(request) - len, "%s%s", (i > optind) ? " " : "", argv[i]);
+        if (len >= sizeof(request) - 1) {
+            LOG_ERROR("Error: command too long\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    request[len++] = '\n';
+    subscribe = (strcmp(argv[optind], "subscribe") == 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LOG_ERROR("Error: socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((fd < 0) || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        LOG_ERROR("Error: failed to connect to %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (write(fd, request, len) != (ssize_t)len) {
+        LOG_ERROR("Error: failed to send command: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // one reply line, or a stream of them when subscribed
+    len = 0;
+    for (;;) {
+        ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        char *line, *end;
+        if (n <= 0)
+            break;
+        len += n;
+        buf[len] = 0;
+        line = buf;
+        while ((end = strchr(line, '\n')) != NULL) {
+            *end = 0;
+            fprintf(stdout, "%s\n", line);
+            if (strncmp(line, "{\"error\"", 8) == 0)
+                error = 1;
+            line = end + 1;
+            if (!subscribe || error)
+                goto done;
+        }
+        fflush(stdout);
+        len -= line - buf;
+        memmove(buf, line, len);
+        if (len == sizeof(buf) - 1)
+            len = 0;
+    }
+    if (!subscribe) {
+        LOG_ERROR("Error: no reply from %s\n", path);
+        error = 1;
+    }
+
+done:
+    close(fd);
+    exit(error ? EXIT_FAILURE : EXIT_SUCCESS);
+}
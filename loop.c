@@ -0,0 +1,225 @@
+/*
+ *    Filename: loop.c
+ * Description: epoll based event loop.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "utils.h"
+#include "loop.h"
+
+
+int loop_init(struct loop_t *loop)
+{
+    memset(loop, 0, sizeof(struct loop_t));
+    loop->fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->fd_epoll < 0) {
+        LOG_ERROR("Error: epoll_create failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+void loop_cleanup(struct loop_t *loop)
+{
+    if (loop->fd_epoll >= 0) {
+        close(loop->fd_epoll);
+        loop->fd_epoll = -1;
+    }
+}
+
+
+int loop_add(struct loop_t *loop, struct loop_source_t *src, int fd,
+             uint32_t events, LoopCallback cb, void *priv_data)
+{
+    struct epoll_event ev;
+
+    src->fd = fd;
+    src->cb = cb;
+    src->priv_data = priv_data;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(loop->fd_epoll, EPOLL_CTL_ADD, fd, &ev)) {
+        LOG_ERROR("Error: epoll add failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+int loop_modify(struct loop_t *loop, struct loop_source_t *src, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(loop->fd_epoll, EPOLL_CTL_MOD, src->fd, &ev)) {
+        LOG_ERROR("Error: epoll modify failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+int loop_remove(struct loop_t *loop, struct loop_source_t *src)
+{
+    if (src->fd < 0)
+        return 0;
+    if (epoll_ctl(loop->fd_epoll, EPOLL_CTL_DEL, src->fd, NULL)) {
+        LOG_ERROR("Error: epoll remove failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+// dispatches events until loop_stop() is called.
+int loop_run(struct loop_t *loop)
+{
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    int num_events;
+    int i;
+
+    while (!loop->terminate) {
+        num_events = epoll_wait(loop->fd_epoll, events, LOOP_MAX_EVENTS, -1);
+        if (num_events < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("Error: epoll_wait failed: %s\n", strerror(errno));
+            return -1;
+        }
+        for (i = 0; i < num_events; i++) {
+            struct loop_source_t *src = (struct loop_source_t *)events[i].data.ptr;
+            src->cb(src->priv_data, events[i].events);
+            if (loop->terminate)
+                break;
+        }
+    }
+    return 0;
+}
+
+
+void loop_stop(struct loop_t *loop)
+{
+    loop->terminate = 1;
+}
+
+
+int loop_timer_init(struct loop_t *loop, struct loop_source_t *src,
+                    LoopCallback cb, void *priv_data)
+{
+    int fd;
+
+    src->fd = -1;
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR("Error: timerfd_create failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (loop_add(loop, src, fd, EPOLLIN, cb, priv_data)) {
+        close(fd);
+        src->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+
+// one shot timer, a delay of 0 fires as soon as possible.
+int loop_timer_arm_us(struct loop_source_t *src, uint64_t delay_us)
+{
+    struct itimerspec its;
+
+    if (delay_us == 0)
+        delay_us = 1;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = delay_us / 1000000;
+    its.it_value.tv_nsec = (delay_us % 1000000) * 1000;
+    return timerfd_settime(src->fd, 0, &its, NULL);
+}
+
+
+int loop_timer_disarm(struct loop_source_t *src)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    return timerfd_settime(src->fd, 0, &its, NULL);
+}
+
+
+// consumes the expiration count so the timer stops reporting readable.
+int loop_timer_ack(struct loop_source_t *src)
+{
+    uint64_t expirations;
+
+    if (read(src->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return -1;
+    return 0;
+}
+
+
+// blocks the signals in mask and delivers them through a signalfd.
+int loop_signal_init(struct loop_t *loop, struct loop_source_t *src,
+                     const sigset_t *mask, LoopCallback cb, void *priv_data)
+{
+    int fd;
+
+    src->fd = -1;
+    if (sigprocmask(SIG_BLOCK, mask, NULL)) {
+        LOG_ERROR("Error: sigprocmask failed: %s\n", strerror(errno));
+        return -1;
+    }
+    fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR("Error: signalfd failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (loop_add(loop, src, fd, EPOLLIN, cb, priv_data)) {
+        close(fd);
+        src->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+
+// returns the next pending signal number, or 0 if none.
+int loop_signal_read(struct loop_source_t *src)
+{
+    struct signalfd_siginfo info;
+
+    if (read(src->fd, &info, sizeof(info)) != sizeof(info))
+        return 0;
+    return info.ssi_signo;
+}
+
+
+void loop_source_close(struct loop_t *loop, struct loop_source_t *src)
+{
+    if (src->fd >= 0) {
+        loop_remove(loop, src);
+        close(src->fd);
+        src->fd = -1;
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ *    Filename: loop.h
+ * Description: epoll based event loop.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LOOP_H_
+#define _LOOP_H_
+
+#include <stdint.h>
+#include <signal.h>
+#include <sys/epoll.h>
+
+#define LOOP_MAX_EVENTS     16
+
+
+typedef void (*LoopCallback)(void *priv_data, uint32_t events);
+
+// An fd watched by the loop. Owned by the caller, must stay valid while
+// it is registered.
+struct loop_source_t
+{
+    int fd;
+    LoopCallback cb;
+    void *priv_data;
+};
+
+struct loop_t
+{
+    int fd_epoll;
+    unsigned char terminate;
+};
+
+
+int loop_init(struct loop_t *loop);
+void loop_cleanup(struct loop_t *loop);
+int loop_add(struct loop_t *loop, struct loop_source_t *src, int fd,
+             uint32_t events, LoopCallback cb, void *priv_data);
+int loop_modify(struct loop_t *loop, struct loop_source_t *src, uint32_t events);
+int loop_remove(struct loop_t *loop, struct loop_source_t *src);
+int loop_run(struct loop_t *loop);
+void loop_stop(struct loop_t *loop);
+
+int loop_timer_init(struct loop_t *loop, struct loop_source_t *src,
+                    LoopCallback cb, void *priv_data);
+int loop_timer_arm_us(struct loop_source_t *src, uint64_t delay_us);
+int loop_timer_disarm(struct loop_source_t *src);
+int loop_timer_ack(struct loop_source_t *src);
+int loop_signal_init(struct loop_t *loop, struct loop_source_t *src,
+                     const sigset_t *mask, LoopCallback cb, void *priv_data);
+int loop_signal_read(struct loop_source_t *src);
+void loop_source_close(struct loop_t *loop, struct loop_source_t *src);
+
+
+#endif // _LOOP_H_
@@ -0,0 +1,515 @@
+/*
+ *    Filename: metrics.c
+ * Description: Prometheus text format metrics over HTTP.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "utils.h"
+#include "sysfsgpio.h"
+#include "rawlog.h"
+#include "metrics.h"
+
+// room left in front of the body for the HTTP header
+#define METRICS_HEADER_SPACE    160
+
+static const double charge_bounds[] =
+{
+    0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.4, 0.8
+};
+static const double interval_bounds[] =
+{
+    0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30
+};
+#define NUM_BOUNDS(b)   ((int)(sizeof(b) / sizeof((b)[0])))
+
+
+static void metrics_observe(struct metrics_hist_t *hist, const double *bounds,
+                            int num_bounds, double value)
+{
+    int i;
+
+    for (i = 0; (i < num_bounds) && (value > bounds[i]); i++)
+        ;
+    hist->buckets[i]++;
+    hist->count++;
+    hist->sum += value;
+}
+
+
+void metrics_sample(struct metrics_t *metrics, int index, ldr_duration_t duration_us, int timeout)
+{
+    struct metrics_sensor_t *sensor;
+    struct timespec now;
+
+    if ((index < 0) || (index >= metrics->num_ldr))
+        return;
+    sensor = &(metrics->sensors[index]);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // timeouts are counted by ldr_charge_timeouts_total, not as charge times
+    if (!timeout)
+        metrics_observe(&(sensor->charge), charge_bounds, NUM_BOUNDS(charge_bounds),
+                        duration_us / 1e6);
+    if (sensor->last_sample.tv_sec)
+        metrics_observe(&(sensor->interval), interval_bounds, NUM_BOUNDS(interval_bounds),
+                        timespec_diff_us(&now, &(sensor->last_sample)) / 1e6);
+    sensor->last_sample = now;
+}
+
+
+void metrics_transition(struct metrics_t *metrics, int index, ldr_state_t new_state)
+{
+    if ((index < 0) || (index >= metrics->num_ldr))
+        return;
+    if (new_state == LDR_DARK)
+        metrics->sensors[index].to_dark++;
+    else
+        metrics->sensors[index].to_bright++;
+}
+
+
+struct metrics_buf_t
+{
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+static void metrics_printf(struct metrics_buf_t *buf, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void metrics_printf(struct metrics_buf_t *buf, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    if (buf->len >= buf->size)
+        return;
+    va_start(ap, fmt);
+    len = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, ap);
+    va_end(ap);
+    if (len > 0)
+        buf->len += len;
+}
+
+static void metrics_family(struct metrics_buf_t *buf, const char *name,
+                           const char *type, const char *help)
+{
+    metrics_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_render_hist(struct metrics_buf_t *buf, const char *name, int gpio,
+                                const struct metrics_hist_t *hist,
+                                const double *bounds, int num_bounds)
+{
+    uint64_t count = 0;
+    int i;
+
+    for (i = 0; i < num_bounds; i++) {
+        count += hist->buckets[i];
+        metrics_printf(buf, "%s_bucket{gpio=\"%d\",le=\"%g\"} %llu\n", name, gpio, bounds[i],
+                       (unsigned long long)count);
+    }
+    metrics_printf(buf, "%s_bucket{gpio=\"%d\",le=\"+Inf\"} %llu\n", name, gpio,
+                   (unsigned long long)hist->count);
+    metrics_printf(buf, "%s_sum{gpio=\"%d\"} %.6f\n", name, gpio, hist->sum);
+    metrics_printf(buf, "%s_count{gpio=\"%d\"} %llu\n", name, gpio, (unsigned long long)hist->count);
+}
+
+// one line per sensor, for counters and gauges taken from the sensor
+#define METRICS_PER_LDR(buf, name, type, help, fmt, expr)                   \
+    do {                                                                    \
+        metrics_family(buf, name, type, help);                              \
+        for (i = 0; i < metrics->num_ldr; i++) {                            \
+            const struct ldr_sensor_t *ldr = &(metrics->ldrs[i]);           \
+            metrics_printf(buf, name "{gpio=\"%d\"} " fmt "\n", ldr->gpio, expr); \
+        }                                                                   \
+    } while (0)
+
+static void metrics_render(struct metrics_t *metrics, struct metrics_buf_t *buf)
+{
+    const struct exec_t *exec = metrics->exec;
+    struct timespec now;
+    int has_raw_log = 0;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    metrics_family(buf, "ldr_uptime_seconds", "gauge", "Time since ldr-reader started.");
+    metrics_printf(buf, "ldr_uptime_seconds %.3f\n", timespec_diff_ms(&now, &(metrics->start_time)) / 1e3);
+
+    METRICS_PER_LDR(buf, "ldr_samples_total", "counter", "Charge times measured.",
+                    "%llu", (unsigned long long)ldr->stats.samples);
+    METRICS_PER_LDR(buf, "ldr_charge_timeouts_total", "counter",
+                    "Charge phases that saturated, ended by the maximum timeout.",
+                    "%llu", (unsigned long long)ldr->stats.timeouts);
+    METRICS_PER_LDR(buf, "ldr_charge_range_timeouts_total", "counter",
+                    "Charge phases ended by a shorter auto-ranged timeout, past the deciding threshold.",
+                    "%llu", (unsigned long long)ldr->stats.range_timeouts);
+    METRICS_PER_LDR(buf, "ldr_charge_errors_total", "counter",
+                    "Charge phases lost to GPIO errors.",
+                    "%llu", (unsigned long long)ldr->stats.errors);
+    METRICS_PER_LDR(buf, "ldr_charge_timeout_seconds", "gauge", "Current auto-ranged charge timeout.",
+                    "%.3f", ldr->charge_timeout_us / 1e6);
+    METRICS_PER_LDR(buf, "ldr_state", "gauge", "Current state, 0 unknown, 1 bright, 2 dark.",
+                    "%d", (int)ldr->state);
+    METRICS_PER_LDR(buf, "ldr_last_charge_seconds", "gauge", "Last charge time.",
+                    "%.6f", ldr->last_duration_us / 1e6);
+    METRICS_PER_LDR(buf, "ldr_period_seconds", "gauge", "Current adaptive sampling period.",
+                    "%.3f", ldr->period_us / 1e6);
+
+    metrics_family(buf, "ldr_transitions_total", "counter", "State changes by direction.");
+    for (i = 0; i < metrics->num_ldr; i++) {
+        metrics_printf(buf, "ldr_transitions_total{gpio=\"%d\",to=\"dark\"} %llu\n",
+                       metrics->ldrs[i].gpio, (unsigned long long)metrics->sensors[i].to_dark);
+        metrics_printf(buf, "ldr_transitions_total{gpio=\"%d\",to=\"bright\"} %llu\n",
+                       metrics->ldrs[i].gpio, (unsigned long long)metrics->sensors[i].to_bright);
+    }
+
+    metrics_family(buf, "ldr_charge_seconds", "histogram", "Capacitor charge time.");
+    for (i = 0; i < metrics->num_ldr; i++)
+        metrics_render_hist(buf, "ldr_charge_seconds", metrics->ldrs[i].gpio,
+                            &(metrics->sensors[i].charge), charge_bounds, NUM_BOUNDS(charge_bounds));
+    metrics_family(buf, "ldr_sample_interval_seconds", "histogram", "Time between samples.");
+    for (i = 0; i < metrics->num_ldr; i++)
+        metrics_render_hist(buf, "ldr_sample_interval_seconds", metrics->ldrs[i].gpio,
+                            &(metrics->sensors[i].interval), interval_bounds, NUM_BOUNDS(interval_bounds));
+
+    metrics_family(buf, "ldr_gpio_write_errors_total", "counter", "Failed sysfs GPIO writes.");
+    metrics_printf(buf, "ldr_gpio_write_errors_total %llu\n", (unsigned long long)gpio_write_error_count());
+
+    if (exec) {
+        metrics_family(buf, "ldr_action_spawns_total", "counter", "Action commands started.");
+        metrics_printf(buf, "ldr_action_spawns_total %llu\n", (unsigned long long)exec->spawned);
+        metrics_family(buf, "ldr_action_spawn_failures_total", "counter", "Action commands that failed to start.");
+        metrics_printf(buf, "ldr_action_spawn_failures_total %llu\n", (unsigned long long)exec->spawn_failures);
+        metrics_family(buf, "ldr_action_spawn_seconds", "summary", "Time taken by posix_spawn().");
+        metrics_printf(buf, "ldr_action_spawn_seconds_sum %.6f\n", exec->spawn_us_total / 1e6);
+        metrics_printf(buf, "ldr_action_spawn_seconds_count %llu\n", (unsigned long long)exec->spawned);
+        metrics_family(buf, "ldr_action_failures_total", "counter", "Action commands that exited with an error or were killed.");
+        metrics_printf(buf, "ldr_action_failures_total %llu\n", (unsigned long long)exec->failed);
+        metrics_family(buf, "ldr_action_timeouts_total", "counter", "Action commands that timed out.");
+        metrics_printf(buf, "ldr_action_timeouts_total %llu\n", (unsigned long long)exec->timeouts);
+        metrics_family(buf, "ldr_action_dropped_total", "counter", "Action commands skipped or coalesced.");
+        metrics_printf(buf, "ldr_action_dropped_total %llu\n", (unsigned long long)exec->dropped);
+        metrics_family(buf, "ldr_actions_running", "gauge", "Action commands running now.");
+        metrics_printf(buf, "ldr_actions_running %d\n", exec->num_running);
+    }
+
+    for (i = 0; i < metrics->num_ldr; i++) {
+        if (metrics->ldrs[i].raw_log)
+            has_raw_log = 1;
+    }
+    if (has_raw_log) {
+        const char *names[4] = {
+            "ldr_rawlog_records_written_total", "ldr_rawlog_records_dropped_total",
+            "ldr_rawlog_bytes_written_total", "ldr_rawlog_write_errors_total"
+        };
+        const char *help[4] = {
+            "Raw log records written.", "Raw log records dropped because the writer fell behind.",
+            "Raw log bytes written.", "Raw log write errors."
+        };
+        int n;
+        for (n = 0; n < 4; n++) {
+            metrics_family(buf, names[n], "counter", help[n]);
+            for (i = 0; i < metrics->num_ldr; i++) {
+                const struct rawlog_t *log = metrics->ldrs[i].raw_log;
+                uint64_t value;
+                if (log == NULL)
+                    continue;
+                switch (n)
+                {
+                    case 0:  value = __atomic_load_n(&(log->records_written), __ATOMIC_RELAXED); break;
+                    case 1:  value = __atomic_load_n(&(log->records_dropped), __ATOMIC_RELAXED); break;
+                    case 2:  value = __atomic_load_n(&(log->bytes_written), __ATOMIC_RELAXED); break;
+                    default: value = __atomic_load_n(&(log->write_errors), __ATOMIC_RELAXED); break;
+                }
+                metrics_printf(buf, "%s{gpio=\"%d\"} %llu\n", names[n], metrics->ldrs[i].gpio,
+                               (unsigned long long)value);
+            }
+        }
+    }
+    metrics_family(buf, "ldr_metrics_scrapes_total", "counter", "Metrics requests served.");
+    metrics_printf(buf, "ldr_metrics_scrapes_total %llu\n", (unsigned long long)metrics->scrapes);
+}
+
+
+static void metrics_client_close(struct metrics_t *metrics, struct metrics_client_t *client)
+{
+    loop_source_close(metrics->loop, &(client->src));
+    client->request_len = 0;
+    client->response_len = 0;
+    client->response_sent = 0;
+}
+
+
+// builds the whole response in the client's buffer, body first so the
+// header can carry its length
+static void metrics_respond(struct metrics_t *metrics, struct metrics_client_t *client)
+{
+    struct metrics_buf_t body;
+    char header[METRICS_HEADER_SPACE];
+    int header_len;
+
+    if (strncmp(client->request, "GET ", 4) != 0) {
+        header_len = snprintf(client->response, sizeof(client->response),
+                              "HTTP/1.0 405 Method Not Allowed\r\nConnection: close\r\n\r\n");
+        client->response_sent = 0;
+        client->response_len = header_len;
+        return;
+    }
+
+    metrics->scrapes++;
+    body.data = client->response + METRICS_HEADER_SPACE;
+    body.size = sizeof(client->response) - METRICS_HEADER_SPACE;
+    body.len = 0;
+    metrics_render(metrics, &body);
+    if (body.len >= body.size) {
+        LOG_ERROR("Error: metrics truncated, more than %zu bytes\n", body.size);
+        body.len = body.size - 1;
+    }
+    header_len = snprintf(header, sizeof(header),
+                          "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.len);
+    client->response_sent = METRICS_HEADER_SPACE - header_len;
+    memcpy(client->response + client->response_sent, header, header_len);
+    client->response_len = METRICS_HEADER_SPACE + body.len;
+}
+
+
+static void metrics_client_cb(void *priv_data, uint32_t events)
+{
+    struct metrics_client_t *client = (struct metrics_client_t *)priv_data;
+    struct metrics_t *metrics = client->metrics;
+    ssize_t len;
+
+    if (client->src.fd < 0)
+        return;
+
+    if (client->response_len == 0) {
+        len = read(client->src.fd, client->request + client->request_len,
+                   sizeof(client->request) - 1 - client->request_len);
+        if (len <= 0) {
+            if ((len < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+                return;
+            metrics_client_close(metrics, client);
+            return;
+        }
+        client->request_len += len;
+        client->request[client->request_len] = 0;
+        // the headers are not needed, only their end
+        if (!strstr(client->request, "\r\n\r\n") && !strstr(client->request, "\n\n")) {
+            if (client->request_len == sizeof(client->request) - 1)
+                metrics_client_close(metrics, client);
+            return;
+        }
+        metrics_respond(metrics, client);
+        loop_modify(metrics->loop, &(client->src), EPOLLOUT);
+    }
+
+    while (client->response_sent < client->response_len) {
+        len = send(client->src.fd, client->response + client->response_sent,
+                   client->response_len - client->response_sent, MSG_NOSIGNAL);
+        if (len < 0) {
+            if ((errno == EAGAIN) || (errno == EINTR))
+                return;
+            break;
+        }
+        client->response_sent += len;
+    }
+    metrics_client_close(metrics, client);
+}
+
+
+static void metrics_accept_cb(void *priv_data, uint32_t events)
+{
+    struct metrics_t *metrics = (struct metrics_t *)priv_data;
+    int fd;
+    int i;
+
+    while ((fd = accept(metrics->listen.fd, NULL, NULL)) >= 0) {
+        struct metrics_client_t *client = NULL;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+            if (metrics->clients[i].src.fd < 0) {
+                client = &(metrics->clients[i]);
+                break;
+            }
+        }
+        if ((client == NULL) ||
+            loop_add(metrics->loop, &(client->src), fd, EPOLLIN, metrics_client_cb, client)) {
+            close(fd);
+            continue;
+        }
+        client->request_len = 0;
+        client->response_len = 0;
+        client->response_sent = 0;
+    }
+}
+
+
+static int metrics_listen_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LOG_ERROR("Error: metrics socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        LOG_ERROR("Error: failed to create metrics socket: %s\n", strerror(errno));
+        return -1;
+    }
+    // a stale socket from a previous run, anything else is left alone
+    if ((stat(path, &st) == 0) && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        LOG_ERROR("Error: failed to bind metrics socket %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static int metrics_listen_tcp(const char *addr)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    char host[256];
+    const char *port;
+    const char *sep;
+    int one = 1;
+    int fd;
+    int ret;
+
+    sep = strrchr(addr, ':');
+    if (sep) {
+        size_t len = sep - addr;
+        if (len >= sizeof(host))
+            len = sizeof(host) - 1;
+        memcpy(host, addr, len);
+        host[len] = 0;
+        port = sep + 1;
+    } else {
+        strcpy(host, "127.0.0.1");
+        port = addr;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    ret = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+    if (ret) {
+        LOG_ERROR("Error: invalid metrics address %s: %s\n", addr, gai_strerror(ret));
+        return -1;
+    }
+
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0) {
+        LOG_ERROR("Error: failed to create metrics socket: %s\n", strerror(errno));
+        freeaddrinfo(res);
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, res->ai_addr, res->ai_addrlen)) {
+        LOG_ERROR("Error: failed to bind metrics socket %s: %s\n", addr, strerror(errno));
+        freeaddrinfo(res);
+        close(fd);
+        return -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+
+int metrics_init(struct metrics_t *metrics, struct loop_t *loop, const char *addr,
+                 const struct ldr_sensor_t *ldrs, int num_ldr, const struct exec_t *exec)
+{
+    int fd;
+    int i;
+
+    memset(metrics, 0, sizeof(struct metrics_t));
+    metrics->loop = loop;
+    metrics->listen.fd = -1;
+    metrics->ldrs = ldrs;
+    metrics->num_ldr = num_ldr;
+    metrics->exec = exec;
+    clock_gettime(CLOCK_MONOTONIC, &(metrics->start_time));
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        metrics->clients[i].metrics = metrics;
+        metrics->clients[i].src.fd = -1;
+    }
+
+    if (addr[0] == '/')
+        fd = metrics_listen_unix(addr);
+    else
+        fd = metrics_listen_tcp(addr);
+    if (fd < 0)
+        return -1;
+    if (addr[0] == '/')
+        metrics->unix_path = addr;
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (listen(fd, METRICS_MAX_CLIENTS)) {
+        LOG_ERROR("Error: failed to listen on metrics socket %s: %s\n", addr, strerror(errno));
+        close(fd);
+        metrics_cleanup(metrics);
+        return -1;
+    }
+    if (loop_add(loop, &(metrics->listen), fd, EPOLLIN, metrics_accept_cb, metrics)) {
+        close(fd);
+        metrics_cleanup(metrics);
+        return -1;
+    }
+    LOG_INFO("Serving metrics on %s\n", addr);
+    return 0;
+}
+
+
+void metrics_cleanup(struct metrics_t *metrics)
+{
+    int i;
+
+    if (metrics->loop == NULL)
+        return;
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+        loop_source_close(metrics->loop, &(metrics->clients[i].src));
+    loop_source_close(metrics->loop, &(metrics->listen));
+    if (metrics->unix_path) {
+        unlink(metrics->unix_path);
+        metrics->unix_path = NULL;
+    }
+    metrics->loop = NULL;
+}
@@ -0,0 +1,89 @@
+/*
+ *    Filename: metrics.h
+ * Description: Prometheus text format metrics over HTTP.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <time.h>
+#include "loop.h"
+#include "ldr.h"
+#include "exec.h"
+
+#define METRICS_MAX_CLIENTS     4
+#define METRICS_REQUEST_SIZE    1024
+#define METRICS_BUFFER_SIZE     65536
+#define METRICS_MAX_BUCKETS     16
+
+
+// counts per bucket, not cumulative, the last one is +Inf
+struct metrics_hist_t
+{
+    uint64_t buckets[METRICS_MAX_BUCKETS];
+    uint64_t count;
+    double sum;
+};
+
+struct metrics_sensor_t
+{
+    struct metrics_hist_t charge;       // charge time, seconds
+    struct metrics_hist_t interval;     // time between samples, seconds
+    struct timespec last_sample;
+    uint64_t to_dark;
+    uint64_t to_bright;
+};
+
+struct metrics_t;
+
+struct metrics_client_t
+{
+    struct metrics_t *metrics;
+    struct loop_source_t src;
+    char request[METRICS_REQUEST_SIZE];
+    size_t request_len;
+    char response[METRICS_BUFFER_SIZE];
+    size_t response_len;
+    size_t response_sent;
+};
+
+// One HTTP/1.0 endpoint, any GET gets the metrics. All buffers are
+// preallocated here, a scrape renders into the client's buffer and
+// is written out from the loop without blocking.
+struct metrics_t
+{
+    struct loop_t *loop;
+    struct loop_source_t listen;
+    const char *unix_path;
+    const struct ldr_sensor_t *ldrs;
+    int num_ldr;
+    const struct exec_t *exec;
+    struct timespec start_time;
+    struct metrics_sensor_t sensors[LDR_MAX_SENSORS];
+    struct metrics_client_t clients[METRICS_MAX_CLIENTS];
+    uint64_t scrapes;
+};
+
+
+// addr is [host:]port for TCP, localhost if no host, or a path for a
+// Unix socket.
+int metrics_init(struct metrics_t *metrics, struct loop_t *loop, const char *addr,
+                 const struct ldr_sensor_t *ldrs, int num_ldr, const struct exec_t *exec);
+void metrics_sample(struct metrics_t *metrics, int index, ldr_duration_t duration_us, int timeout);
+void metrics_transition(struct metrics_t *metrics, int index, ldr_state_t new_state);
+void metrics_cleanup(struct metrics_t *metrics);
+
+
+#endif // _METRICS_H_
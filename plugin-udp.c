@@ -0,0 +1,115 @@
+/*
+ *    Filename: plugin-udp.c
+ * Description: Example plugin, sends each transition as a UDP datagram.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+// Usage: ldr-reader -P ./plugin-udp.so:host:port
+// Each transition is sent as one line of text: "<gpio> <state> <duration_us>"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "ldr-plugin.h"
+
+
+struct udp_plugin_t
+{
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+};
+
+
+static int udp_init(void **priv, const char *args)
+{
+    struct udp_plugin_t *udp;
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    char host[256];
+    const char *port;
+
+    port = strrchr(args, ':');
+    if ((port == NULL) || (port - args >= (int)sizeof(host))) {
+        fprintf(stderr, "Error: plugin-udp needs host:port\n");
+        return -1;
+    }
+    memcpy(host, args, port - args);
+    host[port - args] = 0;
+    port++;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, port, &hints, &res) || (res == NULL)) {
+        fprintf(stderr, "Error: plugin-udp can't resolve %s\n", args);
+        return -1;
+    }
+    udp = calloc(1, sizeof(struct udp_plugin_t));
+    if (udp == NULL) {
+        freeaddrinfo(res);
+        return -1;
+    }
+    udp->fd = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    memcpy(&(udp->addr), res->ai_addr, res->ai_addrlen);
+    udp->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    if (udp->fd < 0) {
+        free(udp);
+        return -1;
+    }
+    *priv = udp;
+    return 0;
+}
+
+
+static void udp_on_transition(void *priv, int gpio, int state, uint32_t duration_us,
+                              const struct timespec *time)
+{
+    struct udp_plugin_t *udp = (struct udp_plugin_t *)priv;
+    char msg[64];
+    int len;
+
+    len = snprintf(msg, sizeof(msg), "%d %d %u\n", gpio, state, duration_us);
+    // non-blocking, a datagram that doesn't fit is lost like any other
+    sendto(udp->fd, msg, len, 0, (struct sockaddr *)&(udp->addr), udp->addr_len);
+}
+
+
+static void udp_shutdown(void *priv)
+{
+    struct udp_plugin_t *udp = (struct udp_plugin_t *)priv;
+
+    close(udp->fd);
+    free(udp);
+}
+
+
+static const struct ldr_plugin_t udp_plugin =
+{
+    .abi_version = LDR_PLUGIN_ABI_VERSION,
+    .name = "udp",
+    .init = udp_init,
+    .on_transition = udp_on_transition,
+    .on_sample = NULL,
+    .shutdown = udp_shutdown,
+};
+
+
+const struct ldr_plugin_t *ldr_plugin_entry(void)
+{
+    return &udp_plugin;
+}
@@ -0,0 +1,142 @@
+/*
+ *    Filename: plugin.c
+ * Description: Loads and calls ldr-reader action plugins.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include "utils.h"
+#include "plugin.h"
+
+
+int plugin_load(struct plugin_t *plugin, const char *spec)
+{
+    ldr_plugin_entry_t entry;
+    const char *args = "";
+    char *sep;
+
+    memset(plugin, 0, sizeof(struct plugin_t));
+    plugin->path = strdup(spec);
+    if (plugin->path == NULL)
+        return -1;
+    sep = strchr(plugin->path, ':');
+    if (sep) {
+        *sep = 0;
+        args = spec + (sep - plugin->path) + 1;
+    }
+
+    plugin->handle = dlopen(plugin->path, RTLD_NOW | RTLD_LOCAL);
+    if (plugin->handle == NULL) {
+        LOG_ERROR("Error: failed to load plugin %s: %s\n", plugin->path, dlerror());
+        goto error;
+    }
+    entry = (ldr_plugin_entry_t)dlsym(plugin->handle, LDR_PLUGIN_ENTRY);
+    if (entry == NULL) {
+        LOG_ERROR("Error: %s is not an ldr-reader plugin, no %s()\n", plugin->path, LDR_PLUGIN_ENTRY);
+        goto error;
+    }
+    plugin->desc = entry();
+    if ((plugin->desc == NULL) || (plugin->desc->abi_version != LDR_PLUGIN_ABI_VERSION)) {
+        LOG_ERROR("Error: plugin %s ABI version %u, expected %u\n", plugin->path,
+                  plugin->desc ? plugin->desc->abi_version : 0, LDR_PLUGIN_ABI_VERSION);
+        goto error;
+    }
+    if (plugin->desc->init && plugin->desc->init(&(plugin->priv), args)) {
+        LOG_ERROR("Error: plugin %s failed to initialize\n", plugin->path);
+        goto error;
+    }
+    LOG_VERBOSE("Loaded plugin %s from %s\n", plugin->desc->name ? plugin->desc->name : "", plugin->path);
+    return 0;
+
+error:
+    plugin->desc = NULL;
+    plugin_unload(plugin);
+    return -1;
+}
+
+
+static void plugin_account(struct plugin_stats_t *stats, const struct timespec *start)
+{
+    struct timespec end;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns = (uint64_t)(end.tv_sec - start->tv_sec) * 1000000000 + end.tv_nsec - start->tv_nsec;
+    stats->calls++;
+    stats->ns_total += ns;
+    if (ns > stats->ns_max)
+        stats->ns_max = ns;
+}
+
+
+void plugin_transition(struct plugin_t *plugin, int gpio, int state,
+                       uint32_t duration_us, const struct timespec *time)
+{
+    struct timespec start;
+
+    if (plugin->desc->on_transition == NULL)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    plugin->desc->on_transition(plugin->priv, gpio, state, duration_us, time);
+    plugin_account(&(plugin->transition_stats), &start);
+}
+
+
+void plugin_sample(struct plugin_t *plugin, int gpio, int state,
+                   uint32_t duration_us, int timeout, const struct timespec *time)
+{
+    struct timespec start;
+
+    if (plugin->desc->on_sample == NULL)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    plugin->desc->on_sample(plugin->priv, gpio, state, duration_us, timeout, time);
+    plugin_account(&(plugin->sample_stats), &start);
+}
+
+
+static void plugin_print_hook_stats(const struct plugin_t *plugin, const char *hook,
+                                    const struct plugin_stats_t *stats, FILE *stream)
+{
+    if (stats->calls == 0)
+        return;
+    fprintf(stream, "Plugin %s: %s calls %llu, avg %llu ns, max %llu ns\n",
+            plugin->path, hook, (unsigned long long)stats->calls,
+            (unsigned long long)(stats->ns_total / stats->calls),
+            (unsigned long long)stats->ns_max);
+}
+
+
+void plugin_print_stats(const struct plugin_t *plugin, FILE *stream)
+{
+    plugin_print_hook_stats(plugin, "on_transition", &(plugin->transition_stats), stream);
+    plugin_print_hook_stats(plugin, "on_sample", &(plugin->sample_stats), stream);
+}
+
+
+void plugin_unload(struct plugin_t *plugin)
+{
+    if (plugin->desc && plugin->desc->shutdown)
+        plugin->desc->shutdown(plugin->priv);
+    plugin->desc = NULL;
+    if (plugin->handle) {
+        dlclose(plugin->handle);
+        plugin->handle = NULL;
+    }
+    free(plugin->path);
+    plugin->path = NULL;
+}
@@ -0,0 +1,56 @@
+/*
+ *    Filename: plugin.h
+ * Description: Loads and calls ldr-reader action plugins.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _PLUGIN_H_
+#define _PLUGIN_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "ldr-plugin.h"
+
+#define PLUGIN_MAX      8
+
+
+struct plugin_stats_t
+{
+    uint64_t calls;
+    uint64_t ns_total;
+    uint64_t ns_max;
+};
+
+struct plugin_t
+{
+    void *handle;
+    const struct ldr_plugin_t *desc;
+    void *priv;
+    char *path;
+    struct plugin_stats_t transition_stats;
+    struct plugin_stats_t sample_stats;
+};
+
+
+// spec is "path[:args]"
+int plugin_load(struct plugin_t *plugin, const char *spec);
+void plugin_transition(struct plugin_t *plugin, int gpio, int state,
+                       uint32_t duration_us, const struct timespec *time);
+void plugin_sample(struct plugin_t *plugin, int gpio, int state,
+                   uint32_t duration_us, int timeout, const struct timespec *time);
+void plugin_print_stats(const struct plugin_t *plugin, FILE *stream);
+void plugin_unload(struct plugin_t *plugin);
+
+
+#endif // _PLUGIN_H_
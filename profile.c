@@ -0,0 +1,127 @@
+/*
+ *    Filename: profile.c
+ * Description: Per-phase latency histograms of the measurement hot path.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "profile.h"
+
+#ifdef LDR_PROFILE
+
+struct profile_hist_t
+{
+    uint32_t buckets[PROFILE_BUCKETS];
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+static const char *phase_names[PROFILE_NUM_PHASES] =
+{
+    "drain_write", "drain", "charge_arm", "read_edge", "update_state",
+    "trigger_cb", "sample_cb", "rawlog", "idle", "cycle"
+};
+
+static struct profile_hist_t hists[PROFILE_NUM_PHASES];
+
+
+void profile_record(profile_phase_t phase, uint64_t ns)
+{
+    struct profile_hist_t *hist = &hists[phase];
+
+    hist->buckets[loglin_bucket(ns, PROFILE_SUB_BITS, PROFILE_MAX_BITS)]++;
+    hist->count++;
+    hist->total_ns += ns;
+    if (ns > hist->max_ns)
+        hist->max_ns = ns;
+}
+
+
+void profile_record_since(profile_phase_t phase, const struct timespec *start)
+{
+    struct timespec now;
+    int64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (int64_t)(now.tv_sec - start->tv_sec) * 1000000000 + (now.tv_nsec - start->tv_nsec);
+    profile_record(phase, (ns > 0) ? (uint64_t)ns : 0);
+}
+
+
+static uint64_t profile_percentile(const struct profile_hist_t *hist, double pct)
+{
+    uint64_t rank = (uint64_t)(hist->count * pct / 100.0);
+    uint64_t seen = 0;
+    int i;
+
+    if (rank >= hist->count)
+        rank = hist->count - 1;
+    for (i = 0; i < PROFILE_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank) {
+            // the highest value in the bucket
+            uint64_t value = loglin_bucket_min(i + 1, PROFILE_SUB_BITS) - 1;
+            return (value < hist->max_ns) ? value : hist->max_ns;
+        }
+    }
+    return hist->max_ns;
+}
+
+
+void profile_dump(FILE *stream)
+{
+    int i;
+
+    fprintf(stream, "Profile (us):   %12s %10s %10s %10s %10s %10s\n",
+            "count", "mean", "p50", "p99", "p999", "max");
+    for (i = 0; i < PROFILE_NUM_PHASES; i++) {
+        const struct profile_hist_t *hist = &hists[i];
+        if (hist->count == 0)
+            continue;
+        fprintf(stream, "  %-13s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", phase_names[i],
+                (unsigned long long)hist->count, hist->total_ns / 1e3 / hist->count,
+                profile_percentile(hist, 50) / 1e3, profile_percentile(hist, 99) / 1e3,
+                profile_percentile(hist, 99.9) / 1e3, hist->max_ns / 1e3);
+    }
+}
+
+
+// written next to the target and renamed, so readers never see half a dump
+int profile_write(const char *path)
+{
+    char tmp_path[4096];
+    FILE *stream;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    stream = fopen(tmp_path, "w");
+    if (stream == NULL) {
+        LOG_ERROR("Error: failed to open %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+    profile_dump(stream);
+    if (fclose(stream) || rename(tmp_path, path)) {
+        LOG_ERROR("Error: failed to write %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+#endif // LDR_PROFILE
@@ -0,0 +1,68 @@
+/*
+ *    Filename: profile.h
+ * Description: Per-phase latency histograms of the measurement hot path.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "utils.h"
+
+// Log-linear buckets of nanoseconds, see loglin_bucket()
+#define PROFILE_SUB_BITS        5
+#define PROFILE_MAX_BITS        40
+#define PROFILE_BUCKETS         LOGLIN_BUCKETS(PROFILE_SUB_BITS, PROFILE_MAX_BITS)
+#define PROFILE_DEFAULT_INTERVAL_S  60
+
+typedef enum
+{
+    PROFILE_DRAIN_WRITE = 0,    // ops->drain
+    PROFILE_DRAIN,              // drain start to charge start, timer lateness included
+    PROFILE_CHARGE_ARM,         // ops->charge
+    PROFILE_READ_EDGE,          // ops->read_edge
+    PROFILE_UPDATE_STATE,       // ldr_update_state, trigger callback included
+    PROFILE_TRIGGER_CB,         // trigger callback
+    PROFILE_SAMPLE_CB,          // sample callback
+    PROFILE_RAWLOG,             // rawlog_append
+    PROFILE_IDLE,               // ops->idle
+    PROFILE_CYCLE,              // drain start to the end of the charge phase
+    PROFILE_NUM_PHASES
+} profile_phase_t;
+
+// Built with make PROFILE=1, otherwise the hooks compile to nothing.
+#ifdef LDR_PROFILE
+
+#define PROFILE_BEGIN(var)          struct timespec var; clock_gettime(CLOCK_MONOTONIC, &var)
+#define PROFILE_END(phase, var)     profile_record_since(phase, &var)
+#define PROFILE_RECORD(phase, ns)   profile_record(phase, ns)
+
+void profile_record(profile_phase_t phase, uint64_t ns);
+void profile_record_since(profile_phase_t phase, const struct timespec *start);
+void profile_dump(FILE *stream);
+int profile_write(const char *path);
+
+#else
+
+#define PROFILE_BEGIN(var)
+#define PROFILE_END(phase, var)
+#define PROFILE_RECORD(phase, ns)
+
+#endif // LDR_PROFILE
+
+
+#endif // _PROFILE_H_
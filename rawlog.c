@@ -0,0 +1,1077 @@
+/*
+ *    Filename: rawlog.c
+ * Description: Buffered raw value log writer.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "rawlog.h"
+
+#define RAWLOG_V1_RECORD_SIZE   3
+#define RAWLOG_BATCH_RECORDS    512
+
+
+void rawlog_default_config(struct rawlog_config_t *config)
+{
+    config->flush_records = RAWLOG_DEFAULT_FLUSH_RECORDS;
+    config->flush_interval_ms = RAWLOG_DEFAULT_FLUSH_INTERVAL_MS;
+    config->fsync_policy = RAWLOG_FSYNC_NEVER;
+    config->fsync_interval_s = 0;
+    config->version = RAWLOG_DEFAULT_VERSION;
+    config->circ_records = 0;
+}
+
+
+static uint32_t rawlog_fill(struct rawlog_t *log)
+{
+    uint32_t head = __atomic_load_n(&(log->head), __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&(log->tail), __ATOMIC_ACQUIRE);
+    return head - tail;
+}
+
+
+static void put_le16(uint8_t *buf, uint16_t value)
+{
+    buf[0] = (uint8_t)(value & 0xFF);
+    buf[1] = (uint8_t)(value >> 8);
+}
+
+
+static void put_le32(uint8_t *buf, uint32_t value)
+{
+    put_le16(buf, (uint16_t)(value & 0xFFFF));
+    put_le16(buf + 2, (uint16_t)(value >> 16));
+}
+
+
+static void put_le64(uint8_t *buf, uint64_t value)
+{
+    put_le32(buf, (uint32_t)(value & 0xFFFFFFFF));
+    put_le32(buf + 4, (uint32_t)(value >> 32));
+}
+
+
+static uint16_t get_le16(const uint8_t *buf)
+{
+    return (uint16_t)(buf[0] | (buf[1] << 8));
+}
+
+
+static uint32_t get_le32(const uint8_t *buf)
+{
+    return (uint32_t)get_le16(buf) | ((uint32_t)get_le16(buf + 2) << 16);
+}
+
+
+static uint64_t get_le64(const uint8_t *buf)
+{
+    return (uint64_t)get_le32(buf) | ((uint64_t)get_le32(buf + 4) << 32);
+}
+
+
+static size_t put_varint(uint8_t *buf, int64_t value)
+{
+    uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+    size_t len = 0;
+
+    while (zigzag >= 0x80) {
+        buf[len++] = (uint8_t)(zigzag | 0x80);
+        zigzag >>= 7;
+    }
+    buf[len++] = (uint8_t)zigzag;
+    return len;
+}
+
+
+// returns the number of bytes used, 0 if the buffer ends first
+static size_t get_varint(const uint8_t *buf, size_t len, int64_t *value)
+{
+    uint64_t zigzag = 0;
+    size_t i;
+
+    for (i = 0; (i < len) && (i < 10); i++) {
+        zigzag |= (uint64_t)(buf[i] & 0x7F) << (7 * i);
+        if ((buf[i] & 0x80) == 0) {
+            *value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+
+static int rawlog_write_all(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+
+static int rawlog_pwrite_all(int fd, const uint8_t *buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t written = pwrite(fd, buf, len, offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+
+// 16-bit milliseconds, little endian, then the state byte
+static int rawlog_encode_v1(const struct rawlog_record_t *rec, uint8_t *buf)
+{
+    uint32_t raw_ms = (rec->duration_us + 500) / 1000;
+    if (raw_ms > 0xFFFF)
+        raw_ms = 0xFFFF;
+    put_le16(buf, (uint16_t)raw_ms);
+    buf[2] = rec->state;
+    return RAWLOG_V1_RECORD_SIZE;
+}
+
+
+static int rawlog_write_header_v2(struct rawlog_t *log)
+{
+    uint8_t buf[RAWLOG_V2_HEADER_SIZE];
+    const struct rawlog_info_t *info = &(log->info);
+
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, RAWLOG_V2_MAGIC, 6);
+    buf[6] = RAWLOG_VERSION_2;
+    buf[7] = RAWLOG_V2_HEADER_SIZE;
+    put_le32(buf + 8, (uint32_t)info->gpio);
+    put_le32(buf + 12, info->high_threshold_us);
+    put_le32(buf + 16, info->low_threshold_us);
+    put_le32(buf + 20, info->complete_darkness_threshold_us);
+    put_le32(buf + 24, info->value_resolution_us);
+    put_le32(buf + 28, info->time_resolution_us);
+    put_le64(buf + 32, (uint64_t)info->start_realtime_ns);
+    put_le64(buf + 40, info->start_clock_us);
+    return rawlog_write_all(log->fd, buf, sizeof(buf));
+}
+
+
+static void rawlog_v2_emit_run(struct rawlog_t *log)
+{
+    if (log->block_run) {
+        log->block[log->block_len++] = 0x80 | (uint8_t)(log->block_run - 1);
+        log->block_run = 0;
+    }
+}
+
+
+// Writes the block as it is so far over its previous copy in the file.
+// The header is rewritten too, so the file always holds a valid block.
+static int rawlog_v2_block_write(struct rawlog_t *log)
+{
+    if (log->block_samples == log->block_samples_written)
+        return 0;
+    rawlog_v2_emit_run(log);
+    put_le16(log->block + 2, (uint16_t)(log->block_len - RAWLOG_V2_BLOCK_HEADER_SIZE));
+    put_le16(log->block + 4, (uint16_t)log->block_samples);
+    if (rawlog_pwrite_all(log->fd, log->block, log->block_len, log->block_offset)) {
+        log->write_errors++;
+        return -1;
+    }
+    log->records_written += log->block_samples - log->block_samples_written;
+    log->bytes_written += log->block_len - log->block_written;
+    log->block_written = log->block_len;
+    log->block_samples_written = log->block_samples;
+    return 0;
+}
+
+
+static void rawlog_v2_block_end(struct rawlog_t *log)
+{
+    if (log->block_len == 0)
+        return;
+    // on error the copy written by an earlier flush is still a valid block
+    if (rawlog_v2_block_write(log))
+        __atomic_add_fetch(&(log->records_dropped), log->block_samples - log->block_samples_written,
+                           __ATOMIC_RELAXED);
+    log->block_offset += log->block_written;
+    log->block_len = 0;
+}
+
+
+static void rawlog_v2_block_begin(struct rawlog_t *log, uint64_t time)
+{
+    memcpy(log->block, RAWLOG_V2_BLOCK_MAGIC, 2);
+    put_le64(log->block + 6, time);
+    log->block_len = RAWLOG_V2_BLOCK_HEADER_SIZE;
+    log->block_samples = 0;
+    log->block_written = 0;
+    log->block_samples_written = 0;
+    log->block_run = 0;
+    memset(&(log->predictor), 0, sizeof(struct rawlog_predictor_t));
+    log->predictor.time = time;
+}
+
+
+static void rawlog_encode_v2(struct rawlog_t *log, const struct rawlog_record_t *rec)
+{
+    struct rawlog_predictor_t *pred = &(log->predictor);
+    uint64_t time = 0;
+    uint64_t value = (rec->duration_us + log->info.value_resolution_us / 2) / log->info.value_resolution_us;
+    uint8_t state = rec->timeout ? RAWLOG_V2_STATE_TIMEOUT : (rec->state & 0x3);
+    int64_t interval;
+    int64_t dt;
+    int64_t dv;
+
+    if (rec->timestamp_us > log->info.start_clock_us)
+        time = (rec->timestamp_us - log->info.start_clock_us) / log->info.time_resolution_us;
+    if (value > UINT32_MAX)
+        value = UINT32_MAX;
+
+    // worst case record is a pending run, a tag and two varints
+    if ((log->block_len > 0) &&
+        ((log->block_len + 22 > RAWLOG_V2_BLOCK_SIZE) || (log->block_samples >= 0xFFFF - 128)))
+        rawlog_v2_block_end(log);
+    if (log->block_len == 0)
+        rawlog_v2_block_begin(log, time);
+
+    if (time < pred->time)
+        time = pred->time;
+    interval = (int64_t)(time - pred->time);
+    dt = interval - pred->interval;
+    dv = (int64_t)value - (int64_t)pred->value;
+
+    if ((log->block_samples > 0) && (dt == 0) && (dv == 0) && (state == pred->state)) {
+        if (++(log->block_run) == 128)
+            rawlog_v2_emit_run(log);
+    } else {
+        uint8_t *tag;
+        rawlog_v2_emit_run(log);
+        tag = &(log->block[log->block_len++]);
+        *tag = state;
+        if ((dt >= -3) && (dt <= 3)) {
+            *tag |= (uint8_t)(dt + 3) << 2;
+        } else {
+            *tag |= 7 << 2;
+            log->block_len += put_varint(log->block + log->block_len, dt);
+        }
+        if (dv == 0) {
+        } else if (dv == 1) {
+            *tag |= 1 << 5;
+        } else if (dv == -1) {
+            *tag |= 2 << 5;
+        } else {
+            *tag |= 3 << 5;
+            log->block_len += put_varint(log->block + log->block_len, dv);
+        }
+    }
+    pred->time = time;
+    pred->interval = interval;
+    pred->value = (uint32_t)value;
+    pred->state = state;
+    log->block_samples++;
+}
+
+
+static uint32_t rawlog_flush_v2(struct rawlog_t *log)
+{
+    uint32_t flushed = 0;
+
+    for (;;) {
+        uint32_t head = __atomic_load_n(&(log->head), __ATOMIC_ACQUIRE);
+        uint32_t tail = log->tail;
+
+        if (tail == head)
+            break;
+        while (tail != head) {
+            rawlog_encode_v2(log, &(log->ring[tail & (RAWLOG_RING_SIZE - 1)]));
+            tail++;
+            flushed++;
+        }
+        __atomic_store_n(&(log->tail), tail, __ATOMIC_RELEASE);
+    }
+    // the partial block is written but stays open, closing it would cost
+    // a block header and a predictor reset on every flush
+    if (log->block_len > 0)
+        rawlog_v2_block_write(log);
+    return flushed;
+}
+
+
+// finds the newest record and the run of consecutive records ending at it
+static void rawlog_circ_scan(const struct rawlog_circ_record_t *circ, uint32_t capacity,
+                             uint32_t *newest, uint32_t *count)
+{
+    uint32_t max_seq = 0;
+    uint32_t i;
+    uint32_t n;
+
+    *newest = 0;
+    *count = 0;
+    for (i = 0; i < capacity; i++) {
+        if (circ[i].seq > max_seq) {
+            max_seq = circ[i].seq;
+            *newest = i;
+        }
+    }
+    if (max_seq == 0)
+        return;
+    i = *newest;
+    for (n = 1; n < capacity; n++) {
+        i = (i == 0) ? capacity - 1 : i - 1;
+        if (circ[i].seq != max_seq - n)
+            break;
+    }
+    *count = n;
+}
+
+
+static uint32_t rawlog_flush_circ(struct rawlog_t *log)
+{
+    struct rawlog_circ_header_t *header = log->circ_header;
+    uint32_t flushed = 0;
+
+    for (;;) {
+        uint32_t head = __atomic_load_n(&(log->head), __ATOMIC_ACQUIRE);
+        uint32_t tail = log->tail;
+
+        if (tail == head)
+            break;
+        while (tail != head) {
+            const struct rawlog_record_t *rec = &(log->ring[tail & (RAWLOG_RING_SIZE - 1)]);
+            struct rawlog_circ_record_t *slot = &(log->circ[header->head]);
+            int64_t realtime_ms = log->info.start_realtime_ns / 1000000;
+
+            if (rec->timestamp_us > log->info.start_clock_us)
+                realtime_ms += (rec->timestamp_us - log->info.start_clock_us) / 1000;
+            slot->duration_us = rec->duration_us;
+            slot->time_state = ((uint64_t)realtime_ms << 16) | ((uint64_t)rec->timeout << 8) | rec->state;
+            // the sequence number marks the slot valid, store it last
+            __atomic_store_n(&(slot->seq), header->next_seq, __ATOMIC_RELEASE);
+            header->next_seq++;
+            header->head = (header->head + 1) % header->capacity;
+            tail++;
+            flushed++;
+        }
+        __atomic_store_n(&(log->tail), tail, __ATOMIC_RELEASE);
+    }
+    log->records_written += flushed;
+    log->bytes_written += flushed * sizeof(struct rawlog_circ_record_t);
+    return flushed;
+}
+
+
+static void rawlog_sync(struct rawlog_t *log)
+{
+    if (log->circ_header) {
+        if (msync(log->circ_header, log->map_size, MS_SYNC))
+            log->write_errors++;
+    } else {
+        fsync(log->fd);
+    }
+}
+
+
+// maps the circular log, keeping the records already in it if the file
+// has the same layout.
+static int rawlog_open_circ(struct rawlog_t *log, const char *path)
+{
+    struct rawlog_circ_header_t *header;
+    struct stat st;
+    uint32_t newest;
+    uint32_t count;
+    int keep;
+    int ret;
+
+    log->map_size = sizeof(struct rawlog_circ_header_t) +
+                    (size_t)log->config.circ_records * sizeof(struct rawlog_circ_record_t);
+    log->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (log->fd < 0) {
+        LOG_ERROR("Error: Failed to open %s for logging\n", path);
+        return -1;
+    }
+    if (fstat(log->fd, &st)) {
+        LOG_ERROR("Error: Failed to stat %s\n", path);
+        return -1;
+    }
+    keep = ((size_t)st.st_size == log->map_size);
+    if (!keep) {
+        if (st.st_size > 0)
+            LOG_INFO("%s has a different size, starting a new circular log\n", path);
+        // preallocate, so writeback never has to find free blocks
+        if (ftruncate(log->fd, 0) ||
+            ((ret = posix_fallocate(log->fd, 0, log->map_size)) && (ret != EOPNOTSUPP)) ||
+            ftruncate(log->fd, log->map_size)) {
+            LOG_ERROR("Error: Failed to allocate %zu bytes for %s\n", log->map_size, path);
+            return -1;
+        }
+    }
+    header = mmap(NULL, log->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+    if (header == MAP_FAILED) {
+        LOG_ERROR("Error: Failed to map %s\n", path);
+        return -1;
+    }
+    log->circ_header = header;
+    log->circ = (struct rawlog_circ_record_t *)(header + 1);
+
+    if (keep && ((memcmp(header->magic, RAWLOG_CIRC_MAGIC, sizeof(header->magic)) != 0) ||
+                 (header->version != RAWLOG_CIRC_VERSION) ||
+                 (header->record_size != sizeof(struct rawlog_circ_record_t)) ||
+                 (header->capacity != log->config.circ_records))) {
+        LOG_INFO("%s is not a circular log, starting a new one\n", path);
+        keep = 0;
+    }
+    if (keep) {
+        // the header may be older than the records after a crash
+        rawlog_circ_scan(log->circ, header->capacity, &newest, &count);
+        if (count) {
+            header->head = (newest + 1) % header->capacity;
+            header->next_seq = log->circ[newest].seq + 1;
+        } else {
+            header->head = 0;
+            header->next_seq = 1;
+        }
+        LOG_VERBOSE("%s: recovered %u records, generation %u\n", path, count, header->generation);
+    } else {
+        memset(header, 0, log->map_size);
+        memcpy(header->magic, RAWLOG_CIRC_MAGIC, sizeof(header->magic));
+        header->version = RAWLOG_CIRC_VERSION;
+        header->record_size = sizeof(struct rawlog_circ_record_t);
+        header->capacity = log->config.circ_records;
+        header->next_seq = 1;
+    }
+    header->generation++;
+    header->gpio = log->info.gpio;
+    header->high_threshold_us = log->info.high_threshold_us;
+    header->low_threshold_us = log->info.low_threshold_us;
+    header->complete_darkness_threshold_us = log->info.complete_darkness_threshold_us;
+    return 0;
+}
+
+
+// writes out everything in the ring, returns the number of records.
+static uint32_t rawlog_flush(struct rawlog_t *log)
+{
+    uint8_t buf[RAWLOG_BATCH_RECORDS * RAWLOG_V1_RECORD_SIZE];
+    uint32_t flushed = 0;
+
+    if (log->circ_header)
+        return rawlog_flush_circ(log);
+    if (log->config.version == RAWLOG_VERSION_2)
+        return rawlog_flush_v2(log);
+
+    for (;;) {
+        uint32_t head = __atomic_load_n(&(log->head), __ATOMIC_ACQUIRE);
+        uint32_t tail = log->tail;
+        size_t len = 0;
+        uint32_t n = 0;
+
+        while ((tail + n != head) && (n < RAWLOG_BATCH_RECORDS)) {
+            len += rawlog_encode_v1(&(log->ring[(tail + n) & (RAWLOG_RING_SIZE - 1)]), buf + len);
+            n++;
+        }
+        if (n == 0)
+            break;
+        // the slots are free once encoded
+        __atomic_store_n(&(log->tail), tail + n, __ATOMIC_RELEASE);
+        if (rawlog_write_all(log->fd, buf, len)) {
+            log->write_errors++;
+            __atomic_add_fetch(&(log->records_dropped), n, __ATOMIC_RELAXED);
+        } else {
+            log->records_written += n;
+            log->bytes_written += len;
+        }
+        flushed += n;
+    }
+    return flushed;
+}
+
+
+static void *rawlog_thread(void *arg)
+{
+    struct rawlog_t *log = (struct rawlog_t *)arg;
+    struct timespec last_fsync;
+    struct timespec now;
+    unsigned char running = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &last_fsync);
+    while (running) {
+        struct timespec deadline;
+
+        pthread_mutex_lock(&(log->lock));
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += log->config.flush_interval_ms / 1000;
+        deadline.tv_nsec += (log->config.flush_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (log->running && (rawlog_fill(log) < log->config.flush_records)) {
+            if (pthread_cond_timedwait(&(log->cond), &(log->lock), &deadline) == ETIMEDOUT)
+                break;
+        }
+        running = log->running;
+        pthread_mutex_unlock(&(log->lock));
+
+        if (rawlog_flush(log) == 0)
+            continue;
+        if (log->config.fsync_policy == RAWLOG_FSYNC_BATCH) {
+            rawlog_sync(log);
+        } else if (log->config.fsync_policy == RAWLOG_FSYNC_PERIODIC) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (timespec_diff_ms(&now, &last_fsync) >= (int64_t)log->config.fsync_interval_s * 1000) {
+                rawlog_sync(log);
+                last_fsync = now;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+struct rawlog_t *rawlog_open(const char *path, const struct rawlog_config_t *config,
+                             const struct rawlog_info_t *info)
+{
+    struct rawlog_t *log;
+    pthread_condattr_t attr;
+
+    log = malloc(sizeof(struct rawlog_t));
+    if (log == NULL)
+        return NULL;
+    memset(log, 0, sizeof(struct rawlog_t));
+    log->fd = -1;
+    log->config = *config;
+    log->info = *info;
+    if (log->info.value_resolution_us == 0)
+        log->info.value_resolution_us = RAWLOG_V2_VALUE_RESOLUTION_US;
+    if (log->info.time_resolution_us == 0)
+        log->info.time_resolution_us = RAWLOG_V2_TIME_RESOLUTION_US;
+    // copying into the mapping is cheap, keep the window lost on a crash small
+    if ((log->config.flush_records == 0) || log->config.circ_records)
+        log->config.flush_records = 1;
+    if (log->config.flush_records > RAWLOG_RING_SIZE / 2)
+        log->config.flush_records = RAWLOG_RING_SIZE / 2;
+
+    pthread_mutex_init(&(log->lock), NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(log->cond), &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (log->config.circ_records) {
+        if (rawlog_open_circ(log, path)) {
+            rawlog_close(log);
+            return NULL;
+        }
+    } else {
+        // always append, a restart must not overwrite the start of the log.
+        // v2 rewrites its open block in place, which O_APPEND would not allow.
+        int flags = (log->config.version == RAWLOG_VERSION_2) ? 0 : O_APPEND;
+        log->fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    }
+    if (log->fd < 0) {
+        LOG_ERROR("Error: Failed to open %s for logging\n", path);
+        rawlog_close(log);
+        return NULL;
+    }
+    if (!log->circ_header && (log->config.version == RAWLOG_VERSION_2)) {
+        if ((lseek(log->fd, 0, SEEK_END) < 0) || rawlog_write_header_v2(log)) {
+            LOG_ERROR("Error: Failed to write raw log header to %s\n", path);
+            rawlog_close(log);
+            return NULL;
+        }
+        log->block_offset = lseek(log->fd, 0, SEEK_CUR);
+    }
+
+    log->running = 1;
+    if (pthread_create(&(log->thread), NULL, rawlog_thread, log)) {
+        LOG_ERROR("Error: Failed to start raw log writer for %s\n", path);
+        rawlog_close(log);
+        return NULL;
+    }
+    log->thread_started = 1;
+    return log;
+}
+
+
+// called from the measurement path, never blocks on the disk.
+void rawlog_append(struct rawlog_t *log, uint64_t timestamp_us,
+                   uint32_t duration_us, uint8_t state, uint8_t timeout)
+{
+    uint32_t head = log->head;
+    uint32_t tail = __atomic_load_n(&(log->tail), __ATOMIC_ACQUIRE);
+    struct rawlog_record_t *rec;
+
+    if (head - tail >= RAWLOG_RING_SIZE) {
+        __atomic_add_fetch(&(log->records_dropped), 1, __ATOMIC_RELAXED);
+        return;
+    }
+    rec = &(log->ring[head & (RAWLOG_RING_SIZE - 1)]);
+    rec->timestamp_us = timestamp_us;
+    rec->duration_us = duration_us;
+    rec->state = state;
+    rec->timeout = timeout;
+    __atomic_store_n(&(log->head), head + 1, __ATOMIC_RELEASE);
+    // a lost wakeup only delays the flush until the interval expires
+    if (head + 1 - tail == log->config.flush_records)
+        pthread_cond_signal(&(log->cond));
+}
+
+
+void rawlog_close(struct rawlog_t *log)
+{
+    if (log == NULL)
+        return;
+    if (log->thread_started) {
+        pthread_mutex_lock(&(log->lock));
+        log->running = 0;
+        pthread_cond_signal(&(log->cond));
+        pthread_mutex_unlock(&(log->lock));
+        pthread_join(log->thread, NULL);
+    }
+    if (log->fd >= 0) {
+        rawlog_flush(log);
+        if (!log->circ_header && (log->config.version == RAWLOG_VERSION_2))
+            rawlog_v2_block_end(log);
+        if (log->config.fsync_policy != RAWLOG_FSYNC_NEVER)
+            rawlog_sync(log);
+        if (log->circ_header)
+            munmap(log->circ_header, log->map_size);
+        close(log->fd);
+    }
+    pthread_cond_destroy(&(log->cond));
+    pthread_mutex_destroy(&(log->lock));
+    free(log);
+}
+
+
+void rawlog_print_stats(const struct rawlog_t *log, const char *name, FILE *stream)
+{
+    fprintf(stream, "%s: records written %llu, dropped %llu, bytes %llu, write errors %llu\n", name,
+            (unsigned long long)log->records_written,
+            (unsigned long long)__atomic_load_n(&(log->records_dropped), __ATOMIC_RELAXED),
+            (unsigned long long)log->bytes_written,
+            (unsigned long long)log->write_errors);
+}
+
+
+static int rawlog_reader_open_circ(struct rawlog_reader_t *reader)
+{
+    const struct rawlog_circ_header_t *header;
+    struct stat st;
+    uint32_t newest;
+    uint32_t count;
+
+    if (fstat(fileno(reader->fp), &st) || ((size_t)st.st_size < sizeof(struct rawlog_circ_header_t)))
+        return -1;
+    reader->map_size = st.st_size;
+    reader->map = mmap(NULL, reader->map_size, PROT_READ, MAP_SHARED, fileno(reader->fp), 0);
+    if (reader->map == MAP_FAILED) {
+        reader->map = NULL;
+        return -1;
+    }
+    header = (const struct rawlog_circ_header_t *)reader->map;
+    if ((header->record_size != sizeof(struct rawlog_circ_record_t)) ||
+        (sizeof(struct rawlog_circ_header_t) + (size_t)header->capacity * header->record_size > reader->map_size))
+        return -1;
+    reader->circ = (const struct rawlog_circ_record_t *)(header + 1);
+    reader->circ_capacity = header->capacity;
+    reader->info.gpio = header->gpio;
+    reader->info.high_threshold_us = header->high_threshold_us;
+    reader->info.low_threshold_us = header->low_threshold_us;
+    reader->info.complete_darkness_threshold_us = header->complete_darkness_threshold_us;
+    reader->info.value_resolution_us = 1;
+    reader->info.time_resolution_us = 1000;
+    reader->sessions = header->generation;
+    rawlog_circ_scan(reader->circ, reader->circ_capacity, &newest, &count);
+    reader->circ_count = count;
+    reader->circ_first = (newest + 1 + reader->circ_capacity - count) % reader->circ_capacity;
+    reader->circ_pos = reader->circ_first;
+    reader->circ_left = reader->circ_count;
+    return 0;
+}
+
+
+int rawlog_reader_open(struct rawlog_reader_t *reader, const char *path)
+{
+    char magic[8];
+
+    memset(reader, 0, sizeof(struct rawlog_reader_t));
+    reader->fp = fopen(path, "rb");
+    if (reader->fp == NULL) {
+        LOG_ERROR("Error: Failed to open %s\n", path);
+        return -1;
+    }
+    memset(magic, 0, sizeof(magic));
+    // v1 logs have no header at all
+    if (fread(magic, 1, sizeof(magic), reader->fp) < 6)
+        reader->version = RAWLOG_VERSION_1;
+    else if (memcmp(magic, RAWLOG_CIRC_MAGIC, sizeof(magic)) == 0)
+        reader->version = RAWLOG_VERSION_CIRC;
+    else if (memcmp(magic, RAWLOG_V2_MAGIC, 6) == 0)
+        reader->version = RAWLOG_VERSION_2;
+    else
+        reader->version = RAWLOG_VERSION_1;
+    rewind(reader->fp);
+    if ((reader->version == RAWLOG_VERSION_CIRC) && rawlog_reader_open_circ(reader)) {
+        LOG_ERROR("Error: %s is not a valid circular log\n", path);
+        rawlog_reader_close(reader);
+        return -1;
+    }
+    return 0;
+}
+
+
+void rawlog_reader_close(struct rawlog_reader_t *reader)
+{
+    free(reader->index);
+    reader->index = NULL;
+    if (reader->map) {
+        munmap(reader->map, reader->map_size);
+        reader->map = NULL;
+    }
+    if (reader->fp) {
+        fclose(reader->fp);
+        reader->fp = NULL;
+    }
+}
+
+
+static int rawlog_reader_next_circ(struct rawlog_reader_t *reader, struct rawlog_sample_t *sample)
+{
+    const struct rawlog_circ_record_t *rec;
+    int64_t realtime_ms;
+
+    if (reader->circ_left == 0)
+        return 0;
+    rec = &(reader->circ[reader->circ_pos]);
+    reader->circ_pos = (reader->circ_pos + 1) % reader->circ_capacity;
+    reader->circ_left--;
+    realtime_ms = (int64_t)(rec->time_state >> 16);
+    memset(sample, 0, sizeof(struct rawlog_sample_t));
+    sample->timestamp_us = (uint64_t)realtime_ms * 1000;
+    sample->realtime_ns = realtime_ms * 1000000;
+    sample->duration_us = rec->duration_us;
+    sample->state = rec->time_state & 0xFF;
+    sample->timeout = (rec->time_state >> 8) & 0xFF;
+    return 1;
+}
+
+
+// parses a session header, the first two bytes are already in buf
+static int rawlog_reader_header(struct rawlog_reader_t *reader, uint8_t *buf)
+{
+    long offset = ftell(reader->fp) - 2;
+
+    // a truncated header or block is the end of the log
+    if (fread(buf + 2, 1, RAWLOG_V2_HEADER_SIZE - 2, reader->fp) != RAWLOG_V2_HEADER_SIZE - 2)
+        return 0;
+    if ((memcmp(buf, RAWLOG_V2_MAGIC, 6) != 0) || (buf[6] != RAWLOG_VERSION_2))
+        return -1;
+    if (buf[7] > RAWLOG_V2_HEADER_SIZE) {
+        // newer header, skip the fields we don't know
+        if (fseek(reader->fp, buf[7] - RAWLOG_V2_HEADER_SIZE, SEEK_CUR))
+            return 0;
+    }
+    reader->info.gpio = (int)get_le32(buf + 8);
+    reader->info.high_threshold_us = get_le32(buf + 12);
+    reader->info.low_threshold_us = get_le32(buf + 16);
+    reader->info.complete_darkness_threshold_us = get_le32(buf + 20);
+    reader->info.value_resolution_us = get_le32(buf + 24);
+    reader->info.time_resolution_us = get_le32(buf + 28);
+    reader->info.start_realtime_ns = (int64_t)get_le64(buf + 32);
+    reader->info.start_clock_us = get_le64(buf + 40);
+    if ((reader->info.value_resolution_us == 0) || (reader->info.time_resolution_us == 0))
+        return -1;
+    reader->session_offset = offset;
+    reader->last_state = 0;
+    reader->sessions++;
+    return 1;
+}
+
+
+// reads the next session header or block, returns 1 on success, 0 at the
+// end of the log, -1 if the log is corrupt.
+static int rawlog_reader_fill(struct rawlog_reader_t *reader)
+{
+    uint8_t buf[RAWLOG_V2_HEADER_SIZE];
+    size_t len;
+    int ret;
+
+    for (;;) {
+        if (fread(buf, 1, 2, reader->fp) != 2)
+            return 0;
+        if (memcmp(buf, RAWLOG_V2_MAGIC, 2) == 0) {
+            ret = rawlog_reader_header(reader, buf);
+            if (ret <= 0)
+                return ret;
+        } else if (memcmp(buf, RAWLOG_V2_BLOCK_MAGIC, 2) == 0) {
+            if (reader->sessions == 0)
+                return -1;
+            if (fread(buf + 2, 1, RAWLOG_V2_BLOCK_HEADER_SIZE - 2, reader->fp) != RAWLOG_V2_BLOCK_HEADER_SIZE - 2)
+                return 0;
+            len = get_le16(buf + 2);
+            if (len > RAWLOG_V2_BLOCK_SIZE)
+                return -1;
+            if (fread(reader->block, 1, len, reader->fp) != len)
+                return 0;
+            reader->block_len = len;
+            reader->block_pos = 0;
+            reader->run = 0;
+            memset(&(reader->predictor), 0, sizeof(struct rawlog_predictor_t));
+            reader->predictor.time = get_le64(buf + 6);
+            return 1;
+        } else {
+            return -1;
+        }
+    }
+}
+
+
+static int rawlog_reader_next_v1(struct rawlog_reader_t *reader, struct rawlog_sample_t *sample)
+{
+    uint8_t buf[RAWLOG_V1_RECORD_SIZE];
+
+    if (fread(buf, 1, sizeof(buf), reader->fp) != sizeof(buf))
+        return 0;
+    memset(sample, 0, sizeof(struct rawlog_sample_t));
+    sample->duration_us = (uint32_t)get_le16(buf) * 1000;
+    sample->state = buf[2];
+    return 1;
+}
+
+
+// decodes the next tag of the current block into the predictor
+static int rawlog_reader_decode(struct rawlog_reader_t *reader)
+{
+    struct rawlog_predictor_t *pred = &(reader->predictor);
+    const uint8_t *p;
+    size_t left;
+    size_t used;
+    int64_t dt;
+    int64_t dv = 0;
+    uint8_t tag;
+
+    tag = reader->block[reader->block_pos++];
+    if (tag & 0x80) {
+        // this sample plus the rest of the run
+        reader->run = tag & 0x7F;
+        pred->time += pred->interval;
+        return 0;
+    }
+    p = reader->block + reader->block_pos;
+    left = reader->block_len - reader->block_pos;
+    dt = (int64_t)((tag >> 2) & 0x7) - 3;
+    if (dt == 4) {
+        used = get_varint(p, left, &dt);
+        if (used == 0)
+            return -1;
+        p += used;
+        left -= used;
+    }
+    switch ((tag >> 5) & 0x3) {
+        case 0: dv = 0; break;
+        case 1: dv = 1; break;
+        case 2: dv = -1; break;
+        default:
+            used = get_varint(p, left, &dv);
+            if (used == 0)
+                return -1;
+            p += used;
+            break;
+    }
+    reader->block_pos = p - reader->block;
+    pred->interval += dt;
+    pred->time += pred->interval;
+    pred->value = (uint32_t)((int64_t)pred->value + dv);
+    pred->state = tag & 0x3;
+    return 0;
+}
+
+
+// returns 1 with a sample, 0 at the end of the log, -1 if it is corrupt
+int rawlog_reader_next(struct rawlog_reader_t *reader, struct rawlog_sample_t *sample)
+{
+    struct rawlog_predictor_t *pred = &(reader->predictor);
+    const struct rawlog_info_t *info = &(reader->info);
+    uint64_t elapsed_us;
+    int ret;
+
+    if (reader->version == RAWLOG_VERSION_1)
+        return rawlog_reader_next_v1(reader, sample);
+    if (reader->version == RAWLOG_VERSION_CIRC)
+        return rawlog_reader_next_circ(reader, sample);
+
+    if (reader->run > 0) {
+        reader->run--;
+        pred->time += pred->interval;
+    } else {
+        while (reader->block_pos >= reader->block_len) {
+            ret = rawlog_reader_fill(reader);
+            if (ret <= 0)
+                return ret;
+        }
+        if (rawlog_reader_decode(reader))
+            return -1;
+    }
+
+    elapsed_us = pred->time * info->time_resolution_us;
+    memset(sample, 0, sizeof(struct rawlog_sample_t));
+    sample->timestamp_us = info->start_clock_us + elapsed_us;
+    sample->realtime_ns = info->start_realtime_ns + (int64_t)elapsed_us * 1000;
+    sample->duration_us = pred->value * info->value_resolution_us;
+    if (pred->state == RAWLOG_V2_STATE_TIMEOUT) {
+        sample->timeout = 1;
+        sample->state = reader->last_state;
+    } else {
+        sample->state = pred->state;
+        reader->last_state = pred->state;
+    }
+    return 1;
+}
+
+
+static void rawlog_reader_rewind(struct rawlog_reader_t *reader)
+{
+    rewind(reader->fp);
+    reader->block_len = 0;
+    reader->block_pos = 0;
+    reader->run = 0;
+    reader->sessions = 0;
+    reader->last_state = 0;
+}
+
+
+// scans the block headers of a v2 log, skipping the payloads
+static int rawlog_reader_index(struct rawlog_reader_t *reader)
+{
+    uint8_t buf[RAWLOG_V2_HEADER_SIZE];
+    unsigned int blocks = 0;
+    size_t i;
+    long offset;
+    int ret;
+
+    reader->index = malloc(RAWLOG_INDEX_SIZE * sizeof(struct rawlog_index_entry_t));
+    if (reader->index == NULL)
+        return -1;
+    reader->index_count = 0;
+    reader->index_stride = 1;
+    rawlog_reader_rewind(reader);
+    for (;;) {
+        offset = ftell(reader->fp);
+        if (fread(buf, 1, 2, reader->fp) != 2)
+            break;
+        if (memcmp(buf, RAWLOG_V2_MAGIC, 2) == 0) {
+            ret = rawlog_reader_header(reader, buf);
+            if (ret <= 0)
+                break;
+            continue;
+        }
+        if ((memcmp(buf, RAWLOG_V2_BLOCK_MAGIC, 2) != 0) || (reader->sessions == 0) ||
+            (fread(buf + 2, 1, RAWLOG_V2_BLOCK_HEADER_SIZE - 2, reader->fp) != RAWLOG_V2_BLOCK_HEADER_SIZE - 2))
+            break;
+        if ((blocks++ % reader->index_stride) == 0) {
+            struct rawlog_index_entry_t *entry;
+            if (reader->index_count == RAWLOG_INDEX_SIZE) {
+                for (i = 0; i < RAWLOG_INDEX_SIZE / 2; i++)
+                    reader->index[i] = reader->index[i * 2];
+                reader->index_count = RAWLOG_INDEX_SIZE / 2;
+                reader->index_stride *= 2;
+            }
+            entry = &(reader->index[reader->index_count++]);
+            entry->realtime_ns = reader->info.start_realtime_ns +
+                                 (int64_t)(get_le64(buf + 6) * reader->info.time_resolution_us) * 1000;
+            entry->offset = offset;
+            entry->session_offset = reader->session_offset;
+        }
+        if (fseek(reader->fp, get_le16(buf + 2), SEEK_CUR))
+            break;
+    }
+    rawlog_reader_rewind(reader);
+    return 0;
+}
+
+
+static int64_t rawlog_circ_realtime_ns(const struct rawlog_circ_record_t *rec)
+{
+    return (int64_t)(rec->time_state >> 16) * 1000000;
+}
+
+
+// Positions the reader at or shortly before the first sample at
+// realtime_ns, so the caller still has to skip earlier samples. v1 logs
+// have no timestamps and can't seek.
+int rawlog_reader_seek(struct rawlog_reader_t *reader, int64_t realtime_ns)
+{
+    uint8_t buf[RAWLOG_V2_HEADER_SIZE];
+    const struct rawlog_index_entry_t *entry = NULL;
+    size_t i;
+
+    if (reader->version == RAWLOG_VERSION_1)
+        return -1;
+
+    if (reader->version == RAWLOG_VERSION_CIRC) {
+        // the valid range is in time order, binary search it
+        uint32_t first = reader->circ_first;
+        uint32_t lo = 0;
+        uint32_t hi = reader->circ_count;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (rawlog_circ_realtime_ns(&(reader->circ[(first + mid) % reader->circ_capacity])) < realtime_ns)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        reader->circ_pos = (first + lo) % reader->circ_capacity;
+        reader->circ_left = reader->circ_count - lo;
+        return 0;
+    }
+
+    if ((reader->index == NULL) && rawlog_reader_index(reader))
+        return -1;
+    for (i = 0; i < reader->index_count; i++) {
+        if (reader->index[i].realtime_ns > realtime_ns)
+            break;
+        entry = &(reader->index[i]);
+    }
+    rawlog_reader_rewind(reader);
+    if (entry == NULL)
+        return 0;
+    if (fseek(reader->fp, entry->session_offset, SEEK_SET) ||
+        (fread(buf, 1, 2, reader->fp) != 2) ||
+        (rawlog_reader_header(reader, buf) <= 0) ||
+        fseek(reader->fp, entry->offset, SEEK_SET)) {
+        rawlog_reader_rewind(reader);
+        return -1;
+    }
+    return 0;
+}
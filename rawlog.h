@@ -0,0 +1,250 @@
+/*
+ *    Filename: rawlog.h
+ * Description: Buffered raw value log writer.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RAWLOG_H_
+#define _RAWLOG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define RAWLOG_RING_SIZE                4096    // records, power of 2
+#define RAWLOG_DEFAULT_FLUSH_RECORDS    256
+#define RAWLOG_DEFAULT_FLUSH_INTERVAL_MS 5000
+
+// v1: headerless 3-byte records, 16-bit milliseconds and a state byte.
+// v2: a session header followed by self-contained blocks of records.
+//
+// session header, little endian, RAWLOG_V2_HEADER_SIZE bytes:
+//   0  "LDRLOG"            8  int32 gpio          24  uint32 value resolution us
+//   6  uint8 version (2)  12  uint32 high us      28  uint32 time resolution us
+//   7  uint8 header size  16  uint32 low us       32  int64 start realtime ns
+//                         20  uint32 dark us      40  uint64 start clock us
+// A header is appended every time the log is opened, so one file can hold
+// several sessions.
+//
+// block header, RAWLOG_V2_BLOCK_HEADER_SIZE bytes:
+//   0  "LB"  2  uint16 payload length  4  uint16 samples  6  uint64 base time
+// The base time is in time resolution units since the session start. The
+// predictor is reset at every block, so blocks can be decoded on their own
+// and skipped by length. The last block stays open across flushes and is
+// rewritten in place, header included, until it is full.
+//
+// record tag byte:
+//   1nnnnnnn  run, repeat the previous record n+1 times
+//   0vvdddss  ss state, 3 is a charge timeout (the state is unchanged)
+//             ddd change of sample interval -3..+3 as 0..6, 7 varint follows
+//             vv  change of value: 0 none, 1 +1, 2 -1, 3 varint follows
+// varints are LEB128 of zigzag encoded differences. Time varint first.
+#define RAWLOG_VERSION_1        1
+#define RAWLOG_VERSION_2        2
+#define RAWLOG_DEFAULT_VERSION  RAWLOG_VERSION_2
+
+#define RAWLOG_V2_MAGIC                 "LDRLOG"
+#define RAWLOG_V2_HEADER_SIZE           48
+#define RAWLOG_V2_BLOCK_MAGIC           "LB"
+#define RAWLOG_V2_BLOCK_HEADER_SIZE     14
+#define RAWLOG_V2_BLOCK_SIZE            4096
+#define RAWLOG_V2_STATE_TIMEOUT         3
+#define RAWLOG_V2_TIME_RESOLUTION_US    1000
+#define RAWLOG_V2_VALUE_RESOLUTION_US   10
+
+// Circular log: a preallocated file of fixed size, mapped into memory.
+// Records are plain memory stores and the kernel batches the writeback.
+// Both the header and the records are in host byte order. The head in
+// the header is only a hint, on open the file is scanned for the record
+// with the highest sequence number and the valid range is the run of
+// consecutive sequence numbers ending there.
+#define RAWLOG_VERSION_CIRC     0x100   // reader only, any header version
+#define RAWLOG_CIRC_MAGIC       "LDRCIRC"
+#define RAWLOG_CIRC_VERSION     1
+#define RAWLOG_CIRC_DEFAULT_DAYS 7
+#define RAWLOG_CIRC_MAX_RECORDS (64 * 1024 * 1024)   // 1 GB
+
+#define RAWLOG_FSYNC_NEVER      0
+#define RAWLOG_FSYNC_BATCH      1   // after every batch written
+#define RAWLOG_FSYNC_PERIODIC   2   // at most every fsync_interval_s
+
+
+struct rawlog_record_t
+{
+    uint64_t timestamp_us;      // CLOCK_MONOTONIC, or the backend clock
+    uint32_t duration_us;
+    uint8_t state;
+    uint8_t timeout;
+};
+
+struct rawlog_info_t
+{
+    int gpio;
+    uint32_t high_threshold_us;
+    uint32_t low_threshold_us;
+    uint32_t complete_darkness_threshold_us;
+    uint32_t value_resolution_us;
+    uint32_t time_resolution_us;
+    int64_t start_realtime_ns;
+    uint64_t start_clock_us;    // the sensor clock when the session started
+};
+
+struct rawlog_circ_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;          // records
+    uint32_t generation;        // incremented on every open
+    uint32_t head;              // next record to write
+    uint32_t next_seq;
+    int32_t gpio;
+    uint32_t high_threshold_us;
+    uint32_t low_threshold_us;
+    uint32_t complete_darkness_threshold_us;
+    uint32_t reserved[4];
+};
+
+struct rawlog_circ_record_t
+{
+    uint32_t seq;               // 0 for a slot never written
+    uint32_t duration_us;
+    uint64_t time_state;        // wall clock ms << 16 | timeout << 8 | state
+};
+
+// v2 encoder and decoder predictor, reset at every block
+struct rawlog_predictor_t
+{
+    uint64_t time;
+    int64_t interval;
+    uint32_t value;
+    uint8_t state;
+};
+
+struct rawlog_config_t
+{
+    unsigned int flush_records;
+    unsigned int flush_interval_ms;
+    int fsync_policy;
+    unsigned int fsync_interval_s;
+    int version;
+    uint32_t circ_records;      // non-zero for a circular log
+};
+
+// The measurement path only stores records into a single producer,
+// single consumer ring. A writer thread encodes and writes them in
+// batches, so a slow disk never stalls a measurement. When the ring is
+// full, records are dropped and counted.
+struct rawlog_t
+{
+    int fd;
+    struct rawlog_config_t config;
+    struct rawlog_info_t info;
+
+    struct rawlog_record_t ring[RAWLOG_RING_SIZE];
+    uint32_t head;      // written by the producer
+    uint32_t tail;      // written by the writer thread
+
+    // v2 block being encoded, owned by the writer thread
+    uint8_t block[RAWLOG_V2_BLOCK_SIZE];
+    size_t block_len;
+    uint32_t block_samples;
+    off_t block_offset;         // where the block goes in the file
+    size_t block_written;       // bytes and samples already in the file
+    uint32_t block_samples_written;
+    unsigned int block_run;
+    struct rawlog_predictor_t predictor;
+
+    // circular log mapping
+    struct rawlog_circ_header_t *circ_header;
+    struct rawlog_circ_record_t *circ;
+    size_t map_size;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char running;
+    unsigned char thread_started;
+
+    uint64_t records_dropped;
+    uint64_t records_written;
+    uint64_t bytes_written;
+    uint64_t write_errors;
+};
+
+
+struct rawlog_sample_t
+{
+    uint64_t timestamp_us;      // sensor clock, wall clock in circular logs, 0 in v1 logs
+    int64_t realtime_ns;        // wall clock, 0 in v1 logs
+    uint32_t duration_us;
+    uint8_t state;
+    uint8_t timeout;
+};
+
+// Sparse index of a v2 log, one entry every index_stride blocks. The
+// stride doubles whenever the index fills up, so memory stays bounded.
+#define RAWLOG_INDEX_SIZE       1024
+
+struct rawlog_index_entry_t
+{
+    int64_t realtime_ns;        // of the first sample in the block
+    long offset;                // of the block
+    long session_offset;        // of the header of its session
+};
+
+struct rawlog_reader_t
+{
+    FILE *fp;
+    int version;
+    unsigned int sessions;
+    struct rawlog_info_t info;  // of the current session
+    uint8_t block[RAWLOG_V2_BLOCK_SIZE];
+    size_t block_len;
+    size_t block_pos;
+    unsigned int run;
+    struct rawlog_predictor_t predictor;
+    uint8_t last_state;
+    long session_offset;
+    struct rawlog_index_entry_t *index;
+    size_t index_count;
+    unsigned int index_stride;
+    // circular log
+    void *map;
+    size_t map_size;
+    const struct rawlog_circ_record_t *circ;
+    uint32_t circ_capacity;
+    uint32_t circ_first;        // the valid range found on open
+    uint32_t circ_count;
+    uint32_t circ_pos;
+    uint32_t circ_left;
+};
+
+
+void rawlog_default_config(struct rawlog_config_t *config);
+struct rawlog_t *rawlog_open(const char *path, const struct rawlog_config_t *config,
+                             const struct rawlog_info_t *info);
+void rawlog_append(struct rawlog_t *log, uint64_t timestamp_us,
+                   uint32_t duration_us, uint8_t state, uint8_t timeout);
+void rawlog_close(struct rawlog_t *log);
+void rawlog_print_stats(const struct rawlog_t *log, const char *name, FILE *stream);
+
+int rawlog_reader_open(struct rawlog_reader_t *reader, const char *path);
+int rawlog_reader_next(struct rawlog_reader_t *reader, struct rawlog_sample_t *sample);
+int rawlog_reader_seek(struct rawlog_reader_t *reader, int64_t realtime_ns);
+void rawlog_reader_close(struct rawlog_reader_t *reader);
+
+
+#endif // _RAWLOG_H_
@@ -0,0 +1,123 @@
+/*
+ *    Filename: shmpub.c
+ * Description: Publishes the latest readings in shared memory, see ldr-shm.h.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "shmpub.h"
+
+
+struct ldr_shm_t *shmpub_open(const char *name, const int *gpios, int num_sensors)
+{
+    struct ldr_shm_t *shm;
+    int fd;
+    int i;
+
+    if (num_sensors > LDR_SHM_MAX_SENSORS)
+        num_sensors = LDR_SHM_MAX_SENSORS;
+    fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        LOG_ERROR("Error: failed to create shared memory %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(struct ldr_shm_t))) {
+        LOG_ERROR("Error: failed to size shared memory %s: %s\n", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    shm = mmap(NULL, sizeof(struct ldr_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        LOG_ERROR("Error: failed to map shared memory %s: %s\n", name, strerror(errno));
+        shm_unlink(name);
+        return NULL;
+    }
+
+    // readers check the magic last, so it goes in after everything else
+    for (i = 0; i < num_sensors; i++)
+        shm->sensors[i].gpio = gpios[i];
+    shm->num_sensors = num_sensors;
+    shm->size = sizeof(struct ldr_shm_t);
+    shm->version = LDR_SHM_VERSION;
+    shm->pid = getpid();
+    __atomic_store_n(&(shm->magic), LDR_SHM_MAGIC, __ATOMIC_RELEASE);
+    LOG_VERBOSE("Publishing readings in shared memory %s\n", name);
+    return shm;
+}
+
+
+// seqlock write side, there is only ever one writer
+static inline volatile struct ldr_shm_sensor_t *shmpub_begin(struct ldr_shm_t *shm, int index)
+{
+    volatile struct ldr_shm_sensor_t *s = &(shm->sensors[index]);
+
+    __atomic_store_n(&(s->seq), s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return s;
+}
+
+static inline void shmpub_end(volatile struct ldr_shm_sensor_t *s)
+{
+    __atomic_store_n(&(s->seq), s->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+void shmpub_sample(struct ldr_shm_t *shm, int index, int state, uint32_t duration_us,
+                   int timeout, const struct timespec *time)
+{
+    volatile struct ldr_shm_sensor_t *s;
+
+    if ((shm == NULL) || (index < 0) || (index >= (int)shm->num_sensors))
+        return;
+    s = shmpub_begin(shm, index);
+    s->state = state;
+    s->duration_us = duration_us;
+    s->timeout = timeout;
+    s->samples++;
+    s->sample_time_ns = (int64_t)time->tv_sec * 1000000000 + time->tv_nsec;
+    shmpub_end(s);
+}
+
+
+void shmpub_transition(struct ldr_shm_t *shm, int index, int state,
+                       const struct timespec *time)
+{
+    volatile struct ldr_shm_sensor_t *s;
+
+    if ((shm == NULL) || (index < 0) || (index >= (int)shm->num_sensors))
+        return;
+    s = shmpub_begin(shm, index);
+    s->state = state;
+    s->transitions++;
+    s->transition_time_ns = (int64_t)time->tv_sec * 1000000000 + time->tv_nsec;
+    shmpub_end(s);
+}
+
+
+void shmpub_close(struct ldr_shm_t *shm, const char *name)
+{
+    if (shm == NULL)
+        return;
+    munmap(shm, sizeof(struct ldr_shm_t));
+    shm_unlink(name);
+}
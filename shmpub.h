@@ -0,0 +1,33 @@
+/*
+ *    Filename: shmpub.h
+ * Description: Publishes the latest readings in shared memory, see ldr-shm.h.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _SHMPUB_H_
+#define _SHMPUB_H_
+
+#include <stdint.h>
+#include <time.h>
+#include "ldr-shm.h"
+
+
+struct ldr_shm_t *shmpub_open(const char *name, const int *gpios, int num_sensors);
+void shmpub_sample(struct ldr_shm_t *shm, int index, int state, uint32_t duration_us,
+                   int timeout, const struct timespec *time);
+void shmpub_transition(struct ldr_shm_t *shm, int index, int state,
+                       const struct timespec *time);
+void shmpub_close(struct ldr_shm_t *shm, const char *name);
+
+
+#endif // _SHMPUB_H_
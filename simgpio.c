@@ -0,0 +1,335 @@
+/*
+ *    Filename: simgpio.c
+ * Description: Simulated RC circuit GPIO backend.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+
+#include "utils.h"
+#include "simgpio.h"
+#include "ldr.h"
+
+
+// The capacitor charges through the LDR until the pin reads high:
+//   t = R * C * ln(1 / (1 - Vth/Vdd))
+// with the LDR resistance following the usual power law
+//   R = R10 * (lux / 10) ^ -gamma
+// All times handed to ldr.c are on the simulated clock, which runs
+// `speed` times faster than CLOCK_MONOTONIC, so debounce durations scale
+// along with the charge times.
+struct simgpio_t
+{
+    int fd_timer;
+
+    int profile;
+    double lux;
+    double day_lux;
+    double night_lux;
+    double period_s;
+    double noise;
+    double speed;
+    double cap_uf;
+    double r10;
+    double gamma;
+    uint64_t rng;
+
+    int64_t base_ns;
+    int64_t charge_start_ns;
+    int64_t charge_ns;
+};
+
+
+static int64_t simgpio_real_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+static int64_t simgpio_now_ns(struct simgpio_t *sim)
+{
+    int64_t real_ns = simgpio_real_ns();
+    return sim->base_ns + (int64_t)((real_ns - sim->base_ns) * sim->speed);
+}
+
+
+static void simgpio_ns_to_timespec(int64_t ns, struct timespec *ts)
+{
+    ts->tv_sec = ns / 1000000000LL;
+    ts->tv_nsec = ns % 1000000000LL;
+}
+
+
+// xorshift64*, good enough for noise
+static double simgpio_uniform(struct simgpio_t *sim)
+{
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+    return ((sim->rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+static double simgpio_gaussian(struct simgpio_t *sim)
+{
+    double u1 = simgpio_uniform(sim);
+    double u2 = simgpio_uniform(sim);
+    if (u1 < 1e-12)
+        u1 = 1e-12;
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+
+static double simgpio_lux(struct simgpio_t *sim, int64_t now_ns)
+{
+    double t = (now_ns - sim->base_ns) / 1e9;
+    double phase = fmod(t, sim->period_s) / sim->period_s;
+    double elevation;
+
+    switch (sim->profile)
+    {
+        case SIMGPIO_PROFILE_DAY:
+            // starts at sunrise, sun is up for the first half of the period
+            elevation = sin(2.0 * M_PI * phase);
+            if (elevation <= 0.0)
+                return sim->night_lux;
+            return sim->night_lux + (sim->day_lux - sim->night_lux) * elevation;
+        case SIMGPIO_PROFILE_STEP:
+            return (phase < 0.5) ? sim->day_lux : sim->night_lux;
+        default:
+            return sim->lux;
+    }
+}
+
+
+static int64_t simgpio_charge_ns(struct simgpio_t *sim, int64_t now_ns)
+{
+    double lux = simgpio_lux(sim, now_ns);
+    double r, t;
+
+    if (lux < 1e-3)
+        lux = 1e-3;
+    r = sim->r10 * pow(lux / 10.0, -sim->gamma);
+    t = r * sim->cap_uf * 1e-6 * log(1.0 / (1.0 - SIMGPIO_DEFAULT_VTH_RATIO));
+    t *= 1.0 + sim->noise * simgpio_gaussian(sim);
+    if (t < 1e-6)
+        t = 1e-6;
+    return (int64_t)(t * 1e9);
+}
+
+
+static int simgpio_parse(struct simgpio_t *sim, const char *arg)
+{
+    char *buf, *token, *saveptr = NULL;
+    int ret = 0;
+
+    if ((arg == NULL) || (strlen(arg) == 0))
+        return 0;
+    buf = strdup(arg);
+    if (buf == NULL)
+        return -1;
+    for (token = strtok_r(buf, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(token, '=');
+        if (value == NULL) {
+            LOG_ERROR("Error: simulator option %s has no value\n", token);
+            ret = -1;
+            break;
+        }
+        *value++ = 0;
+        if (strcmp(token, "profile") == 0) {
+            if (strcmp(value, "const") == 0)
+                sim->profile = SIMGPIO_PROFILE_CONST;
+            else if (strcmp(value, "day") == 0)
+                sim->profile = SIMGPIO_PROFILE_DAY;
+            else if (strcmp(value, "step") == 0)
+                sim->profile = SIMGPIO_PROFILE_STEP;
+            else {
+                LOG_ERROR("Error: unknown simulator profile %s\n", value);
+                ret = -1;
+                break;
+            }
+        } else if (strcmp(token, "lux") == 0) {
+            sim->lux = atof(value);
+        } else if (strcmp(token, "day") == 0) {
+            sim->day_lux = atof(value);
+        } else if (strcmp(token, "night") == 0) {
+            sim->night_lux = atof(value);
+        } else if (strcmp(token, "period") == 0) {
+            sim->period_s = atof(value);
+        } else if (strcmp(token, "noise") == 0) {
+            sim->noise = atof(value);
+        } else if (strcmp(token, "speed") == 0) {
+            sim->speed = atof(value);
+        } else if (strcmp(token, "cap") == 0) {
+            sim->cap_uf = atof(value);
+        } else if (strcmp(token, "r10") == 0) {
+            sim->r10 = atof(value);
+        } else if (strcmp(token, "gamma") == 0) {
+            sim->gamma = atof(value);
+        } else if (strcmp(token, "seed") == 0) {
+            sim->rng = strtoull(value, NULL, 0);
+        } else {
+            LOG_ERROR("Error: unknown simulator option %s\n", token);
+            ret = -1;
+            break;
+        }
+    }
+    free(buf);
+
+    if (ret == 0) {
+        if (sim->speed < 1.0) {
+            LOG_ERROR("Error: simulator speed must be at least 1\n");
+            ret = -1;
+        } else if ((sim->period_s <= 0.0) || (sim->cap_uf <= 0.0) || (sim->r10 <= 0.0)) {
+            LOG_ERROR("Error: simulator period, cap and r10 must be positive\n");
+            ret = -1;
+        }
+    }
+    if (sim->rng == 0)
+        sim->rng = 1;
+    return ret;
+}
+
+
+static int simgpio_open(struct ldr_sensor_t *ldr, int gpio, const char *arg)
+{
+    struct simgpio_t *sim;
+
+    sim = malloc(sizeof(struct simgpio_t));
+    if (sim == NULL)
+        return -1;
+    memset(sim, 0, sizeof(struct simgpio_t));
+    sim->fd_timer = -1;
+    sim->profile = SIMGPIO_PROFILE_CONST;
+    sim->lux = SIMGPIO_DEFAULT_LUX;
+    sim->day_lux = SIMGPIO_DEFAULT_DAY_LUX;
+    sim->night_lux = SIMGPIO_DEFAULT_NIGHT_LUX;
+    sim->period_s = SIMGPIO_DEFAULT_PERIOD_S;
+    sim->noise = SIMGPIO_DEFAULT_NOISE;
+    sim->speed = SIMGPIO_DEFAULT_SPEED;
+    sim->cap_uf = SIMGPIO_DEFAULT_CAP_UF;
+    sim->r10 = SIMGPIO_DEFAULT_R10;
+    sim->gamma = SIMGPIO_DEFAULT_GAMMA;
+    // different pins get different noise unless a seed is given
+    sim->rng = 0x9E3779B97F4A7C15ULL ^ (uint64_t)gpio;
+    ldr->backend_data = sim;
+    ldr->gpio = gpio;
+
+    if (simgpio_parse(sim, arg))
+        return -1;
+
+    sim->fd_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (sim->fd_timer < 0) {
+        LOG_ERROR("Error: failed to create simulator timer\n");
+        return -1;
+    }
+    sim->base_ns = simgpio_real_ns();
+    return 0;
+}
+
+
+static void simgpio_close(struct ldr_sensor_t *ldr)
+{
+    struct simgpio_t *sim = (struct simgpio_t *)ldr->backend_data;
+
+    if (sim) {
+        if (sim->fd_timer >= 0)
+            close(sim->fd_timer);
+        free(sim);
+        ldr->backend_data = NULL;
+    }
+    ldr->gpio = -1;
+}
+
+
+static int simgpio_drain(struct ldr_sensor_t *ldr)
+{
+    struct simgpio_t *sim = (struct simgpio_t *)ldr->backend_data;
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    return timerfd_settime(sim->fd_timer, 0, &its, NULL);
+}
+
+
+static int simgpio_charge(struct ldr_sensor_t *ldr, struct timespec *start_time)
+{
+    struct simgpio_t *sim = (struct simgpio_t *)ldr->backend_data;
+    struct itimerspec its;
+    int64_t timeout_ns = (int64_t)ldr->charge_timeout_us * 1000LL;
+    int64_t real_ns;
+
+    sim->charge_start_ns = simgpio_now_ns(sim);
+    sim->charge_ns = simgpio_charge_ns(sim, sim->charge_start_ns);
+    simgpio_ns_to_timespec(sim->charge_start_ns, start_time);
+
+    // fire at the simulated edge, or at the timeout if the edge is later
+    real_ns = (int64_t)(((sim->charge_ns < timeout_ns) ? sim->charge_ns : timeout_ns) / sim->speed);
+    if (real_ns < 1)
+        real_ns = 1;
+    memset(&its, 0, sizeof(its));
+    simgpio_ns_to_timespec(real_ns, &its.it_value);
+    return timerfd_settime(sim->fd_timer, 0, &its, NULL);
+}
+
+
+static int simgpio_event_fd(struct ldr_sensor_t *ldr, short *events)
+{
+    struct simgpio_t *sim = (struct simgpio_t *)ldr->backend_data;
+    *events = POLLIN;
+    return sim->fd_timer;
+}
+
+
+static int simgpio_read_edge(struct ldr_sensor_t *ldr, struct timespec *edge_time)
+{
+    struct simgpio_t *sim = (struct simgpio_t *)ldr->backend_data;
+    int64_t timeout_ns = (int64_t)ldr->charge_timeout_us * 1000LL;
+    uint64_t expirations;
+
+    read(sim->fd_timer, &expirations, sizeof(expirations));
+    if (sim->charge_ns > timeout_ns) {
+        simgpio_ns_to_timespec(sim->charge_start_ns + timeout_ns, edge_time);
+        return 0;
+    }
+    simgpio_ns_to_timespec(sim->charge_start_ns + sim->charge_ns, edge_time);
+    return 1;
+}
+
+
+static void simgpio_clock(struct ldr_sensor_t *ldr, struct timespec *now)
+{
+    struct simgpio_t *sim = (struct simgpio_t *)ldr->backend_data;
+    simgpio_ns_to_timespec(simgpio_now_ns(sim), now);
+}
+
+
+const struct ldr_gpio_ops ldr_sim_ops =
+{
+    .name = "sim",
+    .open = simgpio_open,
+    .close = simgpio_close,
+    .drain = simgpio_drain,
+    .charge = simgpio_charge,
+    .event_fd = simgpio_event_fd,
+    .read_edge = simgpio_read_edge,
+    .clock = simgpio_clock,
+};
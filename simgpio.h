@@ -0,0 +1,52 @@
+/*
+ *    Filename: simgpio.h
+ * Description: Simulated RC circuit GPIO backend.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SIMGPIO_H_
+#define _SIMGPIO_H_
+
+#define SIMGPIO_PROFILE_CONST   0
+#define SIMGPIO_PROFILE_DAY     1
+#define SIMGPIO_PROFILE_STEP    2
+
+// Charge time in ms is roughly 0.69 * r10 * cap_uf / 1000 at 10 lux,
+// which puts the defaults at ~10 ms in daylight and ~250 ms at 0.1 lux.
+#define SIMGPIO_DEFAULT_LUX         10.0
+#define SIMGPIO_DEFAULT_DAY_LUX     1000.0
+#define SIMGPIO_DEFAULT_NIGHT_LUX   0.05
+#define SIMGPIO_DEFAULT_PERIOD_S    86400.0
+#define SIMGPIO_DEFAULT_NOISE       0.02
+#define SIMGPIO_DEFAULT_SPEED       1.0
+#define SIMGPIO_DEFAULT_CAP_UF      1.0
+#define SIMGPIO_DEFAULT_R10         15000.0
+#define SIMGPIO_DEFAULT_GAMMA       0.7
+#define SIMGPIO_DEFAULT_VTH_RATIO   0.5
+
+#define SIMGPIO_USAGE \
+    "                 Comma separated key=value list:\n" \
+    "                   profile=const|day|step  light profile (default const)\n" \
+    "                   lux=N        lux for the const profile\n" \
+    "                   day=N        daylight lux for day/step profiles\n" \
+    "                   night=N      night lux for day/step profiles\n" \
+    "                   period=N     day/step profile period in seconds\n" \
+    "                   noise=N      relative noise standard deviation\n" \
+    "                   speed=N      simulated seconds per real second (>= 1)\n" \
+    "                   cap=N r10=N gamma=N  capacitor uF, LDR ohms at 10 lux, slope\n" \
+    "                   seed=N       noise random seed\n" \
+    "                 Example: profile=day,period=600,speed=60,noise=0.05\n"
+
+
+#endif // _SIMGPIO_H_
@@ -26,16 +26,32 @@
 #include "sysfsgpio.h"
 
 #define PIN_BUFFER_SIZE 3
-#define MAX_PATH_BUFFER 40
+#define MAX_PATH_BUFFER 256
+
+static char gpio_root[MAX_PATH_BUFFER - 32] = GPIO_DEFAULT_ROOT;
+
+
+// the benchmarks point this at a fake tree with the same layout
+int gpio_set_root(const char *root)
+{
+    if (strlen(root) >= sizeof(gpio_root)) {
+        LOG_ERROR("Error: GPIO root path too long: %s\n", root);
+        return -1;
+    }
+    strcpy(gpio_root, root);
+    return 0;
+}
 
 
 int gpio_export(int pin)
 {
     char buffer[PIN_BUFFER_SIZE];
     ssize_t bytes_written;
+    char path[MAX_PATH_BUFFER];
     int fd;
 
-    fd = open("/sys/class/gpio/export", O_WRONLY);
+    snprintf(path, MAX_PATH_BUFFER, "%s/export", gpio_root);
+    fd = open(path, O_WRONLY);
     if (-1 == fd) {
         LOG_ERROR("Failed to open gpio export for writing!\n");
         return(-1);
@@ -51,9 +67,11 @@ int gpio_unexport(int pin)
 {
     char buffer[PIN_BUFFER_SIZE];
     ssize_t bytes_written;
+    char path[MAX_PATH_BUFFER];
     int fd;
 
-    fd = open("/sys/class/gpio/unexport", O_WRONLY);
+    snprintf(path, MAX_PATH_BUFFER, "%s/unexport", gpio_root);
+    fd = open(path, O_WRONLY);
     if (-1 == fd) {
         LOG_ERROR("Failed to open gpio unexport for writing!\n");
         return(-1);
@@ -70,7 +88,7 @@ int gpio_open_direction(int pin)
     char path[MAX_PATH_BUFFER];
     int fd;
 
-    snprintf(path, MAX_PATH_BUFFER, "/sys/class/gpio/gpio%d/direction", pin);
+    snprintf(path, MAX_PATH_BUFFER, "%s/gpio%d/direction", gpio_root, pin);
     fd = open(path, O_RDWR);
     if (-1 == fd)
         LOG_ERROR("Failed to open gpio direction!\n");
@@ -99,7 +117,7 @@ int gpio_open_edge(int pin)
     char path[MAX_PATH_BUFFER];
     int fd;
 
-    snprintf(path, MAX_PATH_BUFFER, "/sys/class/gpio/gpio%d/edge", pin);
+    snprintf(path, MAX_PATH_BUFFER, "%s/gpio%d/edge", gpio_root, pin);
     fd = open(path, O_RDWR);
     if (-1 == fd)
         LOG_ERROR("Failed to open gpio edge!\n");
@@ -140,7 +158,7 @@ int gpio_open_active_low(int pin)
     char path[MAX_PATH_BUFFER];
     int fd;
 
-    snprintf(path, MAX_PATH_BUFFER, "/sys/class/gpio/gpio%d/active_low", pin);
+    snprintf(path, MAX_PATH_BUFFER, "%s/gpio%d/active_low", gpio_root, pin);
     fd = open(path, O_RDWR);
     if (-1 == fd)
         LOG_ERROR("Failed to open gpio active_low!\n");
@@ -171,7 +189,7 @@ int gpio_open_value(int pin)
     char path[MAX_PATH_BUFFER];
     int fd;
 
-    snprintf(path, MAX_PATH_BUFFER, "/sys/class/gpio/gpio%d/value", pin);
+    snprintf(path, MAX_PATH_BUFFER, "%s/gpio%d/value", gpio_root, pin);
     fd = open(path, O_RDWR);
     if (-1 == fd)
         LOG_ERROR("Failed to open gpio value!\n");
@@ -264,12 +282,20 @@ int gpio_wait_for_interrupt(int pin, int timeout_ms)
     return ret;
 }
 
+static uint64_t write_errors = 0;
+
+uint64_t gpio_write_error_count(void)
+{
+    return write_errors;
+}
+
 int gpio_write_string(int fd, const char *str, const char *filename)
 {
     if (-1 == write(fd, str, strlen(str))) {
+        write_errors++;
         LOG_ERROR("Failed to set gpio %s!\n", filename);
         return(-1);
     }
-    fsync(fd);
+    // sysfs attributes take effect on write(), fsync() only costs a syscall
     return 0;
 }
@@ -19,6 +19,8 @@
 #define _SYSFSGPIO_H_
 
 
+#define GPIO_DEFAULT_ROOT   "/sys/class/gpio"
+
 #define GPIO_IN  0
 #define GPIO_OUT 1
 
@@ -33,7 +35,10 @@
 #define GPIO_ACTIVE_HIGH    0
 #define GPIO_ACTIVE_LOW     1
 
+#include <stdint.h>
+
 
+int gpio_set_root(const char *root);
 int gpio_export(int pin);
 int gpio_unexport(int pin);
 int gpio_open_direction(int pin);
@@ -48,6 +53,7 @@ int gpio_write(int pin, int value);
 int gpio_wait_for_interrupt_fd(int fd, int timeout_ms);
 int gpio_wait_for_interrupt(int pin, int timeout_ms);
 int gpio_write_string(int fd, const char *str, const char *filename);
+uint64_t gpio_write_error_count(void);
 
 
 #endif // _SYSFSGPIO_H_
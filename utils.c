@@ -47,3 +47,37 @@ void udelay(unsigned s)
     tv.tv_usec = s%1000000;
     select (0,NULL,NULL,NULL, &tv);
 }
+
+int64_t timespec_diff_us(const struct timespec *end, const struct timespec *start)
+{
+    return (int64_t)(end->tv_sec - start->tv_sec) * 1000000 + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+int64_t timespec_diff_ms(const struct timespec *end, const struct timespec *start)
+{
+    return (int64_t)(end->tv_sec - start->tv_sec) * 1000 + (end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+int loglin_bucket(uint64_t value, int sub_bits, int max_bits)
+{
+    int shift;
+
+    if (value < ((uint64_t)1 << sub_bits))
+        return (int)value;
+    if (value >= ((uint64_t)1 << max_bits))
+        value = ((uint64_t)1 << max_bits) - 1;
+    // keep the top sub_bits bits
+    shift = 63 - __builtin_clzll(value) - (sub_bits - 1);
+    return (shift << (sub_bits - 1)) + (int)(value >> shift);
+}
+
+uint64_t loglin_bucket_min(int bucket, int sub_bits)
+{
+    int half = 1 << (sub_bits - 1);
+    int shift;
+
+    if (bucket < (1 << sub_bits))
+        return bucket;
+    shift = bucket / half - 1;
+    return (uint64_t)(bucket - shift * half) << shift;
+}
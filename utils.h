@@ -20,6 +20,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <time.h>
 
 typedef enum
 {
@@ -44,6 +45,18 @@ void print_hex_bytes(FILE *stream, const uint8_t *buffer, int len);
 
 void udelay(unsigned s);
 
+int64_t timespec_diff_us(const struct timespec *end, const struct timespec *start);
+int64_t timespec_diff_ms(const struct timespec *end, const struct timespec *start);
+
+// Log-linear buckets: values below 2^sub_bits get one bucket each, above
+// that every power of two is split into 2^(sub_bits-1) buckets. With 5
+// sub bits that is 16 buckets per octave, 3 to 6% wide. Values are capped
+// at 2^max_bits - 1.
+#define LOGLIN_BUCKETS(sub_bits, max_bits)  ((((max_bits) - (sub_bits)) + 2) << ((sub_bits) - 1))
+int loglin_bucket(uint64_t value, int sub_bits, int max_bits);
+// lowest value that lands in the bucket
+uint64_t loglin_bucket_min(int bucket, int sub_bits);
+
 
 extern log_level_t _log_level;
 